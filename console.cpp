@@ -280,6 +280,34 @@ static ConsoleCommand help("help", "help", "lists all commands",
                              }
                            });
 
+static ConsoleCommand sched_pacing(
+    "sched_pacing", "sched_pacing",
+    "logs the frame pacing of every scheduler job",
+    [](Game* game, ConsoleArgReader r) {
+      if (game->getWorld()) {
+        Log::printf(LOG_INFO, "Client:");
+        game->getWorld()->getScheduler()->logPacingReport();
+      }
+      if (game->getServerWorld()) {
+        Log::printf(LOG_INFO, "Server:");
+        game->getServerWorld()->getScheduler()->logPacingReport();
+      }
+    });
+
+static ConsoleCommand sched_latency(
+    "sched_latency", "sched_latency",
+    "logs the step time percentiles and overruns of every scheduler job",
+    [](Game* game, ConsoleArgReader r) {
+      if (game->getWorld()) {
+        Log::printf(LOG_INFO, "Client:");
+        game->getWorld()->getScheduler()->logLatencyReport();
+      }
+      if (game->getServerWorld()) {
+        Log::printf(LOG_INFO, "Server:");
+        game->getServerWorld()->getScheduler()->logLatencyReport();
+      }
+    });
+
 static ConsoleCommand exit("exit", "exit", "quits the game",
                            [](Game* game, ConsoleArgReader r) {
                              if (game->getWorld())
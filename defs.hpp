@@ -4,4 +4,4 @@
 // MM - major, mm - minor, RR - revision
 
 #define ENGINE_VERSION 0x003800
-#define PROTOCOL_VERSION 0x010002
+#define PROTOCOL_VERSION 0x010009
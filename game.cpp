@@ -213,6 +213,9 @@ class GameEventJob : public SchedulerJob {
   }
 
   virtual double getFrameRate() { return 1.0 / input_rate.getFloat(); }
+
+  // SDL wants events pumped from a consistent thread
+  virtual bool isThreadAffine() { return true; }
 };
 
 void Game::earlyInit() {
@@ -136,6 +136,9 @@ class RenderJob : public SchedulerJob {
 
   virtual void shutdown() { engine->context->unsetCurrent(); }
 
+  // the GL context is current on one thread only
+  virtual bool isThreadAffine() { return true; }
+
   virtual Result step() {
 #ifndef DISABLE_EASY_PROFILER
     EASY_FUNCTION();
@@ -0,0 +1,265 @@
+#include <enet/enet.h>
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <unordered_map>
+
+#include "defs.hpp"
+#include "logging.hpp"
+#include "network/capture.hpp"
+#include "network/network.hpp"
+
+// replays captures of a server's traffic by connecting one client per peer in
+// the capture and sending what that peer sent, at the same pace or as fast as
+// the server takes it
+
+#define NETREPLAY_MAX_PEERS 1024
+
+using namespace rdm;
+using namespace rdm::network;
+
+struct ReplayPeer {
+  ENetPeer* peer = NULL;
+  bool connected = false;
+  bool disconnecting = false;
+  // channel and packet, sent once connected
+  std::deque<std::pair<int, ENetPacket*>> queued;
+};
+
+struct ReplayStats {
+  size_t packetsSent = 0;
+  size_t bytesSent = 0;
+  size_t packetsReceived = 0;
+  size_t bytesReceived = 0;
+  // what the server sent in the capture, to compare against
+  size_t recordedBytesSent = 0;
+  size_t skipped = 0;
+  float recordedTime = 0.f;
+};
+
+class Replay {
+  ENetHost* host;
+  ENetAddress address;
+  std::unordered_map<int, ReplayPeer> peers;
+  std::unordered_map<ENetPeer*, int> peerIds;
+  ReplayStats stats;
+
+  void handle(CapturedPacket& record) {
+    stats.recordedTime = record.time;
+    switch (record.type) {
+      case CapturedPacket::Connect: {
+        ReplayPeer& peer = peers[record.peerId];
+        peer.peer = enet_host_connect(host, &address, 2, 0);
+        if (!peer.peer) throw std::runtime_error("enet_host_connect failed");
+        peerIds[peer.peer] = record.peerId;
+      } break;
+      case CapturedPacket::Receive: {
+        auto it = peers.find(record.peerId);
+        if (it == peers.end() || it->second.disconnecting) {
+          // connected before the capture started
+          stats.skipped++;
+          break;
+        }
+        ENetPacket* packet = enet_packet_create(
+            record.data.data(), record.data.size(), record.flags);
+        if (it->second.connected)
+          enet_peer_send(it->second.peer, record.channel, packet);
+        else
+          it->second.queued.push_back({record.channel, packet});
+        stats.packetsSent++;
+        stats.bytesSent += record.data.size();
+      } break;
+      case CapturedPacket::Send:
+        stats.recordedBytesSent += record.data.size();
+        break;
+      case CapturedPacket::Disconnect: {
+        auto it = peers.find(record.peerId);
+        if (it == peers.end()) break;
+        it->second.disconnecting = true;
+        if (it->second.connected)
+          enet_peer_disconnect_later(it->second.peer,
+                                     NETWORK_DISCONNECT_USER);
+      } break;
+    }
+  }
+
+  void service(int timeout) {
+    ENetEvent event;
+    while (enet_host_service(host, &event, timeout) > 0) {
+      timeout = 0;
+      auto it = peerIds.find(event.peer);
+      if (it == peerIds.end()) continue;
+      ReplayPeer& peer = peers[it->second];
+
+      switch (event.type) {
+        case ENET_EVENT_TYPE_CONNECT:
+          peer.connected = true;
+          for (auto& queued : peer.queued)
+            enet_peer_send(peer.peer, queued.first, queued.second);
+          peer.queued.clear();
+          if (peer.disconnecting)
+            enet_peer_disconnect_later(peer.peer, NETWORK_DISCONNECT_USER);
+          break;
+        case ENET_EVENT_TYPE_RECEIVE:
+          stats.packetsReceived++;
+          stats.bytesReceived += event.packet->dataLength;
+          enet_packet_destroy(event.packet);
+          break;
+        case ENET_EVENT_TYPE_DISCONNECT: {
+          for (auto& queued : peer.queued) enet_packet_destroy(queued.second);
+          int peerId = it->second;
+          peerIds.erase(it);
+          peers.erase(peerId);
+        } break;
+        default:
+          break;
+      }
+    }
+  }
+
+ public:
+  Replay(std::string hostname, int port) {
+    enet_address_set_host(&address, hostname.c_str());
+    address.port = port;
+    host = enet_host_create(NULL, NETREPLAY_MAX_PEERS,
+                            NETWORK_STREAM_MAX, 0, 0);
+    if (!host) throw std::runtime_error("enet_host_create returned NULL");
+  }
+
+  ~Replay() { enet_host_destroy(host); }
+
+  /**
+   * @param speed Multiplier of the capture's pace, 0 sends every packet as
+   * soon as the server is connected
+   */
+  void run(PacketCaptureReader& reader, float speed) {
+    auto start = std::chrono::steady_clock::now();
+    CapturedPacket record;
+    bool more = reader.next(record);
+    while (more) {
+      float elapsed = std::chrono::duration<float>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+      // a handful of records between services when going as fast as possible
+      for (int i = 0; more && (speed > 0.f ? record.time <= elapsed * speed
+                                           : i < 64);
+           i++) {
+        handle(record);
+        more = reader.next(record);
+      }
+      service(1);
+    }
+
+    // let the server drain what is still in flight
+    for (auto& peer : peers)
+      if (peer.second.connected && !peer.second.disconnecting)
+        enet_peer_disconnect_later(peer.second.peer, NETWORK_DISCONNECT_USER);
+    auto drainStart = std::chrono::steady_clock::now();
+    while (!peers.empty() &&
+           std::chrono::steady_clock::now() - drainStart <
+               std::chrono::seconds(10))
+      service(1);
+
+    float replayTime = std::chrono::duration<float>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    Log::printf(LOG_INFO, "Replayed %0.2fs of capture in %0.2fs",
+                stats.recordedTime, replayTime);
+    Log::printf(LOG_INFO, "Sent %zu packets, %zu bytes (%0.1f KiB/s)",
+                stats.packetsSent, stats.bytesSent,
+                stats.bytesSent / 1024.f / replayTime);
+    Log::printf(LOG_INFO,
+                "Received %zu packets, %zu bytes (%0.1f KiB/s), %zu bytes in "
+                "the capture",
+                stats.packetsReceived, stats.bytesReceived,
+                stats.bytesReceived / 1024.f / replayTime,
+                stats.recordedBytesSent);
+    if (stats.skipped)
+      Log::printf(LOG_WARN,
+                  "Skipped %zu packets from peers that connected before the "
+                  "capture started",
+                  stats.skipped);
+  }
+};
+
+// per channel totals of each direction
+static void printInfo(PacketCaptureReader& reader) {
+  size_t packets[2][256] = {}, bytes[2][256] = {};
+  int connects = 0;
+  float time = 0.f;
+  CapturedPacket record;
+  while (reader.next(record)) {
+    time = record.time;
+    if (record.type == CapturedPacket::Connect) connects++;
+    if (record.type != CapturedPacket::Receive &&
+        record.type != CapturedPacket::Send)
+      continue;
+    int direction = record.type == CapturedPacket::Send;
+    packets[direction][record.channel]++;
+    bytes[direction][record.channel] += record.data.size();
+  }
+
+  Log::printf(LOG_INFO, "%s capture, %0.2fs, %i connections",
+              reader.isBackend() ? "Server" : "Client", time, connects);
+  for (int direction = 0; direction < 2; direction++)
+    for (int channel = 0; channel < 256; channel++)
+      if (packets[direction][channel])
+        Log::printf(LOG_INFO, "%s channel %i: %zu packets, %zu bytes",
+                    direction ? "Sent" : "Received", channel,
+                    packets[direction][channel], bytes[direction][channel]);
+}
+
+int main(int argc, char** argv) {
+  namespace po = boost::program_options;
+  po::options_description desc("Allowed options");
+  desc.add_options()("help,h", "produce help message")(
+      "capture,c", po::value<std::string>(), "capture file from net_capture")(
+      "address,a", po::value<std::string>()->default_value("127.0.0.1"),
+      "server to replay against")(
+      "port,p", po::value<int>()->default_value(7938), "server port")(
+      "speed,s", po::value<float>()->default_value(1.f),
+      "pace of the replay, 2 is twice as fast, 0 is as fast as possible")(
+      "info,i", "show what is in the capture instead of replaying it");
+  po::positional_options_description positional;
+  positional.add("capture", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv)
+                .options(desc)
+                .positional(positional)
+                .run(),
+            vm);
+  po::notify(vm);
+
+  if (vm.count("help") || !vm.count("capture")) {
+    std::cout << desc << "\n";
+    return EXIT_FAILURE;
+  }
+
+  try {
+    PacketCaptureReader reader(vm["capture"].as<std::string>());
+    if (vm.count("info")) {
+      printInfo(reader);
+      return EXIT_SUCCESS;
+    }
+
+    if (!reader.isBackend())
+      throw std::runtime_error("Capture was recorded on a client");
+    if (reader.getProtocolVersion() != PROTOCOL_VERSION)
+      Log::printf(LOG_WARN, "Capture is from protocol %06x, this is %06x",
+                  reader.getProtocolVersion(), PROTOCOL_VERSION);
+
+    NetworkManager::initialize();
+    {
+      Replay replay(vm["address"].as<std::string>(), vm["port"].as<int>());
+      replay.run(reader, vm["speed"].as<float>());
+    }
+    NetworkManager::deinitialize();
+  } catch (std::exception& e) {
+    Log::printf(LOG_FATAL, "%s", e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -2,38 +2,104 @@
 
 #include <enet/enet.h>
 #include <enet/types.h>
+#include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <stdexcept>
 
 #include "crc_hash.hpp"
 #include "logging.hpp"
 
+// buffers of finished streams are kept per thread for the next stream, since
+// NetworkManager::service builds and drops several streams per peer per tick
+#define BITSTREAM_POOL_SIZE 64
+#define BITSTREAM_POOL_MAX_BUFFER 65536
+#define BITSTREAM_MIN_BUFFER 256
+
 namespace rdm::network {
+namespace {
+struct BufferPool {
+  std::vector<std::pair<char*, size_t>> buffers;
+
+  ~BufferPool() {
+    for (auto& buffer : buffers) free(buffer.first);
+  }
+};
+
+thread_local BufferPool bufferPool;
+
+char* acquireBuffer(size_t& size) {
+  size = std::max(size, (size_t)BITSTREAM_MIN_BUFFER);
+  if (bufferPool.buffers.empty()) return (char*)malloc(size);
+
+  std::pair<char*, size_t> buffer = bufferPool.buffers.back();
+  bufferPool.buffers.pop_back();
+  if (buffer.second < size) return (char*)realloc(buffer.first, size);
+  size = buffer.second;
+  return buffer.first;
+}
+
+void releaseBuffer(char* buffer, size_t size) {
+  if (bufferPool.buffers.size() < BITSTREAM_POOL_SIZE &&
+      size <= BITSTREAM_POOL_MAX_BUFFER)
+    bufferPool.buffers.push_back({buffer, size});
+  else
+    free(buffer);
+}
+
+void ENET_CALLBACK releasePacketBuffer(ENetPacket* packet) {
+  releaseBuffer((char*)packet->data, (size_t)packet->userData);
+}
+}  // namespace
+
 BitStream::BitStream() {
   data = 0;
   c = 0;
+  bit = 0;
   size = 0;
+  owned = true;
 }
 BitStream::BitStream(BitStream& stream) {
-  data = (char*)malloc(stream.size);
   c = 0;
+  bit = 0;
+  owned = true;
   size = stream.size;
-  memcpy(data, stream.data, size);
+  data = acquireBuffer(size);
+  memcpy(data, stream.data, stream.size);
 }
 BitStream::BitStream(void* data, size_t size) {
-  this->data = (char*)malloc(size);
   this->c = 0;
+  this->bit = 0;
+  this->owned = true;
   this->size = size;
   this->ctxt = Generic;
+  this->data = acquireBuffer(this->size);
   memcpy(this->data, data, size);
 }
 
 BitStream::~BitStream() {
-  if (data) free(data);
+  if (data && owned) releaseBuffer(data, size);
 }
 
+BitStreamView::BitStreamView(ENetPacket* packet) {
+  this->packet = packet;
+  data = (char*)packet->data;
+  size = packet->dataLength;
+  owned = false;
+  setContext(Generic);
+}
+
+BitStreamView::~BitStreamView() { enet_packet_destroy(packet); }
+
 void BitStream::makeSpaceFor(size_t s) {
+  if (!owned) {
+    size_t used = size;
+    char* copy = acquireBuffer(size);
+    memcpy(copy, data, used);
+    data = copy;
+    owned = true;
+  }
   if (size) {
     if (s + c > size) {
       size_t newSize = size * 2;
@@ -42,10 +108,12 @@ void BitStream::makeSpaceFor(size_t s) {
     }
   } else {
     size = s;
-    data = (char*)malloc(size);
+    data = acquireBuffer(size);
   }
 }
 
+void BitStream::reserve(size_t s) { makeSpaceFor(s); }
+
 bool BitStream::isSpaceFor(size_t s) {
   if (s + c > size) {
     return false;
@@ -55,26 +123,179 @@ bool BitStream::isSpaceFor(size_t s) {
 }
 
 void BitStream::writeStream(const BitStream& stream) {
-  for (int i = 0; i < stream.size - stream.c; i++) write<char>(stream.data[i]);
+  writeBytes(stream.data, stream.c);
+}
+
+void BitStream::writeBytes(const void* bytes, size_t count) {
+  bit = 0;
+  makeSpaceFor(count);
+  memcpy(&data[c], bytes, count);
+  c += count;
 }
 
 void BitStream::writeString(std::string s) {
   write<uint16_t>(s.size());
-  for (int i = 0; i < s.size(); i++) write<char>(s[i]);
+  writeBytes(s.data(), s.size());
 }
 
 std::string BitStream::readString() {
-  std::string s;
   uint16_t size = read<uint16_t>();
-  s.resize(size);
-  for (int i = 0; i < size; i++) s[i] = read<char>();
+  if (!isSpaceFor(size)) throw BitStreamException("Out of space on bitstream");
+  std::string s(&data[c], size);
+  c += size;
   return s;
 }
 
+void BitStream::readBytes(void* out, size_t count) {
+  bit = 0;
+  if (!isSpaceFor(count)) throw BitStreamException("Out of space on bitstream");
+  memcpy(out, &data[c], count);
+  c += count;
+}
+
+void BitStream::writeBits(uint64_t value, int bits) {
+  while (bits > 0) {
+    if (bit == 0) {
+      makeSpaceFor(1);
+      data[c++] = 0;
+    }
+    int n = std::min(bits, 8 - bit);
+    data[c - 1] |= (char)((value & ((1u << n) - 1)) << bit);
+    value >>= n;
+    bits -= n;
+    bit = (bit + n) % 8;
+  }
+}
+
+uint64_t BitStream::readBits(int bits) {
+  uint64_t value = 0;
+  int shift = 0;
+  while (bits > 0) {
+    if (bit == 0) {
+      if (!isSpaceFor(1)) throw BitStreamException("Out of space on bitstream");
+      c++;
+    }
+    int n = std::min(bits, 8 - bit);
+    value |= (uint64_t)(((unsigned char)data[c - 1] >> bit) & ((1u << n) - 1))
+             << shift;
+    shift += n;
+    bits -= n;
+    bit = (bit + n) % 8;
+  }
+  return value;
+}
+
+void BitStream::writeVarInt(uint64_t value) {
+  do {
+    writeBits(value & 0x7f, 7);
+    value >>= 7;
+    writeBool(value != 0);
+  } while (value);
+}
+
+uint64_t BitStream::readVarInt() {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    value |= readBits(7) << shift;
+    if (!readBool()) return value;
+  }
+  throw BitStreamException("Malformed varint on bitstream");
+}
+
+void BitStream::writeVarSInt(int64_t value) {
+  writeVarInt(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+int64_t BitStream::readVarSInt() {
+  uint64_t value = readVarInt();
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+void BitStream::writeQuantizedFloat(float value, float min, float max,
+                                    int bits) {
+  double steps = (double)((1ull << bits) - 1);
+  double t = std::clamp((value - min) / (double)(max - min), 0.0, 1.0);
+  writeBits((uint64_t)round(t * steps), bits);
+}
+
+float BitStream::readQuantizedFloat(float min, float max, int bits) {
+  double steps = (double)((1ull << bits) - 1);
+  return min + (max - min) * (readBits(bits) / steps);
+}
+
+static glm::vec2 octahedralWrap(glm::vec2 v) {
+  return (1.f - glm::abs(glm::vec2(v.y, v.x))) *
+         glm::vec2(v.x >= 0.f ? 1.f : -1.f, v.y >= 0.f ? 1.f : -1.f);
+}
+
+void BitStream::writeNormal(glm::vec3 normal, int bits) {
+  float l1 = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+  glm::vec2 p = l1 == 0.f ? glm::vec2(0.f) : glm::vec2(normal) / l1;
+  if (normal.z < 0.f) p = octahedralWrap(p);
+  writeQuantizedFloat(p.x, -1.f, 1.f, bits);
+  writeQuantizedFloat(p.y, -1.f, 1.f, bits);
+}
+
+glm::vec3 BitStream::readNormal(int bits) {
+  glm::vec2 p;
+  p.x = readQuantizedFloat(-1.f, 1.f, bits);
+  p.y = readQuantizedFloat(-1.f, 1.f, bits);
+  glm::vec3 normal(p, 1.f - fabsf(p.x) - fabsf(p.y));
+  if (normal.z < 0.f) {
+    glm::vec2 wrapped = octahedralWrap(p);
+    normal.x = wrapped.x;
+    normal.y = wrapped.y;
+  }
+  return glm::normalize(normal);
+}
+
+void BitStream::writeQuat(glm::quat quat, int bits) {
+  quat = glm::normalize(quat);
+  float c[4] = {quat.x, quat.y, quat.z, quat.w};
+  int largest = 0;
+  for (int i = 1; i < 4; i++)
+    if (fabsf(c[i]) > fabsf(c[largest])) largest = i;
+  // q and -q are the same rotation, so the left out component is always
+  // positive and can be rebuilt from the other three
+  float sign = c[largest] < 0.f ? -1.f : 1.f;
+
+  writeBits(largest, 2);
+  for (int i = 0; i < 4; i++)
+    if (i != largest)
+      writeQuantizedFloat(c[i] * sign, -M_SQRT1_2, M_SQRT1_2, bits);
+}
+
+glm::quat BitStream::readQuat(int bits) {
+  int largest = readBits(2);
+  float c[4];
+  float sum = 0.f;
+  for (int i = 0; i < 4; i++) {
+    if (i == largest) continue;
+    c[i] = readQuantizedFloat(-M_SQRT1_2, M_SQRT1_2, bits);
+    sum += c[i] * c[i];
+  }
+  c[largest] = sqrtf(std::max(0.f, 1.f - sum));
+  return glm::normalize(glm::quat(c[3], c[0], c[1], c[2]));
+}
+
 ENetPacket* BitStream::createPacket(enet_uint32 flags) {
   return enet_packet_create(data, c, flags);
 }
 
+ENetPacket* BitStream::releasePacket(enet_uint32 flags) {
+  if (!owned || !data) return createPacket(flags);
+
+  ENetPacket* packet =
+      enet_packet_create(data, c, flags | ENET_PACKET_FLAG_NO_ALLOCATE);
+  packet->userData = (void*)size;
+  packet->freeCallback = releasePacketBuffer;
+  data = 0;
+  size = 0;
+  c = 0;
+  bit = 0;
+  return packet;
+}
+
 std::vector<unsigned char> BitStream::getDataVec() {
   std::vector<unsigned char> data;
   data.resize(c);
@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <logging.hpp>
 #include <string>
 #include <typeinfo>
@@ -15,14 +17,27 @@ class BitStreamException : public std::runtime_error {
   BitStreamException(const char* msg) : std::runtime_error(msg) {}
 };
 
+/**
+ * @brief A stream of packed network data.
+ *
+ * write/read work on whole bytes. writeBits and the helpers built on it pack
+ * values at bit granularity into the last byte; the next write<T> or read<T>
+ * starts on a fresh byte, so both kinds can be mixed as long as the reader
+ * reads in the same order the writer wrote.
+ */
 class BitStream {
+ protected:
   char* data;
   size_t size;
   size_t c;
+  int bit;     // bits already used in the last byte, 0 when byte aligned
+  bool owned;  // false when data belongs to someone else, see BitStreamView
 
   bool isSpaceFor(size_t s);
   void makeSpaceFor(size_t s);
 
+ private:
+
  public:
   enum Context {
     Generic,
@@ -45,12 +60,21 @@ class BitStream {
 
   void* getData() { return data; }
   size_t getSize() { return c; }
+  // what is left to read, whole bytes for read/readBytes and bits for readBits
+  size_t getBytesLeft() { return size - c; }
+  size_t getBitsLeft() { return (size - c) * 8 + (bit ? 8 - bit : 0); }
+  // empties the stream but keeps its buffer for the next write
+  void clear() {
+    c = 0;
+    bit = 0;
+  }
 
   BitStream(void* data, size_t size);
   BitStream(BitStream& stream);
 
   template <typename T>
   void write(T t) {
+    bit = 0;
     makeSpaceFor(sizeof(T));
     memcpy(&data[c], &t, sizeof(T));
     c += sizeof(T);
@@ -62,6 +86,7 @@ class BitStream {
       const std::source_location location = std::source_location::current()
 #endif
   ) {
+    bit = 0;
     if (!isSpaceFor(sizeof(T))) {
       rdm::Log::printf(LOG_ERROR, "No space for type %s", typeid(T).name());
 #ifndef NDEBUG
@@ -76,12 +101,71 @@ class BitStream {
     return t;
   }
 
+  /**
+   * @brief Makes room for at least s more bytes, so the stream does not have
+   * to grow while it is being written.
+   */
+  void reserve(size_t s);
+
   void writeStream(const BitStream& stream);
+  void writeBytes(const void* bytes, size_t count);
+
+  /**
+   * @brief Writes the low bits of value.
+   *
+   * @param bits Between 1 and 64.
+   */
+  void writeBits(uint64_t value, int bits);
+  uint64_t readBits(int bits);
+
+  void writeBool(bool b) { writeBits(b, 1); }
+  bool readBool() { return readBits(1); }
+
+  /**
+   * @brief Writes an integer in 8 bit groups, small values take less space.
+   */
+  void writeVarInt(uint64_t value);
+  uint64_t readVarInt();
+  void writeVarSInt(int64_t value);  // zigzag encoded
+  int64_t readVarSInt();
+
+  /**
+   * @brief Writes value clamped to [min, max] in the given number of bits.
+   */
+  void writeQuantizedFloat(float value, float min, float max, int bits);
+  float readQuantizedFloat(float min, float max, int bits);
+
+  /**
+   * @brief Writes a unit vector using octahedral encoding, two components of
+   * bits each.
+   */
+  void writeNormal(glm::vec3 normal, int bits = 12);
+  glm::vec3 readNormal(int bits = 12);
+
+  /**
+   * @brief Writes a rotation as its three smallest components of bits each,
+   * plus 2 bits for which component was left out.
+   */
+  void writeQuat(glm::quat quat, int bits = 10);
+  glm::quat readQuat(int bits = 10);
 
   void writeString(std::string s);
   std::string readString();
 
+  void readBytes(void* out, size_t count);
+  template <typename T>
+  void readArray(T* out, size_t count) {
+    readBytes(out, sizeof(T) * count);
+  }
+
   ENetPacket* createPacket(enet_uint32 flags);
+  /**
+   * @brief Hands the stream's buffer to a new packet without copying it.
+   *
+   * The stream is left empty. The buffer returns to the pool once ENet is done
+   * with the packet.
+   */
+  ENetPacket* releasePacket(enet_uint32 flags);
   std::vector<unsigned char> getDataVec();
 
   Context getContext() { return ctxt; }
@@ -89,5 +173,23 @@ class BitStream {
 
  private:
   Context ctxt;
-};  // namespace rdm::network
+};
+
+/**
+ * @brief Reads a received packet in place instead of copying it out.
+ *
+ * The view owns the packet from then on and destroys it along with itself, so
+ * keep it alive until parsing is done. Writing to a view copies the data
+ * first.
+ */
+class BitStreamView : public BitStream {
+  ENetPacket* packet;
+
+ public:
+  BitStreamView(ENetPacket* packet);
+  ~BitStreamView();
+
+  BitStreamView(const BitStreamView&) = delete;
+  BitStreamView& operator=(const BitStreamView&) = delete;
+};
 }  // namespace rdm::network
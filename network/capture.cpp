@@ -0,0 +1,128 @@
+#include "capture.hpp"
+
+#include <stdexcept>
+
+#include "defs.hpp"
+#include "logging.hpp"
+
+namespace rdm::network {
+// what precedes the data of each record
+struct CaptureRecordHeader {
+  float time;
+  int32_t peerId;
+  uint32_t size;
+  uint8_t type;
+  uint8_t channel;
+  uint8_t flags;
+} __attribute__((packed));
+
+struct CaptureFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t protocolVersion;
+  uint8_t backend;
+} __attribute__((packed));
+
+PacketCapture::PacketCapture() {
+  file = NULL;
+  recording = false;
+  packets = 0;
+  bytes = 0;
+}
+
+PacketCapture::~PacketCapture() { close(); }
+
+void PacketCapture::open(const std::string& path, bool backend) {
+  close();
+
+  std::scoped_lock l(mutex);
+  file = fopen(path.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("Could not open capture file " + path);
+
+  CaptureFileHeader header;
+  header.magic = PACKET_CAPTURE_MAGIC;
+  header.version = PACKET_CAPTURE_VERSION;
+  header.protocolVersion = PROTOCOL_VERSION;
+  header.backend = backend;
+  fwrite(&header, sizeof(header), 1, file);
+
+  start = std::chrono::steady_clock::now();
+  packets = 0;
+  bytes = 0;
+  recording = true;
+  Log::printf(LOG_INFO, "Capturing packets to %s", path.c_str());
+}
+
+void PacketCapture::close() {
+  std::scoped_lock l(mutex);
+  if (!file) return;
+  recording = false;
+  fclose(file);
+  file = NULL;
+  Log::printf(LOG_INFO, "Captured %zu packets, %zu bytes", packets, bytes);
+}
+
+void PacketCapture::record(CapturedPacket::Type type, int peerId,
+                           int channel, int flags, const void* data,
+                           size_t size) {
+  std::scoped_lock l(mutex);
+  if (!file) return;
+
+  CaptureRecordHeader header;
+  header.time = std::chrono::duration<float>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+  header.peerId = peerId;
+  header.size = size;
+  header.type = type;
+  header.channel = channel;
+  header.flags = flags;
+  fwrite(&header, sizeof(header), 1, file);
+  if (size) fwrite(data, size, 1, file);
+
+  if (type == CapturedPacket::Receive || type == CapturedPacket::Send) {
+    packets++;
+    bytes += size;
+  }
+}
+
+PacketCaptureReader::PacketCaptureReader(const std::string& path) {
+  file = fopen(path.c_str(), "rb");
+  if (!file)
+    throw std::runtime_error("Could not open capture file " + path);
+
+  CaptureFileHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      header.magic != PACKET_CAPTURE_MAGIC) {
+    fclose(file);
+    throw std::runtime_error(path + " is not a packet capture");
+  }
+  if (header.version != PACKET_CAPTURE_VERSION) {
+    fclose(file);
+    throw std::runtime_error(path + " is from an unsupported capture version");
+  }
+  protocolVersion = header.protocolVersion;
+  backend = header.backend;
+}
+
+PacketCaptureReader::~PacketCaptureReader() { fclose(file); }
+
+bool PacketCaptureReader::next(CapturedPacket& packet) {
+  CaptureRecordHeader header;
+  size_t read = fread(&header, 1, sizeof(header), file);
+  if (read == 0) return false;
+  if (read != sizeof(header))
+    throw std::runtime_error("Capture record header cut short");
+
+  packet.type = (CapturedPacket::Type)header.type;
+  packet.time = header.time;
+  packet.peerId = header.peerId;
+  packet.channel = header.channel;
+  packet.flags = header.flags;
+  packet.data.resize(header.size);
+  if (header.size && fread(packet.data.data(), header.size, 1, file) != 1)
+    throw std::runtime_error("Capture record data cut short");
+  return true;
+}
+}  // namespace rdm::network
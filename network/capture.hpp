@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// "RDCP"
+#define PACKET_CAPTURE_MAGIC 0x50434452
+#define PACKET_CAPTURE_VERSION 1
+
+namespace rdm::network {
+/**
+ * @brief One record of a packet capture.
+ */
+struct CapturedPacket {
+  enum Type : uint8_t {
+    Connect,
+    Disconnect,
+    Receive,
+    Send,
+  };
+
+  Type type;
+  float time;      // seconds since the capture started
+  int32_t peerId;  // the remote peer's id on servers, -1 on clients
+  uint8_t channel;
+  uint8_t flags;  // ENET_PACKET_FLAG_*
+  std::vector<unsigned char> data;
+};
+
+/**
+ * @brief Records the packets a NetworkManager sends and receives to a file,
+ * see NetworkManager::startCapture and the netreplay tool.
+ *
+ * The file starts with the magic, PACKET_CAPTURE_VERSION, PROTOCOL_VERSION
+ * and whether it was recorded on a server, followed by one record per event:
+ * time, type, peer id, channel, flags, size and the packet as it was on the
+ * wire, still compressed if it was sent compressed.
+ */
+class PacketCapture {
+  std::mutex mutex;
+  std::atomic<bool> recording;
+  FILE* file;
+  std::chrono::steady_clock::time_point start;
+  size_t packets;
+  size_t bytes;
+
+ public:
+  PacketCapture();
+  ~PacketCapture();
+
+  void open(const std::string& path, bool backend);
+  void close();
+  bool isRecording() { return recording.load(std::memory_order_relaxed); }
+
+  void record(CapturedPacket::Type type, int peerId, int channel, int flags,
+              const void* data = NULL, size_t size = 0);
+};
+
+/**
+ * @brief Reads back a file written by PacketCapture. Throws
+ * std::runtime_error if the file is not a capture or is cut short.
+ */
+class PacketCaptureReader {
+  FILE* file;
+  uint32_t protocolVersion;
+  bool backend;
+
+ public:
+  PacketCaptureReader(const std::string& path);
+  ~PacketCaptureReader();
+
+  uint32_t getProtocolVersion() { return protocolVersion; }
+  bool isBackend() { return backend; }
+
+  /**
+   * @return false at the end of the file
+   */
+  bool next(CapturedPacket& packet);
+};
+}  // namespace rdm::network
@@ -0,0 +1,135 @@
+#include "compress.hpp"
+
+#include <enet/enet.h>
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+
+#include "logging.hpp"
+#include "lz.hpp"
+
+namespace rdm::network {
+namespace {
+struct RangeCoderDeleter {
+  void operator()(void* context) { enet_range_coder_destroy(context); }
+};
+
+// the range coder keeps its model in a context, one per thread
+void* getRangeCoder() {
+  thread_local std::unique_ptr<void, RangeCoderDeleter> context(
+      enet_range_coder_create());
+  if (!context) throw std::runtime_error("enet_range_coder_create failed");
+  return context.get();
+}
+}  // namespace
+
+const char* getCodecName(PacketCodec codec) {
+  switch (codec) {
+    case CodecNone:
+      return "none";
+    case CodecRangeCoder:
+      return "range";
+    case CodecLz:
+      return "lz";
+    default:
+      return "unknown";
+  }
+}
+
+PacketCodec getCodecByName(const std::string& name) {
+  for (int i = 0; i < CodecMax; i++)
+    if (name == getCodecName((PacketCodec)i)) return (PacketCodec)i;
+  return CodecNone;
+}
+
+bool compressPacketData(PacketCodec codec, const unsigned char* data,
+                        size_t size, std::vector<unsigned char>& out) {
+  size_t start = out.size();
+  switch (codec) {
+    case CodecRangeCoder: {
+      ENetBuffer buffer;
+      buffer.data = (void*)data;
+      buffer.dataLength = size;
+      out.resize(start + size);
+      size_t compressed = enet_range_coder_compress(
+          getRangeCoder(), &buffer, 1, size, out.data() + start, size);
+      out.resize(start + compressed);
+      return compressed != 0;
+    }
+    case CodecLz:
+      compressLz(data, size, out);
+      if (out.size() - start < size) return true;
+      out.resize(start);
+      return false;
+    default:
+      return false;
+  }
+}
+
+void decompressPacketData(PacketCodec codec, const unsigned char* data,
+                          size_t size, size_t rawSize,
+                          std::vector<unsigned char>& out) {
+  switch (codec) {
+    case CodecRangeCoder: {
+      size_t start = out.size();
+      out.resize(start + rawSize);
+      size_t decompressed =
+          enet_range_coder_decompress(getRangeCoder(), data, size,
+                                      out.data() + start, rawSize);
+      if (decompressed != rawSize)
+        throw std::runtime_error("Range coder output size mismatch");
+    } break;
+    case CodecLz:
+      decompressLz(data, size, rawSize, out);
+      break;
+    default:
+      throw std::runtime_error("Unknown packet codec");
+  }
+}
+
+void benchmarkCodecs(std::vector<std::vector<unsigned char>>* channels,
+                     int channelCount) {
+  std::vector<unsigned char> compressed, decompressed;
+  for (int channel = 0; channel < channelCount; channel++) {
+    auto& samples = channels[channel];
+    if (samples.empty()) continue;
+
+    size_t raw = 0;
+    for (auto& sample : samples) raw += sample.size();
+    Log::printf(LOG_INFO, "Channel %i: %zu packets, %zu bytes", channel,
+                samples.size(), raw);
+
+    for (int codec = CodecRangeCoder; codec < CodecMax; codec++) {
+      size_t sent = 0;
+      std::chrono::duration<double> compressTime(0), decompressTime(0);
+      for (auto& sample : samples) {
+        compressed.clear();
+        auto start = std::chrono::steady_clock::now();
+        bool smaller = compressPacketData((PacketCodec)codec, sample.data(),
+                                          sample.size(), compressed);
+        compressTime += std::chrono::steady_clock::now() - start;
+        if (!smaller) {
+          sent += sample.size();
+          continue;
+        }
+        sent += compressed.size();
+
+        decompressed.clear();
+        start = std::chrono::steady_clock::now();
+        decompressPacketData((PacketCodec)codec, compressed.data(),
+                             compressed.size(), sample.size(), decompressed);
+        decompressTime += std::chrono::steady_clock::now() - start;
+        if (decompressed != sample)
+          throw std::runtime_error("Codec did not round trip");
+      }
+      Log::printf(LOG_INFO,
+                  "  %s: %0.1f%% of raw, compress %0.2fns/byte, decompress "
+                  "%0.2fns/byte",
+                  getCodecName((PacketCodec)codec), 100.0 * sent / raw,
+                  compressTime.count() / raw * 1e9,
+                  decompressTime.count() / raw * 1e9);
+    }
+  }
+}
+}  // namespace rdm::network
@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace rdm::network {
+/**
+ * @brief How packets on a channel are compressed, see
+ * NetworkManager::sendPacket.
+ */
+enum PacketCodec : uint8_t {
+  CodecNone,
+  CodecRangeCoder,  // ENet's adaptive range coder, slow but tight
+  CodecLz,          // see compressLz, fast
+  CodecMax,
+};
+
+const char* getCodecName(PacketCodec codec);
+/**
+ * @return CodecNone for names it does not know
+ */
+PacketCodec getCodecByName(const std::string& name);
+
+/**
+ * @brief Appends data compressed with codec to out.
+ *
+ * @return false if the codec could not make it smaller, out is then left
+ * as it was
+ */
+bool compressPacketData(PacketCodec codec, const unsigned char* data,
+                        size_t size, std::vector<unsigned char>& out);
+/**
+ * @brief Appends the rawSize bytes data decompresses to to out. Throws
+ * std::runtime_error if data is malformed.
+ */
+void decompressPacketData(PacketCodec codec, const unsigned char* data,
+                          size_t size, size_t rawSize,
+                          std::vector<unsigned char>& out);
+
+/**
+ * @brief Compresses every sample with every codec and logs the ratio and time
+ * per byte of each, per channel.
+ */
+void benchmarkCodecs(std::vector<std::vector<unsigned char>>* channels,
+                     int channelCount);
+}  // namespace rdm::network
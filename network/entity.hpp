@@ -86,6 +86,17 @@ class Entity {
 
   virtual void tick() {};
 
+  /**
+   * @brief Return true if tickParallel may run at the same time as other
+   * entities' tickParallel.
+   *
+   * It must only touch state owned by this entity. Anything shared (other
+   * entities, the physics world, the network manager) belongs in tick(), which
+   * still runs afterwards, serially and in entity id order.
+   */
+  virtual bool isTickThreadSafe() { return false; }
+  virtual void tickParallel() {};
+
   virtual void serialize(BitStream& stream) {};
   virtual void deserialize(BitStream& stream) {};
 
@@ -94,6 +105,13 @@ class Entity {
 
   virtual bool getOwnership(Peer* peer) { return false; }
 
+  /**
+   * @brief Where the entity is, for the NetworkManager's RelevancyFilter.
+   *
+   * Entities without a position return false and are relevant to every peer.
+   */
+  virtual bool getPosition(glm::vec3& position) { return false; }
+
   virtual bool dirty() { return false; }
   virtual const char* getTypeName() { return "Entity"; };
 
@@ -0,0 +1,49 @@
+#include "entityslots.hpp"
+
+#include <algorithm>
+
+namespace rdm::network {
+Entity* EntitySlotMap::insert(Entity* entity) {
+  EntityId id = entity->getEntityId();
+  if (contains(id)) erase(id);
+  if (id >= slots.size()) slots.resize(id + 1, Slot{-1, 0});
+
+  slots[id].index = entities.size();
+  entities.push_back(std::unique_ptr<Entity>(entity));
+  types[entity->getTypeName()].push_back(entity);
+  return entity;
+}
+
+bool EntitySlotMap::erase(EntityId id) {
+  Entity* entity = get(id);
+  if (!entity) return false;
+
+  auto& ofType = types[entity->getTypeName()];
+  ofType.erase(std::find(ofType.begin(), ofType.end(), entity));
+
+  // swap the last entity into the hole
+  int index = slots[id].index;
+  std::unique_ptr<Entity> removed = std::move(entities[index]);
+  if (index != (int)entities.size() - 1) {
+    entities[index] = std::move(entities.back());
+    slots[entities[index]->getEntityId()].index = index;
+  }
+  entities.pop_back();
+  slots[id].index = -1;
+  slots[id].generation++;
+
+  // destroyed last, so a destructor looking entities up sees it gone
+  removed.reset();
+  return true;
+}
+
+void EntitySlotMap::clear() {
+  while (!entities.empty()) erase(entities.back()->getEntityId());
+}
+
+const std::vector<Entity*>& EntitySlotMap::ofType(
+    const std::string& typeName) const {
+  auto it = types.find(typeName);
+  return it == types.end() ? noEntities : it->second;
+}
+}  // namespace rdm::network
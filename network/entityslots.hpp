@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "entity.hpp"
+
+namespace rdm::network {
+/**
+ * @brief Refers to an entity across ticks. Unlike a bare EntityId it stops
+ * resolving once the entity is deleted, even if the id is used again.
+ */
+struct EntityHandle {
+  EntityId id;
+  uint32_t generation;
+};
+
+/**
+ * @brief The NetworkManager's entities, indexed directly by EntityId.
+ *
+ * Entities are stored densely so iterating them walks one array, with a
+ * sparse array of slots mapping ids into it. Each slot counts how many
+ * entities have left it, which is what makes EntityHandle detect stale ids.
+ * Entities are also indexed by getTypeName() so looking them up by type
+ * costs only the matches.
+ */
+class EntitySlotMap {
+  struct Slot {
+    int index;  // into entities, -1 if empty
+    uint32_t generation;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<std::unique_ptr<Entity>> entities;
+  std::unordered_map<std::string, std::vector<Entity*>> types;
+  std::vector<Entity*> noEntities;
+
+ public:
+  /**
+   * @brief Takes ownership of entity, deleting whatever had its id before.
+   */
+  Entity* insert(Entity* entity);
+  /**
+   * @return false if there is no entity with the id
+   */
+  bool erase(EntityId id);
+  void clear();
+
+  Entity* get(EntityId id) const {
+    if (id >= slots.size() || slots[id].index == -1) return NULL;
+    return entities[slots[id].index].get();
+  }
+  bool contains(EntityId id) const { return get(id) != NULL; }
+
+  EntityHandle getHandle(EntityId id) const {
+    return EntityHandle{id, id < slots.size() ? slots[id].generation : 0};
+  }
+  Entity* get(EntityHandle handle) const {
+    if (handle.id >= slots.size() ||
+        slots[handle.id].generation != handle.generation)
+      return NULL;
+    return get(handle.id);
+  }
+
+  /**
+   * @brief The entities of a type. Stays valid until the next insert or
+   * erase, copy it to add or delete entities while iterating.
+   */
+  const std::vector<Entity*>& ofType(const std::string& typeName) const;
+
+  size_t size() const { return entities.size(); }
+  auto begin() const { return entities.begin(); }
+  auto end() const { return entities.end(); }
+};
+}  // namespace rdm::network
@@ -0,0 +1,113 @@
+#include "lz.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+namespace rdm::network {
+static inline uint32_t lzHash(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// lengths past 15 spill into bytes of 255 and a remainder
+static void writeLength(std::vector<unsigned char>& out, size_t length) {
+  for (; length >= 255; length -= 255) out.push_back(255);
+  out.push_back(length);
+}
+
+static void writeSequence(std::vector<unsigned char>& out,
+                          const unsigned char* literals, size_t literalCount,
+                          size_t offset, size_t matchLength) {
+  size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+  out.push_back(((literalCount < 15 ? literalCount : 15) << 4) |
+                (matchCode < 15 ? matchCode : 15));
+  if (literalCount >= 15) writeLength(out, literalCount - 15);
+  out.insert(out.end(), literals, literals + literalCount);
+  if (!matchLength) return;
+  out.push_back(offset & 0xff);
+  out.push_back(offset >> 8);
+  if (matchCode >= 15) writeLength(out, matchCode - 15);
+}
+
+void compressLz(const unsigned char* data, size_t size,
+                std::vector<unsigned char>& out) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + LZ_MIN_MATCH <= size) {
+    uint32_t hash = lzHash(data + i);
+    uint32_t candidate = table[hash];
+    table[hash] = i;
+    if (candidate == UINT32_MAX || i - candidate > LZ_MAX_OFFSET ||
+        memcmp(data + candidate, data + i, LZ_MIN_MATCH)) {
+      i++;
+      continue;
+    }
+
+    size_t length = LZ_MIN_MATCH;
+    while (i + length < size && data[candidate + length] == data[i + length])
+      length++;
+    writeSequence(out, data + anchor, i - anchor, i - candidate, length);
+    i += length;
+    anchor = i;
+  }
+  // always ends on literals, even none, so the decoder knows where to stop
+  writeSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+void decompressLz(const unsigned char* data, size_t size, size_t rawSize,
+                  std::vector<unsigned char>& out) {
+  size_t start = out.size();
+  out.reserve(start + rawSize);
+  const unsigned char* end = data + size;
+
+  auto readLength = [&data, end](size_t length) {
+    if (length != 15) return length;
+    unsigned char b;
+    do {
+      if (data >= end) throw std::runtime_error("LZ length past end");
+      b = *data++;
+      length += b;
+    } while (b == 255);
+    return length;
+  };
+
+  while (true) {
+    if (data >= end) throw std::runtime_error("LZ missing token");
+    unsigned char token = *data++;
+
+    size_t literals = readLength(token >> 4);
+    if ((size_t)(end - data) < literals)
+      throw std::runtime_error("LZ literals past end");
+    if (out.size() - start + literals > rawSize)
+      throw std::runtime_error("LZ output too large");
+    out.insert(out.end(), data, data + literals);
+    data += literals;
+    if (data == end) break;
+
+    if (end - data < 2) throw std::runtime_error("LZ offset past end");
+    size_t offset = data[0] | (data[1] << 8);
+    data += 2;
+    size_t length = readLength(token & 15) + LZ_MIN_MATCH;
+    if (!offset || offset > out.size() - start)
+      throw std::runtime_error("LZ offset out of range");
+    if (out.size() - start + length > rawSize)
+      throw std::runtime_error("LZ output too large");
+    // byte by byte, matches may overlap what they are copying
+    size_t from = out.size() - offset;
+    for (size_t j = 0; j < length; j++) out.push_back(out[from + j]);
+  }
+
+  if (out.size() - start != rawSize)
+    throw std::runtime_error("LZ output size mismatch");
+}
+}  // namespace rdm::network
@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+
+#include <vector>
+
+namespace rdm::network {
+/**
+ * @brief Byte oriented LZ77 in the LZ4 block layout: runs of literals
+ * followed by a back reference of at least 4 bytes up to 64KiB back. Fast
+ * enough to run per packet, and does well on entity states, which repeat
+ * a lot between entities of the same type.
+ *
+ * Appends to out.
+ */
+void compressLz(const unsigned char* data, size_t size,
+                std::vector<unsigned char>& out);
+/**
+ * @brief Reverses compressLz. Appends to out and throws std::runtime_error if
+ * the input is malformed or does not decompress to exactly rawSize bytes.
+ */
+void decompressLz(const unsigned char* data, size_t size, size_t rawSize,
+                  std::vector<unsigned char>& out);
+}  // namespace rdm::network
@@ -2,6 +2,7 @@
 
 #include <enet/enet.h>
 
+#include <algorithm>
 #include <chrono>
 #include <stdexcept>
 
@@ -11,6 +12,7 @@
 #include "logging.hpp"
 #include "network/bitstream.hpp"
 #include "network/entity.hpp"
+#include "network/lz.hpp"
 #include "scheduler.hpp"
 #include "settings.hpp"
 #include "world.hpp"
@@ -31,6 +33,7 @@ namespace rdm::network {
 Peer::Peer() {
   playerEntity = NULL;
   peer = NULL;
+  ackedSnapshot = 0;
 }
 
 static CVar net_rate("net_rate", "60.0",
@@ -108,6 +111,64 @@ static ConsoleCommand entity(
       }
     });
 
+static ConsoleCommand net_deltastats(
+    "net_deltastats", "net_deltastats",
+    "shows bytes saved by delta compressing entity updates",
+    [](Game* game, ConsoleArgReader reader) {
+      if (!game->getWorldConstructorSettings().network)
+        throw std::runtime_error("network disabled");
+      if (!game->getServerWorld())
+        throw std::runtime_error("Must be hosting server");
+
+      game->getServerWorld()->getNetworkManager()->logSnapshotStats();
+    });
+
+static ConsoleCommand net_joinstats(
+    "net_joinstats", "net_joinstats",
+    "shows how long joining the server took and what it sent",
+    [](Game* game, ConsoleArgReader reader) {
+      if (!game->getWorldConstructorSettings().network)
+        throw std::runtime_error("network disabled");
+      if (!game->getWorld()) throw std::runtime_error("Not connected");
+
+      game->getWorld()->getNetworkManager()->logJoinStats();
+    });
+
+static ConsoleCommand bench_compress(
+    "bench_compress", "bench_compress [packets]",
+    "records the next packets sent and shows how well each codec compresses "
+    "them",
+    [](Game* game, ConsoleArgReader reader) {
+      if (!game->getWorldConstructorSettings().network)
+        throw std::runtime_error("network disabled");
+      World* world =
+          game->getServerWorld() ? game->getServerWorld() : game->getWorld();
+      if (!world) throw std::runtime_error("Not hosting or connected");
+
+      int packets = std::atoi(reader.next().c_str());
+      if (packets <= 0) packets = 1000;
+      world->getNetworkManager()->sampleCodecs(packets);
+      Log::printf(LOG_INFO, "Recording the next %i packets", packets);
+    });
+
+static ConsoleCommand net_capture(
+    "net_capture", "net_capture [file]",
+    "records every packet sent and received to file for netreplay, stops "
+    "recording without a file",
+    [](Game* game, ConsoleArgReader reader) {
+      if (!game->getWorldConstructorSettings().network)
+        throw std::runtime_error("network disabled");
+      World* world =
+          game->getServerWorld() ? game->getServerWorld() : game->getWorld();
+      if (!world) throw std::runtime_error("Not hosting or connected");
+
+      std::string path = reader.rest();
+      if (path.empty())
+        world->getNetworkManager()->stopCapture();
+      else
+        world->getNetworkManager()->startCapture(path);
+    });
+
 static ConsoleCommand entities(
     "entities", "entities", "lists all entities",
     [](Game* game, ConsoleArgReader reader) {
@@ -134,6 +195,8 @@ class NetworkJob : public SchedulerJob {
     } else {
       netmanager->distributedTime += getStats().totalDeltaTime;
     }
+    netmanager->clockTime = netmanager->distributedTime;
+    netmanager->clockStamp = std::chrono::steady_clock::now();
     netmanager->service();
     return Stepped;
   }
@@ -155,6 +218,19 @@ NetworkManager::NetworkManager(World* world) {
 
   username = Fun::getSystemUsername();
   nextDtPacket = 0.0;
+  packetTime = 0.0;
+  clockTime = 0.0;
+  clockStamp = std::chrono::steady_clock::now();
+
+  lastSnapshot = 0;
+  pendingSnapshotAck = 0;
+  serializeGeneration = 0;
+  snapshotFullBytes = 0;
+  snapshotSentBytes = 0;
+  snapshotTotalFullBytes = 0;
+  snapshotTotalSentBytes = 0;
+  joinTime = -1.f;
+  codecSamplesWanted = 0;
 
   cvarChangingUpdate =
       Settings::singleton()->cvarChanging.listen([this](std::string name) {
@@ -173,8 +249,8 @@ NetworkManager::NetworkManager(World* world) {
 
 void NetworkManager::listEntities() {
   for (auto& entity : entities) {
-    Log::printf(LOG_INFO, "%i - %s", entity.first,
-                entity.second->getTypeName());
+    Log::printf(LOG_INFO, "%i - %s", entity->getEntityId(),
+                entity->getTypeName());
   }
 }
 
@@ -182,8 +258,8 @@ void NetworkManager::requestDisconnect() {
   BitStream disconnectMessage;
   disconnectMessage.write<PacketId>(DisconnectPacket);
   disconnectMessage.write<int>(0);
-  enet_peer_send(localPeer.peer, 0,
-                 disconnectMessage.createPacket(ENET_PACKET_FLAG_RELIABLE));
+  sendPacket(localPeer.peer, 0,
+             disconnectMessage.releasePacket(ENET_PACKET_FLAG_RELIABLE));
 }
 
 NetworkManager::~NetworkManager() {
@@ -195,8 +271,8 @@ NetworkManager::~NetworkManager() {
       BitStream shutdownMessage;
       shutdownMessage.write<PacketId>(DisconnectPacket);
       shutdownMessage.writeString("Server is shutting down");
-      enet_host_broadcast(
-          host, 0, shutdownMessage.createPacket(ENET_PACKET_FLAG_RELIABLE));
+      broadcastPacket(0,
+                      shutdownMessage.releasePacket(ENET_PACKET_FLAG_RELIABLE));
       enet_host_service(host, &event,
                         1);  // service to flush disconnect packet
     } else {
@@ -213,6 +289,140 @@ NetworkManager::~NetworkManager() {
 }
 
 static CVar sv_dtrate("sv_dtrate", "0.5", CVARF_SAVE | CVARF_GLOBAL);
+static CVar sv_deltasnapshots("sv_deltasnapshots", "1",
+                              CVARF_SAVE | CVARF_GLOBAL);
+static CVar sv_relevancy("sv_relevancy", "1", CVARF_SAVE | CVARF_GLOBAL);
+static CVar sv_entitybudget("sv_entitybudget", "0", CVARF_SAVE | CVARF_GLOBAL);
+static CVar sv_compress_meta("sv_compress_meta", "range",
+                             CVARF_SAVE | CVARF_GLOBAL);
+static CVar sv_compress_entity("sv_compress_entity", "lz",
+                               CVARF_SAVE | CVARF_GLOBAL);
+static CVar sv_compress_event("sv_compress_event", "lz",
+                              CVARF_SAVE | CVARF_GLOBAL);
+static CVar cl_compress("cl_compress", "1", CVARF_SAVE | CVARF_GLOBAL);
+
+static PacketCodec getServerCodec(int channel) {
+  switch (channel) {
+    case NETWORK_STREAM_META:
+      return getCodecByName(sv_compress_meta.getValue());
+    case NETWORK_STREAM_ENTITY:
+      return getCodecByName(sv_compress_entity.getValue());
+    case NETWORK_STREAM_EVENT:
+      return getCodecByName(sv_compress_event.getValue());
+    default:
+      return CodecNone;
+  }
+}
+
+static_assert(sizeof(NetworkManager::PacketId) == sizeof(uint32_t));
+
+PacketCodec NetworkManager::getPacketCodec(ENetPacket* packet) {
+  uint32_t id;
+  if (packet->dataLength < sizeof(PacketId) + 5) return CodecNone;
+  memcpy(&id, packet->data, sizeof(PacketId));
+  if (!(id & NETWORK_PACKET_COMPRESSED)) return CodecNone;
+  return (PacketCodec)packet->data[sizeof(PacketId)];
+}
+
+ENetPacket* NetworkManager::compressPacket(ENetPacket* packet,
+                                           PacketCodec codec) {
+  if (packet->dataLength < NETWORK_COMPRESS_MIN) return packet;
+  if (getPacketCodec(packet) != CodecNone) return packet;
+
+  // PacketId, codec, uncompressed size, then everything after the PacketId
+  uint32_t id;
+  memcpy(&id, packet->data, sizeof(PacketId));
+  id |= NETWORK_PACKET_COMPRESSED;
+  uint32_t rawSize = packet->dataLength - sizeof(PacketId);
+  compressScratch.resize(sizeof(PacketId) + 5);
+  memcpy(compressScratch.data(), &id, sizeof(PacketId));
+  compressScratch[sizeof(PacketId)] = codec;
+  memcpy(&compressScratch[sizeof(PacketId) + 1], &rawSize, sizeof(rawSize));
+  if (!compressPacketData(codec, packet->data + sizeof(PacketId), rawSize,
+                          compressScratch) ||
+      compressScratch.size() >= packet->dataLength)
+    return packet;
+
+  ENetPacket* compressed =
+      enet_packet_create(compressScratch.data(), compressScratch.size(),
+                         packet->flags & ~ENET_PACKET_FLAG_NO_ALLOCATE);
+  enet_packet_destroy(packet);
+  return compressed;
+}
+
+ENetPacket* NetworkManager::decompressPacket(ENetPacket* packet,
+                                             bool destroy) {
+  ENetPacket* decompressed = NULL;
+  try {
+    uint32_t id, rawSize;
+    memcpy(&id, packet->data, sizeof(PacketId));
+    id &= ~NETWORK_PACKET_COMPRESSED;
+    PacketCodec codec = (PacketCodec)packet->data[sizeof(PacketId)];
+    memcpy(&rawSize, packet->data + sizeof(PacketId) + 1, sizeof(rawSize));
+    if (rawSize > NETWORK_DECOMPRESS_MAX_SIZE)
+      throw std::runtime_error("Compressed packet too large");
+
+    size_t header = sizeof(PacketId) + 5;
+    compressScratch.resize(sizeof(PacketId));
+    memcpy(compressScratch.data(), &id, sizeof(PacketId));
+    decompressPacketData(codec, packet->data + header,
+                         packet->dataLength - header, rawSize,
+                         compressScratch);
+    decompressed =
+        enet_packet_create(compressScratch.data(), compressScratch.size(),
+                           packet->flags & ~ENET_PACKET_FLAG_NO_ALLOCATE);
+  } catch (...) {
+    if (destroy) enet_packet_destroy(packet);
+    throw;
+  }
+  if (destroy) enet_packet_destroy(packet);
+  return decompressed;
+}
+
+ENetPacket* NetworkManager::sendPacket(ENetPeer* peer, enet_uint8 channel,
+                                       ENetPacket* packet) {
+  if (codecSamplesWanted > 0 && channel < NETWORK_STREAM_MAX &&
+      !packet->referenceCount && getPacketCodec(packet) == CodecNone) {
+    codecSamples[channel].push_back(std::vector<unsigned char>(
+        packet->data + sizeof(PacketId), packet->data + packet->dataLength));
+    if (--codecSamplesWanted == 0) {
+      benchmarkCodecs(codecSamples, NETWORK_STREAM_MAX);
+      for (auto& samples : codecSamples) samples.clear();
+    }
+  }
+
+  Peer* remotePeer = backend ? (Peer*)peer->data : &localPeer;
+  PacketCodec codec = CodecNone;
+  if (remotePeer && channel < NETWORK_STREAM_MAX)
+    codec = remotePeer->codecs[channel];
+
+  // the shared packet stays as it is for whoever is sent it next, a peer that
+  // did not agree to its codec gets its own copy in the peer's codec
+  ENetPacket* shared = packet;
+  if (!packet->referenceCount) {
+    if (codec != CodecNone) shared = packet = compressPacket(packet, codec);
+  } else {
+    PacketCodec sent = getPacketCodec(packet);
+    if (sent != CodecNone && sent != codec) {
+      packet = decompressPacket(packet, false);
+      if (codec != CodecNone) packet = compressPacket(packet, codec);
+    }
+  }
+  if (capture.isRecording())
+    capture.record(CapturedPacket::Send,
+                   backend && remotePeer ? remotePeer->peerId : -1, channel,
+                   packet->flags, packet->data, packet->dataLength);
+  if (enet_peer_send(peer, channel, packet) < 0 && packet != shared)
+    enet_packet_destroy(packet);
+  return shared;
+}
+
+void NetworkManager::broadcastPacket(enet_uint8 channel, ENetPacket* packet) {
+  for (auto& peer : peers)
+    if (peer.second.peer)
+      packet = sendPacket(peer.second.peer, channel, packet);
+  if (!packet->referenceCount) enet_packet_destroy(packet);
+}
 
 void NetworkManager::service() {
   if (!host) return;
@@ -234,8 +444,16 @@ void NetworkManager::service() {
       case ENET_EVENT_TYPE_RECEIVE: {
         try {
           Peer* remotePeer = (Peer*)event.peer->data;
-          BitStream stream(event.packet->data, event.packet->dataLength);
+          if (capture.isRecording())
+            capture.record(CapturedPacket::Receive,
+                           backend && remotePeer ? remotePeer->peerId : -1,
+                           event.channelID, event.packet->flags,
+                           event.packet->data, event.packet->dataLength);
+          if (getPacketCodec(event.packet) != CodecNone)
+            event.packet = decompressPacket(event.packet, true);
+          BitStreamView stream(event.packet);  // destroys the packet
           PacketId packetId = stream.read<PacketId>();
+          packetTime = distributedTime;
           try {
             switch (packetId) {
               case WelcomePacket:
@@ -249,6 +467,17 @@ void NetworkManager::service() {
                               _ticks, _ticks - ticks);
                   distributedTime = stream.read<float>();
 
+                  remoteTypeTable.resize(stream.readVarInt());
+                  for (auto& typeName : remoteTypeTable)
+                    typeName = stream.readString();
+                  // take what the server offers as long as it is known here
+                  PacketCodec codecs[NETWORK_STREAM_MAX];
+                  for (int i = 0; i < NETWORK_STREAM_MAX; i++) {
+                    codecs[i] = stream.read<PacketCodec>();
+                    if (codecs[i] >= CodecMax || !cl_compress.getBool())
+                      codecs[i] = CodecNone;
+                  }
+
 #ifndef DISABLE_OBZ
                   // doesn't do anything yet but will verify official servers
                   obz::ObzCrypt::singleton()->readCryptPacket(stream, false);
@@ -261,15 +490,19 @@ void NetworkManager::service() {
                   authenticateStream.writeString(this->username);
                   authenticateStream.writeString(password);
                   authenticateStream.writeString(userPassword);
+                  for (int i = 0; i < NETWORK_STREAM_MAX; i++)
+                    authenticateStream.write<PacketCodec>(codecs[i]);
 
 #ifndef DISABLE_OBZ
                   obz::ObzCrypt::singleton()->writeCryptPacket(
                       authenticateStream, false);
 #endif
 
-                  enet_peer_send(localPeer.peer, NETWORK_STREAM_META,
-                                 authenticateStream.createPacket(
-                                     ENET_PACKET_FLAG_RELIABLE));
+                  sendPacket(localPeer.peer, NETWORK_STREAM_META,
+                             authenticateStream.releasePacket(
+                                 ENET_PACKET_FLAG_RELIABLE));
+                  for (int i = 0; i < NETWORK_STREAM_MAX; i++)
+                    localPeer.codecs[i] = codecs[i];
                 }
                 break;
               case AuthenticatePacket:
@@ -277,6 +510,12 @@ void NetworkManager::service() {
                   std::string username = stream.readString();
                   std::string password = stream.readString();
                   std::string userPassword = stream.readString();
+                  PacketCodec codecs[NETWORK_STREAM_MAX];
+                  for (int i = 0; i < NETWORK_STREAM_MAX; i++) {
+                    codecs[i] = stream.read<PacketCodec>();
+                    // the client may only turn compression down
+                    if (codecs[i] != getServerCodec(i)) codecs[i] = CodecNone;
+                  }
 
 #ifndef DISABLE_OBZ
                   obz::ObzCrypt::singleton()->readCryptPacket(stream, true);
@@ -300,6 +539,8 @@ void NetworkManager::service() {
 
                   Log::printf(LOG_INFO, "%s authenticating", username.c_str());
                   remotePeer->type = Peer::ConnectedPlayer;
+                  for (int i = 0; i < NETWORK_STREAM_MAX; i++)
+                    remotePeer->codecs[i] = codecs[i];
                   if (playerType.empty()) {
                     throw std::runtime_error(
                         "Please use NetworkManager::setPlayerType to set the "
@@ -316,12 +557,12 @@ void NetworkManager::service() {
                   newPeerPacket.write<int>(remotePeer->peerId);
                   newPeerPacket.write<EntityId>(
                       remotePeer->playerEntity->getEntityId());
-                  enet_host_broadcast(
-                      host, NETWORK_STREAM_META,
-                      newPeerPacket.createPacket(ENET_PACKET_FLAG_RELIABLE));
+                  broadcastPacket(
+                      NETWORK_STREAM_META,
+                      newPeerPacket.releasePacket(ENET_PACKET_FLAG_RELIABLE));
 
                   for (auto& e : entities)
-                    remotePeer->pendingNewIds.push_back(e.first);
+                    remotePeer->pendingNewIds.push_back(e->getEntityId());
                 } else {
                   throw std::runtime_error(
                       "Received AuthenticatePacket on frontend");
@@ -331,15 +572,7 @@ void NetworkManager::service() {
                 if (backend) {
                   throw std::runtime_error("Received NewIdPacket on backend");
                 } else {
-                  int numEntities = stream.read<int>();
-                  for (int i = 0; i < numEntities; i++) {
-                    EntityId id = stream.read<EntityId>();
-                    std::string typeName = stream.readString();
-                    Entity* ent = instantiate(typeName, id);
-                    // ent->deserialize(stream);
-
-                    Log::printf(LOG_DEBUG, "created %s", typeName.c_str());
-                  }
+                  readNewIds(stream);
                 }
                 break;
               case DelIdPacket:
@@ -360,7 +593,7 @@ void NetworkManager::service() {
                 try {
                   for (i = 0; i < numEntities; i++) {
                     EntityId id = stream.read<EntityId>();
-                    ent = entities[id].get();
+                    ent = entities.get(id);
                     if (!ent) {
                       Log::printf(LOG_DEBUG, "%i == NULL", id);
                       throw std::runtime_error("ent == NULL");
@@ -537,6 +770,25 @@ void NetworkManager::service() {
                   customSignals[id].fire(this, id, stream);
                 }
               } break;
+              case DeltaSnapshotPacket:
+                if (backend) {
+                  throw std::runtime_error(
+                      "Received DeltaSnapshotPacket on backend");
+                } else {
+                  readSnapshot(stream);
+                }
+                break;
+              case SnapshotAckPacket:
+                if (backend) {
+                  uint32_t sequence = stream.read<uint32_t>();
+                  if (sequence > remotePeer->ackedSnapshot &&
+                      sequence <= lastSnapshot)
+                    remotePeer->ackedSnapshot = sequence;
+                } else {
+                  throw std::runtime_error(
+                      "Received SnapshotAckPacket on frontend");
+                }
+                break;
               case CvarPacket:
                 if (backend) {
                   throw std::runtime_error("CvarPacket on backend");
@@ -570,12 +822,13 @@ void NetworkManager::service() {
           Log::printf(LOG_ERROR, "%s: Error in ENET_EVENT_TYPE_RECEIVE: %s",
                       backend ? "Backend" : "Frontend", e.what());
         }
-        enet_packet_destroy(event.packet);
       } break;
       case ENET_EVENT_TYPE_DISCONNECT: {
         if (backend) {
           Peer* peer = (Peer*)event.peer->data;
           if (peer) {
+            if (capture.isRecording())
+              capture.record(CapturedPacket::Disconnect, peer->peerId, 0, 0);
             Log::printf(LOG_INFO, "Peer disconnecting (reason: %s)",
                         disconnectReasons[event.data]);
 
@@ -588,7 +841,7 @@ void NetworkManager::service() {
                 if (!_peer.second.playerEntity ||
                     peer->peerId == _peer.second.peerId)
                   continue;
-                enet_peer_send(
+                sendPacket(
                     _peer.second.peer, NETWORK_STREAM_META,
                     peerRemoving.createPacket(ENET_PACKET_FLAG_RELIABLE));
               }
@@ -622,21 +875,28 @@ void NetworkManager::service() {
 
           peers[np.peerId] = np;
           event.peer->data = &peers[np.peerId];
+          if (capture.isRecording())
+            capture.record(CapturedPacket::Connect, np.peerId, 0, 0);
 
           BitStream welcomePacketStream;
           welcomePacketStream.write<PacketId>(WelcomePacket);
           welcomePacketStream.write<int>(np.peerId);
           welcomePacketStream.write<size_t>(ticks);
           welcomePacketStream.write<float>(distributedTime);
+          welcomePacketStream.writeVarInt(typeTable.size());
+          for (auto& typeName : typeTable)
+            welcomePacketStream.writeString(typeName);
+          for (int i = 0; i < NETWORK_STREAM_MAX; i++)
+            welcomePacketStream.write<PacketCodec>(getServerCodec(i));
 
 #ifndef DISABLE_OBZ
           obz::ObzCrypt::singleton()->writeCryptPacket(welcomePacketStream,
                                                        true);
 #endif
 
-          enet_peer_send(
+          sendPacket(
               event.peer, NETWORK_STREAM_META,
-              welcomePacketStream.createPacket(ENET_PACKET_FLAG_RELIABLE));
+              welcomePacketStream.releasePacket(ENET_PACKET_FLAG_RELIABLE));
         } else {
           localPeer.peer = event.peer;
           localPeer.type = Peer::ConnectedPlayer;
@@ -653,12 +913,40 @@ void NetworkManager::service() {
 #ifndef DISABLE_EASY_PROFILER
   EASY_BLOCK("Network Tick");
 #endif
+  tickOrder.clear();
+  tickParallelEntities.clear();
   for (auto& entity : entities) {
+    tickOrder.push_back(entities.getHandle(entity->getEntityId()));
+    if (entity->isTickThreadSafe()) tickParallelEntities.push_back(entity.get());
+  }
+  // slot map iteration order depends on the deletion history, so the
+  // serial phase is sorted to tick the same way on every machine
+  std::sort(tickOrder.begin(), tickOrder.end(),
+            [](EntityHandle a, EntityHandle b) { return a.id < b.id; });
+
+  Scheduler::parallelFor(
+      0, tickParallelEntities.size(), [this](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          Entity* entity = tickParallelEntities[i];
+          try {
+            entity->tickParallel();
+          } catch (std::exception& e) {
+            Log::printf(LOG_ERROR, "Error ticking entity %s:%i: %s",
+                        entity->getTypeName(), entity->getEntityId(),
+                        e.what());
+          }
+        }
+      });
+
+  for (EntityHandle handle : tickOrder) {
+    // an earlier tick may have deleted it
+    Entity* entity = entities.get(handle);
+    if (!entity) continue;
     try {
-      entity.second->tick();
+      entity->tick();
     } catch (std::exception& e) {
       Log::printf(LOG_ERROR, "Error ticking entity %s:%i: %s",
-                  entity.second->getTypeName(), entity.first, e.what());
+                  entity->getTypeName(), entity->getEntityId(), e.what());
     }
   }
 #ifndef DISABLE_EASY_PROFILER
@@ -669,24 +957,9 @@ void NetworkManager::service() {
 #ifndef DISABLE_EASY_PROFILER
     EASY_BLOCK("Backend Peer Management");
 #endif
+    serializeGeneration++;
     for (auto& peer : peers) {
-      std::vector<int> pendingUpdates;
-
-      if (int pendingNewIds = peer.second.pendingNewIds.size()) {
-        BitStream newIdStream;
-        newIdStream.write<PacketId>(NewIdPacket);
-        newIdStream.write<int>(pendingNewIds);
-        for (auto id : peer.second.pendingNewIds) {
-          newIdStream.write<EntityId>(id);
-          Entity* ent = entities[id].get();
-          newIdStream.writeString(ent->getTypeName());
-          pendingUpdates.push_back(id);
-          // ent->serialize(newIdStream);
-        }
-        enet_peer_send(peer.second.peer, NETWORK_STREAM_ENTITY,
-                       newIdStream.createPacket(ENET_PACKET_FLAG_RELIABLE));
-        peer.second.pendingNewIds.clear();
-      }
+      if (peer.second.pendingNewIds.size()) sendNewIds(peer.second);
 
       if (int pendingDelIds = peer.second.pendingDelIds.size()) {
         BitStream delIdStream;
@@ -695,40 +968,11 @@ void NetworkManager::service() {
         for (auto id : peer.second.pendingDelIds) {
           delIdStream.write<EntityId>(id);
         }
-        enet_peer_send(peer.second.peer, NETWORK_STREAM_ENTITY,
-                       delIdStream.createPacket(ENET_PACKET_FLAG_RELIABLE));
+        sendPacket(peer.second.peer, NETWORK_STREAM_ENTITY,
+                   delIdStream.releasePacket(ENET_PACKET_FLAG_RELIABLE));
         peer.second.pendingDelIds.clear();
       }
 
-      if (int _pendingUpdates = pendingUpdates.size()) {
-        BitStream deltaIdStream, deltaIdStreamUnreliable;
-        deltaIdStream.write<PacketId>(DeltaIdPacket);
-        deltaIdStreamUnreliable.write<PacketId>(DeltaIdPacket);
-        deltaIdStream.write<int>(_pendingUpdates);
-        deltaIdStreamUnreliable.write<int>(_pendingUpdates);
-        for (auto id : pendingUpdates) {
-          deltaIdStream.write<EntityId>(id);
-          deltaIdStreamUnreliable.write<EntityId>(id);
-
-          Entity* ent = entities[id].get();
-
-          BitStream::Context ctxt = BitStream::ToClient;
-          if (ent->getOwnership(&peer.second)) ctxt = BitStream::ToClientLocal;
-          deltaIdStream.setContext(ctxt);
-          deltaIdStreamUnreliable.setContext(ctxt);
-
-          ent->serialize(deltaIdStream);
-          ent->serializeUnreliable(deltaIdStreamUnreliable);
-        }
-        ENetPacket* packet =
-            deltaIdStream.createPacket(ENET_PACKET_FLAG_RELIABLE);
-        ENetPacket* packetUnreliable = deltaIdStream.createPacket(0);
-        enet_peer_send(peer.second.peer, NETWORK_STREAM_ENTITY, packet);
-        enet_peer_send(peer.second.peer, NETWORK_STREAM_ENTITY,
-                       packetUnreliable);
-        // need not be cleared because std::vector will clean itself up
-      }
-
       if (peer.second.noob && peer.second.playerEntity) {
         {
           std::vector<CVar*> cvars =
@@ -742,8 +986,8 @@ void NetworkManager::service() {
             cvarsPacket.writeString(cvar->getValue());
           }
 
-          enet_peer_send(peer.second.peer, NETWORK_STREAM_META,
-                         cvarsPacket.createPacket(ENET_PACKET_FLAG_RELIABLE));
+          sendPacket(peer.second.peer, NETWORK_STREAM_META,
+                     cvarsPacket.releasePacket(ENET_PACKET_FLAG_RELIABLE));
         }
 
         for (auto& _peer : peers) {
@@ -753,13 +997,13 @@ void NetworkManager::service() {
           newPeerPacket.write<int>(_peer.first);
           newPeerPacket.write<EntityId>(
               _peer.second.playerEntity->getEntityId());
-          enet_peer_send(
+          sendPacket(
               peer.second.peer,
               NETWORK_STREAM_ENTITY,  // even though this is technically a meta
                                       // packet it needs to be in the entity
                                       // stream so the other entities can be
                                       // read by the remote peer in time
-              newPeerPacket.createPacket(ENET_PACKET_FLAG_RELIABLE));
+              newPeerPacket.releasePacket(ENET_PACKET_FLAG_RELIABLE));
         }
         peer.second.noob = false;
       }
@@ -792,46 +1036,88 @@ void NetworkManager::service() {
       pendingCvars.clear();
     }
 
+    // entities deleted after asking for an update
+    std::erase_if(pendingUpdates,
+                  [this](EntityId id) { return !entities.contains(id); });
     if (int _pendingUpdates = pendingUpdates.size()) {
+      // peers that own none of the updated entities all get the same bytes,
+      // so build that packet once and only assemble packets for the owners
+      ENetPacket* shared = NULL;
       for (auto& peer : peers) {
         if (peer.second.type != Peer::ConnectedPlayer) continue;
+        bool owner = false;
+        for (auto id : pendingUpdates)
+          if (entities.get(id)->getOwnership(&peer.second)) owner = true;
+
+        if (!owner && shared) {
+          shared = sendPacket(peer.second.peer, NETWORK_STREAM_ENTITY, shared);
+          continue;
+        }
+
         BitStream deltaIdStream;
         deltaIdStream.write<PacketId>(DeltaIdPacket);
         deltaIdStream.write<int>(_pendingUpdates);
         for (auto id : pendingUpdates) {
           deltaIdStream.write<EntityId>(id);
-          Entity* ent = entities[id].get();
-          BitStream::Context ctxt = BitStream::ToClient;
-          if (ent->getOwnership(&peer.second)) ctxt = BitStream::ToClientLocal;
-          deltaIdStream.setContext(ctxt);
-          ent->serialize(deltaIdStream);
+          Entity* ent = entities.get(id);
+          auto& state = getSerialized(ent, true, ent->getOwnership(&peer.second));
+          deltaIdStream.writeBytes(state.data(), state.size());
         }
         ENetPacket* packet =
-            deltaIdStream.createPacket(ENET_PACKET_FLAG_RELIABLE);
-        enet_peer_send(peer.second.peer, NETWORK_STREAM_ENTITY, packet);
+            sendPacket(peer.second.peer, NETWORK_STREAM_ENTITY,
+                       deltaIdStream.releasePacket(ENET_PACKET_FLAG_RELIABLE));
+        if (!owner) shared = packet;
       }
       pendingUpdates.clear();
     }
 
-    if (int _pendingUpdatesUnreliable = pendingUpdatesUnreliable.size()) {
-      for (auto& peer : peers) {
-        if (peer.second.type != Peer::ConnectedPlayer) continue;
-        BitStream deltaIdStream;
-        deltaIdStream.write<PacketId>(DeltaIdPacket);
-        deltaIdStream.write<int>(_pendingUpdatesUnreliable);
-        for (auto id : pendingUpdatesUnreliable) {
-          deltaIdStream.write<EntityId>(id);
-          Entity* ent = entities[id].get();
-          BitStream::Context ctxt = BitStream::ToClient;
-          if (ent->getOwnership(&peer.second)) ctxt = BitStream::ToClientLocal;
-          deltaIdStream.setContext(ctxt);
-          ent->serializeUnreliable(deltaIdStream);
-        }
-        ENetPacket* packet = deltaIdStream.createPacket(0);
-        enet_peer_send(peer.second.peer, NETWORK_STREAM_ENTITY, packet);
+    if (relevancyFilter && sv_relevancy.getBool()) relevancyFilter->update();
+    bool deltaSnapshots = sv_deltasnapshots.getBool();
+    if (deltaSnapshots) {
+      lastSnapshot++;
+      snapshotFullBytes = 0;
+      snapshotSentBytes = 0;
+    }
+    for (auto& peer : peers) {
+      if (peer.second.type != Peer::ConnectedPlayer) continue;
+      UpdateQueue& queue = peer.second.unreliableQueue;
+      for (auto id : pendingUpdatesUnreliable) queue.push(id);
+      if (!queue.size()) continue;
+
+      peerUpdates.clear();
+      queue.pop(
+          sv_relevancy.getBool() ? relevancyFilter.get() : NULL,
+          peer.second.playerEntity,
+          [this](EntityId id) -> Entity* { return entities.get(id); },
+          sv_entitybudget.getInt(), peerUpdates);
+      if (peerUpdates.empty()) continue;
+
+      if (deltaSnapshots) {
+        sendSnapshot(peer.second, peerUpdates);
+        continue;
       }
-      pendingUpdatesUnreliable.clear();
+
+      BitStream deltaIdStream;
+      // player states are around 32 bytes each, see FpsController
+      deltaIdStream.reserve(peerUpdates.size() * 32);
+      deltaIdStream.write<PacketId>(DeltaIdPacket);
+      deltaIdStream.write<int>(peerUpdates.size());
+      for (auto id : peerUpdates) {
+        deltaIdStream.write<EntityId>(id);
+        Entity* ent = entities.get(id);
+        auto& state =
+            getSerialized(ent, false, ent->getOwnership(&peer.second));
+        deltaIdStream.writeBytes(state.data(), state.size());
+        queue.recordSize(id, sizeof(EntityId) + state.size());
+      }
+      ENetPacket* packet = deltaIdStream.releasePacket(0);
+      sendPacket(peer.second.peer, NETWORK_STREAM_ENTITY, packet);
     }
+    if (deltaSnapshots) {
+      snapshotTotalFullBytes += snapshotFullBytes;
+      snapshotTotalSentBytes += snapshotSentBytes;
+    }
+    pendingUpdatesUnreliable.clear();
 
     if (distributedTime > nextDtPacket) {
       nextDtPacket += distributedTime + sv_dtrate.getFloat();
@@ -846,8 +1132,7 @@ void NetworkManager::service() {
         timeStream.write<int>(peer.second.peer->roundTripTime);
         timeStream.write<int>(peer.second.peer->packetLoss);
       }
-      enet_host_broadcast(host, NETWORK_STREAM_META,
-                          timeStream.createPacket(0));
+      broadcastPacket(NETWORK_STREAM_META, timeStream.releasePacket(0));
     }
   } else {
 #ifndef DISABLE_EASY_PROFILER
@@ -859,15 +1144,20 @@ void NetworkManager::service() {
       }
     }
     if (!localPeer.playerEntity) {
-      for (auto& pair : entities) {
-        Entity* entity = pair.second.get();
-        if (Player* playerEntity = dynamic_cast<Player*>(entity)) {
+      for (auto& entity : entities) {
+        if (Player* playerEntity = dynamic_cast<Player*>(entity.get())) {
           if (playerEntity->remotePeerId.get() == localPeer.peerId) {
             Log::printf(
                 LOG_DEBUG, "Found player entity id %i, eid %i, username %s",
                 playerEntity->remotePeerId.get(), playerEntity->getEntityId(),
                 playerEntity->displayName.get().c_str());
             localPeer.playerEntity = playerEntity;
+            if (joinTime < 0.f) {
+              joinTime = std::chrono::duration<float>(
+                             std::chrono::steady_clock::now() - joinStart)
+                             .count();
+              logJoinStats();
+            }
           }
         }
       }
@@ -875,8 +1165,7 @@ void NetworkManager::service() {
 
     for (auto& peer : peers) {
       if (!peer.second.playerEntity) {
-        std::vector<Entity*> ents = findEntitiesByType(playerType);
-        for (auto ent : ents) {
+        for (auto ent : findEntitiesByType(playerType)) {
           Player* player = dynamic_cast<Player*>(ent);
           if (player->remotePeerId.get() == peer.second.peerId) {
             peer.second.playerEntity = player;
@@ -891,21 +1180,25 @@ void NetworkManager::service() {
       }
     }
 
+    std::erase_if(pendingUpdates,
+                  [this](EntityId id) { return !entities.contains(id); });
+    std::erase_if(pendingUpdatesUnreliable,
+                  [this](EntityId id) { return !entities.contains(id); });
     if (int _pendingUpdates = pendingUpdates.size()) {
       BitStream deltaIdStream;
       deltaIdStream.write<PacketId>(DeltaIdPacket);
       deltaIdStream.write<int>(_pendingUpdates);
       for (auto id : pendingUpdates) {
         deltaIdStream.write<EntityId>(id);
-        Entity* ent = entities[id].get();
+        Entity* ent = entities.get(id);
         BitStream::Context ctxt = BitStream::ToServer;
         if (ent->getOwnership(&localPeer)) ctxt = BitStream::ToServerLocal;
         deltaIdStream.setContext(ctxt);
         ent->serialize(deltaIdStream);
       }
       ENetPacket* packet =
-          deltaIdStream.createPacket(ENET_PACKET_FLAG_RELIABLE);
-      enet_peer_send(localPeer.peer, 0, packet);
+          deltaIdStream.releasePacket(ENET_PACKET_FLAG_RELIABLE);
+      sendPacket(localPeer.peer, 0, packet);
       pendingUpdates.clear();
     }
 
@@ -915,25 +1208,34 @@ void NetworkManager::service() {
       deltaIdStream.write<int>(_pendingUpdatesUnreliable);
       for (auto id : pendingUpdatesUnreliable) {
         deltaIdStream.write<EntityId>(id);
-        Entity* ent = entities[id].get();
+        Entity* ent = entities.get(id);
         BitStream::Context ctxt = BitStream::ToServer;
         if (ent->getOwnership(&localPeer)) ctxt = BitStream::ToServerLocal;
         deltaIdStream.setContext(ctxt);
         ent->serializeUnreliable(deltaIdStream);
       }
-      ENetPacket* packet = deltaIdStream.createPacket(0);
-      enet_peer_send(localPeer.peer, 0, packet);
+      ENetPacket* packet = deltaIdStream.releasePacket(0);
+      sendPacket(localPeer.peer, 0, packet);
       pendingUpdatesUnreliable.clear();
     }
 
+    if (pendingSnapshotAck) {
+      BitStream ackStream;
+      ackStream.write<PacketId>(SnapshotAckPacket);
+      ackStream.write<uint32_t>(pendingSnapshotAck);
+      sendPacket(localPeer.peer, NETWORK_STREAM_ENTITY,
+                 ackStream.releasePacket(0));
+      pendingSnapshotAck = 0;
+    }
+
     if (int _pendingRconCommands = pendingRconCommands.size()) {
       for (auto command : pendingRconCommands) {
         BitStream rconStream;
         rconStream.write<PacketId>(RconPacket);
         rconStream.writeString(command.first);
         rconStream.writeString(command.second);
-        enet_peer_send(localPeer.peer, 0,
-                       rconStream.createPacket(ENET_PACKET_FLAG_RELIABLE));
+        sendPacket(localPeer.peer, 0,
+                   rconStream.releasePacket(ENET_PACKET_FLAG_RELIABLE));
       }
       pendingRconCommands.clear();
     }
@@ -990,6 +1292,13 @@ void NetworkManager::connect(std::string address, int port) {
 
   localPeer.type = Peer::Undifferentiated;
   Log::printf(LOG_INFO, "Connecting to %s:%i", address.c_str(), port);
+
+  joinStart = std::chrono::steady_clock::now();
+  joinTime = -1.f;
+  joinPackets = 0;
+  joinEntities = 0;
+  joinBytes = 0;
+  joinRawBytes = 0;
 }
 
 Peer* NetworkManager::getPeerById(int id) {
@@ -1000,26 +1309,363 @@ Peer* NetworkManager::getPeerById(int id) {
   return NULL;
 }
 
+const std::vector<unsigned char>& NetworkManager::getSerialized(Entity* ent,
+                                                               bool reliable,
+                                                               bool owner) {
+  SerializedEntity& cached = serializeCache[ent->getEntityId()];
+  int i = (reliable ? 2 : 0) + (owner ? 1 : 0);
+  if (cached.generation[i] != serializeGeneration) {
+    serializeScratch.clear();
+    serializeScratch.setContext(owner ? BitStream::ToClientLocal
+                                      : BitStream::ToClient);
+    if (reliable)
+      ent->serialize(serializeScratch);
+    else
+      ent->serializeUnreliable(serializeScratch);
+
+    unsigned char* data = (unsigned char*)serializeScratch.getData();
+    cached.states[i].assign(data, data + serializeScratch.getSize());
+    cached.generation[i] = serializeGeneration;
+  }
+  return cached.states[i];
+}
+
+float NetworkManager::getClockTime() {
+  std::chrono::duration<float> elapsed =
+      std::chrono::steady_clock::now() - clockStamp.load();
+  return clockTime + elapsed.count();
+}
+
 void NetworkManager::handleDisconnect() {
   entities.clear();
   peers.clear();
+  receivedSnapshots.clear();
+  pendingSnapshotAck = 0;
+  newIdChunks.clear();
+}
+
+// Each entity in a snapshot is either sent whole, or as the XOR of its state
+// against the same entity in a snapshot the peer has acknowledged. Unchanged
+// bytes XOR to zero and cost one bit each.
+void NetworkManager::sendSnapshot(Peer& peer, std::vector<EntityId>& ids) {
+  EntitySnapshot* baseline = NULL;
+  for (auto& snapshot : peer.snapshots)
+    if (snapshot.sequence == peer.ackedSnapshot) baseline = &snapshot;
+
+  peer.snapshots.push_back(EntitySnapshot());
+  EntitySnapshot& snapshot = peer.snapshots.back();
+  snapshot.sequence = lastSnapshot;
+
+  BitStream stream;
+  stream.reserve(ids.size() * 16);
+  stream.write<PacketId>(DeltaSnapshotPacket);
+  stream.write<uint32_t>(snapshot.sequence);
+  stream.write<uint32_t>(baseline ? baseline->sequence : 0);
+  stream.write<float>(distributedTime);
+  stream.write<int>(ids.size());
+  for (auto id : ids) {
+    Entity* ent = entities.get(id);
+    if (!ent) {
+      // deleted since it was queued, send an empty state to keep the count
+      stream.write<EntityId>(id);
+      stream.writeBool(false);
+      stream.writeVarInt(0);
+      continue;
+    }
+
+    const std::vector<unsigned char>& serialized =
+        getSerialized(ent, false, ent->getOwnership(&peer));
+    const unsigned char* state = serialized.data();
+    size_t stateSize = serialized.size();
+    snapshot.states[id] = serialized;
+    peer.unreliableQueue.recordSize(id, sizeof(EntityId) + stateSize);
+    snapshotFullBytes += sizeof(EntityId) + stateSize;
+
+    std::vector<unsigned char>* base = NULL;
+    if (baseline) {
+      auto baseIt = baseline->states.find(id);
+      if (baseIt != baseline->states.end() &&
+          baseIt->second.size() == stateSize)
+        base = &baseIt->second;
+    }
+
+    stream.write<EntityId>(id);
+    stream.writeBool(base != NULL);
+    if (base) {
+      for (size_t i = 0; i < stateSize; i++) {
+        unsigned char delta = state[i] ^ (*base)[i];
+        stream.writeBool(delta != 0);
+        if (delta) stream.writeBits(delta, 8);
+      }
+    } else {
+      stream.writeVarInt(stateSize);
+      stream.writeBytes(state, stateSize);
+    }
+  }
+  snapshotSentBytes += stream.getSize();
+
+  // a peer that stops acking falls back to full states once its baseline
+  // drops out of the history
+  while (peer.snapshots.size() > NETWORK_SNAPSHOT_HISTORY)
+    peer.snapshots.pop_front();
+
+  sendPacket(peer.peer, NETWORK_STREAM_ENTITY, stream.releasePacket(0));
+}
+
+void NetworkManager::readSnapshot(BitStream& stream) {
+  uint32_t sequence = stream.read<uint32_t>();
+  uint32_t baselineSequence = stream.read<uint32_t>();
+  packetTime = stream.read<float>();
+
+  EntitySnapshot* baseline = NULL;
+  if (baselineSequence) {
+    for (auto& snapshot : receivedSnapshots)
+      if (snapshot.sequence == baselineSequence) baseline = &snapshot;
+    if (!baseline) {
+      // not acked, so the server will move on to a baseline we still have
+      Log::printf(LOG_DEBUG, "Dropping snapshot %i, missing baseline %i",
+                  sequence, baselineSequence);
+      return;
+    }
+  }
+
+  EntitySnapshot snapshot;
+  snapshot.sequence = sequence;
+  int numEntities = stream.read<int>();
+  for (int i = 0; i < numEntities; i++) {
+    EntityId id = stream.read<EntityId>();
+    std::vector<unsigned char>& state = snapshot.states[id];
+    if (stream.readBool()) {
+      if (!baseline || !baseline->states.count(id))
+        throw std::runtime_error("Delta against an entity not in baseline");
+      state = baseline->states[id];
+      for (size_t j = 0; j < state.size(); j++)
+        if (stream.readBool()) state[j] ^= stream.readBits(8);
+    } else {
+      state.resize(stream.readVarInt());
+      stream.readArray(state.data(), state.size());
+    }
+
+    Entity* ent = entities.get(id);
+    if (!ent || state.empty()) continue;
+
+    BitStream entityStream(state.data(), state.size());
+    entityStream.setContext(ent->getOwnership(&localPeer)
+                                ? BitStream::FromServerLocal
+                                : BitStream::FromServer);
+    try {
+      ent->deserializeUnreliable(entityStream);
+    } catch (std::exception& e) {
+      Log::printf(LOG_ERROR, "Error decoding entity %s (%i): %s",
+                  ent->getTypeName(), id, e.what());
+    }
+  }
+
+  receivedSnapshots.push_back(std::move(snapshot));
+  while (receivedSnapshots.size() > NETWORK_SNAPSHOT_HISTORY)
+    receivedSnapshots.pop_front();
+  if (sequence > pendingSnapshotAck) pendingSnapshotAck = sequence;
+}
+
+void NetworkManager::logSnapshotStats() {
+  Log::printf(LOG_INFO,
+              "Last tick: %zu bytes sent for %zu bytes of state (%i saved)",
+              snapshotSentBytes, snapshotFullBytes,
+              (int)snapshotFullBytes - (int)snapshotSentBytes);
+  double ratio = snapshotTotalFullBytes
+                     ? (double)snapshotTotalSentBytes / snapshotTotalFullBytes
+                     : 1.0;
+  Log::printf(LOG_INFO, "Total: %zu bytes sent for %zu bytes of state (%0.1f%%)",
+              snapshotTotalSentBytes, snapshotTotalFullBytes, ratio * 100.0);
+}
+
+// New entities are sent to a peer as one batch: for each its id, its index in
+// the type table from the WelcomePacket and its serialize() and
+// serializeUnreliable() states. The batch is LZ compressed and split into
+// NETWORK_NEWID_CHUNK sized NewIdPackets, which the client collects until it
+// has the whole batch.
+void NetworkManager::sendNewIds(Peer& peer) {
+  BitStream batch;
+  batch.reserve(peer.pendingNewIds.size() * 64);
+  batch.writeVarInt(peer.pendingNewIds.size());
+  for (auto id : peer.pendingNewIds) {
+    Entity* ent = entities.get(id);
+    auto type = typeIds.find(ent->getTypeName());
+    if (type == typeIds.end())
+      throw std::runtime_error("Sending entity of unregistered type");
+    bool owner = ent->getOwnership(&peer);
+    auto& state = getSerialized(ent, true, owner);
+    auto& stateUnreliable = getSerialized(ent, false, owner);
+
+    batch.write<EntityId>(id);
+    batch.writeVarInt(type->second);
+    batch.writeBool(owner);
+    batch.writeVarInt(state.size());
+    batch.writeBytes(state.data(), state.size());
+    batch.writeVarInt(stateUnreliable.size());
+    batch.writeBytes(stateUnreliable.data(), stateUnreliable.size());
+  }
+  peer.pendingNewIds.clear();
+
+  const unsigned char* raw = (const unsigned char*)batch.getData();
+  std::vector<unsigned char> compressed;
+  compressLz(raw, batch.getSize(), compressed);
+  bool useCompressed = compressed.size() < batch.getSize();
+  const unsigned char* data = useCompressed ? compressed.data() : raw;
+  size_t size = useCompressed ? compressed.size() : batch.getSize();
+
+  for (size_t offset = 0; offset < size; offset += NETWORK_NEWID_CHUNK) {
+    size_t length = std::min(size - offset, (size_t)NETWORK_NEWID_CHUNK);
+    BitStream chunk;
+    chunk.reserve(length + 16);
+    chunk.write<PacketId>(NewIdPacket);
+    chunk.write<uint32_t>(batch.getSize());
+    chunk.write<uint32_t>(size);
+    chunk.write<uint32_t>(offset);
+    chunk.writeBool(useCompressed);
+    chunk.writeBytes(data + offset, length);
+    sendPacket(peer.peer, NETWORK_STREAM_ENTITY,
+               chunk.releasePacket(ENET_PACKET_FLAG_RELIABLE));
+  }
+}
+
+void NetworkManager::readNewIds(BitStream& stream) {
+  // a bad chunk drops the whole batch, otherwise every later chunk would
+  // look out of order
+  try {
+    uint32_t rawSize = stream.read<uint32_t>();
+    uint32_t size = stream.read<uint32_t>();
+    uint32_t offset = stream.read<uint32_t>();
+    bool compressed = stream.readBool();
+    if (offset != newIdChunks.size() || offset >= size)
+      throw std::runtime_error("NewIdPacket chunk out of order");
+    if (rawSize > NETWORK_NEWID_MAX_SIZE || size > NETWORK_NEWID_MAX_SIZE)
+      throw std::runtime_error("NewIdPacket batch too large");
+
+    size_t length =
+        std::min((size_t)(size - offset), (size_t)NETWORK_NEWID_CHUNK);
+    newIdChunks.resize(offset + length);
+    stream.readArray(newIdChunks.data() + offset, length);
+    joinPackets++;
+    if (newIdChunks.size() < size) return;
+
+    std::vector<unsigned char> batch;
+    if (compressed) {
+      decompressLz(newIdChunks.data(), newIdChunks.size(), rawSize, batch);
+      newIdChunks.clear();
+    } else {
+      batch.swap(newIdChunks);
+    }
+    joinBytes += size;
+    joinRawBytes += rawSize;
+    createEntities(batch);
+  } catch (...) {
+    newIdChunks.clear();
+    throw;
+  }
+}
+
+void NetworkManager::createEntities(std::vector<unsigned char>& batch) {
+  struct NewEntity {
+    Entity* ent;
+    EntityId id;
+    size_t type;
+    bool owner;
+    std::vector<unsigned char> state;
+    std::vector<unsigned char> stateUnreliable;
+  };
+
+  // the whole batch is read and checked before anything is allocated for it,
+  // counts and sizes come from the server and may be anything
+  BitStream stream(batch.data(), batch.size());
+  size_t count = stream.readVarInt();
+  // id, type, owner and both state sizes
+  if (count > stream.getBitsLeft() / (sizeof(EntityId) * 8 + 25))
+    throw std::runtime_error("NewIdPacket claims more entities than it holds");
+  std::vector<NewEntity> created(count);
+  for (auto& entity : created) {
+    entity.id = stream.read<EntityId>();
+    entity.type = stream.readVarInt();
+    if (entity.type >= remoteTypeTable.size())
+      throw std::runtime_error("NewIdPacket entity of unknown type");
+    entity.owner = stream.readBool();
+    size_t size = stream.readVarInt();
+    if (size > stream.getBytesLeft())
+      throw std::runtime_error("NewIdPacket entity state too large");
+    entity.state.resize(size);
+    stream.readArray(entity.state.data(), entity.state.size());
+    size = stream.readVarInt();
+    if (size > stream.getBytesLeft())
+      throw std::runtime_error("NewIdPacket entity state too large");
+    entity.stateUnreliable.resize(size);
+    stream.readArray(entity.stateUnreliable.data(),
+                     entity.stateUnreliable.size());
+  }
+
+  // everything is created before anything is deserialized, states may refer
+  // to entities later in the batch
+  for (auto& entity : created)
+    entity.ent = instantiate(remoteTypeTable[entity.type], entity.id);
+
+  for (auto& entity : created) {
+    BitStream::Context context =
+        entity.owner ? BitStream::FromServerLocal : BitStream::FromServer;
+    try {
+      BitStream state(entity.state.data(), entity.state.size());
+      state.setContext(context);
+      entity.ent->deserialize(state);
+      if (entity.stateUnreliable.size()) {
+        BitStream stateUnreliable(entity.stateUnreliable.data(),
+                                  entity.stateUnreliable.size());
+        stateUnreliable.setContext(context);
+        entity.ent->deserializeUnreliable(stateUnreliable);
+      }
+    } catch (std::exception& e) {
+      Log::printf(LOG_ERROR, "Error decoding new entity %s (%i): %s",
+                  entity.ent->getTypeName(), entity.ent->getEntityId(),
+                  e.what());
+    }
+  }
+  joinEntities += created.size();
+}
+
+void NetworkManager::logJoinStats() {
+  if (joinTime < 0.f) {
+    Log::printf(LOG_INFO, "Not joined yet");
+    return;
+  }
+  Log::printf(LOG_INFO,
+              "Joined in %0.1fms: %zu entities in %i packets, %zu bytes "
+              "(%zu uncompressed)",
+              joinTime * 1000.f, joinEntities, joinPackets, joinBytes,
+              joinRawBytes);
 }
 
 void NetworkManager::registerConstructor(EntityConstructorFunction func,
                                          std::string type) {
   Log::printf(LOG_DEBUG, "Registered entity type %s", type.c_str());
+  if (!constructors.count(type)) {
+    typeIds[type] = typeTable.size();
+    typeTable.push_back(type);
+  }
   constructors[type] = func;
 }
 
 void NetworkManager::deleteEntity(EntityId id) {
-  auto it = entities.find(id);
-  if (it != entities.end()) {
+  if (entities.contains(id)) {
     if (backend) {
       for (auto& peer : peers) {
-        if (peer.second.playerEntity) peer.second.pendingDelIds.push_back(id);
+        // peers never told about it don't need telling it's gone
+        auto& newIds = peer.second.pendingNewIds;
+        auto it = std::find(newIds.begin(), newIds.end(), id);
+        if (it != newIds.end())
+          newIds.erase(it);
+        else if (peer.second.playerEntity)
+          peer.second.pendingDelIds.push_back(id);
       }
     }
-    entities.erase(it);
+    entities.erase(id);
+    serializeCache.erase(id);
   } else {
     Log::printf(LOG_ERROR, "Attempt to delete entity id %i", id);
     throw std::runtime_error("Invalid delete entity id");
@@ -1031,7 +1677,11 @@ Entity* NetworkManager::instantiate(std::string typeName, int _id) {
   if (it != constructors.end()) {
     EntityId id = 0;
     if (_id == -1) {
-      id = lastId++;
+      // ids are not reused until they wrap around, so late packets about a
+      // deleted entity can't land on a new one
+      do {
+        id = lastId++;
+      } while (entities.contains(id));
     } else {
       id = _id;
     }
@@ -1040,13 +1690,13 @@ Entity* NetworkManager::instantiate(std::string typeName, int _id) {
       Log::printf(LOG_ERROR, "Constructor for %s is NULL", typeName.c_str());
       throw std::runtime_error("Could not instantiate entity");
     }
-    entities[id].reset(ent);
+    entities.insert(ent);
     if (backend) {
       for (auto& peer : peers) {
         if (peer.second.playerEntity) peer.second.pendingNewIds.push_back(id);
       }
     }
-    return entities[id].get();
+    return ent;
   } else {
     Log::printf(LOG_ERROR, "Could not instantiate entity of type %s",
                 typeName.c_str());
@@ -1054,26 +1704,16 @@ Entity* NetworkManager::instantiate(std::string typeName, int _id) {
   }
 }
 
-Entity* NetworkManager::findEntityByType(std::string typeName) {
-  for (auto& entity : entities) {
-    if (entity.second->getTypeName() == typeName) return entity.second.get();
-  }
-  return NULL;
+Entity* NetworkManager::findEntityByType(const std::string& typeName) {
+  auto& ofType = entities.ofType(typeName);
+  return ofType.empty() ? NULL : ofType.front();
 }
 
-Entity* NetworkManager::getEntityById(EntityId id) {
-  auto it = entities.find(id);
-  if (it == entities.end()) return NULL;
-  return it->second.get();
-}
+Entity* NetworkManager::getEntityById(EntityId id) { return entities.get(id); }
 
-std::vector<Entity*> NetworkManager::findEntitiesByType(std::string typeName) {
-  std::vector<Entity*> ret;
-  for (auto& entity : entities) {
-    if (entity.second->getTypeName() == typeName)
-      ret.push_back(entity.second.get());
-  }
-  return ret;
+const std::vector<Entity*>& NetworkManager::findEntitiesByType(
+    const std::string& typeName) {
+  return entities.ofType(typeName);
 }
 
 void NetworkManager::initialize() { enet_initialize(); }
@@ -1,16 +1,24 @@
 #pragma once
 #include <enet/enet.h>
 
+#include <atomic>
 #include <chrono>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "capture.hpp"
+#include "compress.hpp"
 #include "crc_hash.hpp"
 #include "defs.hpp"
 #include "entity.hpp"
+#include "entityslots.hpp"
 #include "player.hpp"
+#include "relevancy.hpp"
 #include "signal.hpp"
 
 #define NETWORK_STREAM_META 0
@@ -18,6 +26,22 @@
 #define NETWORK_STREAM_EVENT 3
 #define NETWORK_STREAM_MAX 4
 
+// unreliable entity snapshots kept per peer to delta against
+#define NETWORK_SNAPSHOT_HISTORY 32
+
+// bytes of a NewIdPacket batch per packet, under ENet's default MTU so the
+// packets go out unfragmented
+#define NETWORK_NEWID_CHUNK 1024
+// refuses batches claiming to decompress larger than this
+#define NETWORK_NEWID_MAX_SIZE (16 << 20)
+
+// set in the PacketId of a compressed packet, see NetworkManager::sendPacket
+#define NETWORK_PACKET_COMPRESSED 0x40000000
+// packets smaller than this are not worth compressing
+#define NETWORK_COMPRESS_MIN 32
+// refuses compressed packets claiming to decompress larger than this
+#define NETWORK_DECOMPRESS_MAX_SIZE (32 << 20)
+
 #define NETWORK_DISCONNECT_FORCED 0
 #define NETWORK_DISCONNECT_USER 1
 #define NETWORK_DISCONNECT_TIMEOUT 2
@@ -31,6 +55,14 @@ namespace rdm::network {
 typedef uint16_t CustomEventID;
 typedef std::vector<std::pair<CustomEventID, BitStream*>> CustomEventList;
 
+/**
+ * @brief The serializeUnreliable output of every entity sent in one tick.
+ */
+struct EntitySnapshot {
+  uint32_t sequence;
+  std::unordered_map<EntityId, std::vector<unsigned char>> states;
+};
+
 struct Peer {
   enum Type {
     ConnectedPlayer,
@@ -48,11 +80,21 @@ struct Peer {
   int roundTripTime;
   int packetLoss;
 
+  // agreed in the handshake, how packets sent to this peer (or, on clients,
+  // to the server) are compressed on each channel
+  PacketCodec codecs[NETWORK_STREAM_MAX] = {};
+
   CustomEventList queuedEvents;
   std::vector<EntityId> pendingNewIds;
   std::vector<EntityId> pendingDelIds;
   std::map<std::string, std::string> localCvarValues;
 
+  // server only, the snapshots sent to this peer and the newest it acked
+  std::deque<EntitySnapshot> snapshots;
+  uint32_t ackedSnapshot;
+  // server only, unreliable updates not sent to this peer yet
+  UpdateQueue unreliableQueue;
+
   Peer();
 };
 
@@ -79,6 +121,10 @@ class NetworkManager {
   float distributedTime;
   float nextDtPacket;
   float latency;
+  float packetTime;
+  // distributedTime as of the last service, for getClockTime on other threads
+  std::atomic<float> clockTime;
+  std::atomic<std::chrono::steady_clock::time_point> clockStamp;
 
   std::string playerType;
   std::string password;
@@ -86,7 +132,11 @@ class NetworkManager {
   std::string username;
 
   std::map<std::string, EntityConstructorFunction> constructors;
-  std::unordered_map<EntityId, std::unique_ptr<Entity>> entities;
+  // declared before entities so it outlives them, entities may unset it
+  std::unique_ptr<RelevancyFilter> relevancyFilter;
+  EntitySlotMap entities;
+  std::vector<EntityHandle> tickOrder;
+  std::vector<Entity*> tickParallelEntities;
 
   std::unordered_map<CustomEventID, CustomEventSignal> customSignals;
 
@@ -99,6 +149,87 @@ class NetworkManager {
   std::chrono::time_point<std::chrono::steady_clock> lastTick;
   ClosureId cvarChangingUpdate;
 
+  // delta compression of unreliable entity updates, see DeltaSnapshotPacket
+  uint32_t lastSnapshot;
+  uint32_t pendingSnapshotAck;
+  std::deque<EntitySnapshot> receivedSnapshots;
+  size_t snapshotFullBytes;
+  size_t snapshotSentBytes;
+  size_t snapshotTotalFullBytes;
+  size_t snapshotTotalSentBytes;
+
+  void sendSnapshot(Peer& peer, std::vector<EntityId>& ids);
+  void readSnapshot(BitStream& stream);
+
+  // entity types by index, the server's own in typeTable, the server's as
+  // told in the WelcomePacket in remoteTypeTable
+  std::vector<std::string> typeTable;
+  std::unordered_map<std::string, int> typeIds;
+  std::vector<std::string> remoteTypeTable;
+
+  // client only, NewIdPacket chunks of a batch not received whole yet
+  std::vector<unsigned char> newIdChunks;
+
+  // client only, how long joining took, see logJoinStats
+  std::chrono::steady_clock::time_point joinStart;
+  float joinTime;  // -1 until the local player is found
+  int joinPackets;
+  size_t joinEntities;
+  size_t joinBytes;
+  size_t joinRawBytes;
+
+  // compression, see sendPacket
+  std::vector<unsigned char> compressScratch;
+  std::atomic<int> codecSamplesWanted;
+  std::vector<std::vector<unsigned char>> codecSamples[NETWORK_STREAM_MAX];
+
+  PacketCapture capture;
+
+  static PacketCodec getPacketCodec(ENetPacket* packet);
+  ENetPacket* compressPacket(ENetPacket* packet, PacketCodec codec);
+  /**
+   * @param destroy Destroys packet, otherwise it is left for whoever else
+   * holds it
+   */
+  ENetPacket* decompressPacket(ENetPacket* packet, bool destroy);
+  /**
+   * @brief enet_peer_send, compressing packet with the codec agreed with the
+   * peer for the channel.
+   *
+   * Compressed packets have NETWORK_PACKET_COMPRESSED set in their PacketId,
+   * followed by the codec and the uncompressed size, so receiving them does
+   * not depend on the handshake. Packets already sent to another peer are
+   * sent as they are, unless this peer did not agree to their codec, then it
+   * is sent a copy recompressed with its own.
+   *
+   * @return The packet to send to more peers, compressed at most once
+   */
+  ENetPacket* sendPacket(ENetPeer* peer, enet_uint8 channel,
+                         ENetPacket* packet);
+  // enet_host_broadcast through sendPacket
+  void broadcastPacket(enet_uint8 channel, ENetPacket* packet);
+
+  void sendNewIds(Peer& peer);
+  void readNewIds(BitStream& stream);
+  void createEntities(std::vector<unsigned char>& batch);
+  std::vector<EntityId> peerUpdates;
+
+  // what each entity serialized to this tick, shared by every peer
+  struct SerializedEntity {
+    std::vector<unsigned char> states[4];  // [reliable * 2 + owner]
+    size_t generation[4] = {0, 0, 0, 0};
+  };
+  std::unordered_map<EntityId, SerializedEntity> serializeCache;
+  size_t serializeGeneration;
+  BitStream serializeScratch;
+
+  /**
+   * @brief Serializes ent with serialize() or serializeUnreliable() in the
+   * ToClient or ToClientLocal (owner) context, once per tick.
+   */
+  const std::vector<unsigned char>& getSerialized(Entity* ent, bool reliable,
+                                                  bool owner);
+
  public:
   NetworkManager(World* world);
   ~NetworkManager();
@@ -107,6 +238,20 @@ class NetworkManager {
   Game* getGame() { return game; }
 
   float getDistributedTime() { return distributedTime; };
+  /**
+   * @brief The distributedTime the packet being read was sent at, for
+   * stamping entity state put in a SnapshotBuffer.
+   *
+   * Delta snapshots carry the server's time, anything else is stamped when it
+   * arrives.
+   */
+  float getPacketTime() { return packetTime; }
+  /**
+   * @brief distributedTime advanced to the current moment. Unlike
+   * getDistributedTime it is safe to call from any thread and moves smoothly
+   * between network ticks.
+   */
+  float getClockTime();
   float getLatency() { return latency; }
 
   void handleDisconnect();
@@ -132,6 +277,8 @@ class NetworkManager {
     RconPacket,             // C -> S
     CvarPacket,             // S -> C, C -> S
     EventPacket,            // S -> C, C -> S
+    DeltaSnapshotPacket,    // S -> C
+    SnapshotAckPacket,      // C -> S
 
     WelcomePacket = PROTOCOL_VERSION,  // S -> C, beginning of handshake
     AuthenticatePacket,                // C -> S
@@ -148,13 +295,33 @@ class NetworkManager {
   Entity* instantiate(std::string typeName, int id = -1);
   void registerConstructor(EntityConstructorFunction func,
                            std::string typeName);
-  Entity* findEntityByType(std::string typeName);
-  std::vector<Entity*> findEntitiesByType(std::string typeName);
-
-  std::map<int, Peer> getPeers() { return peers; }
+  Entity* findEntityByType(const std::string& typeName);
+  /**
+   * @brief Valid until the next instantiate or deleteEntity, copy it to add
+   * or delete entities while iterating.
+   */
+  const std::vector<Entity*>& findEntitiesByType(const std::string& typeName);
+
+  std::map<int, Peer>& getPeers() { return peers; }
   Peer* getPeerById(int id);
 
   Entity* getEntityById(EntityId id);
+  EntityHandle getEntityHandle(EntityId id) { return entities.getHandle(id); }
+  /**
+   * @return NULL if the entity was deleted, even if its id is in use again
+   */
+  Entity* getEntityByHandle(EntityHandle handle) {
+    return entities.get(handle);
+  }
+
+  /**
+   * @brief Sets the filter deciding which entity updates each peer gets, see
+   * RelevancyFilter. Takes ownership, NULL sends everything to everyone.
+   */
+  void setRelevancyFilter(RelevancyFilter* filter) {
+    relevancyFilter.reset(filter);
+  }
+  RelevancyFilter* getRelevancyFilter() { return relevancyFilter.get(); }
 
   void addPendingUpdate(EntityId id) { pendingUpdates.push_back(id); };
   void addPendingUpdateUnreliable(EntityId id) {
@@ -170,6 +337,28 @@ class NetworkManager {
 
   void setUsername(std::string username) { this->username = username; };
   void listEntities();
+  /**
+   * @brief Logs how many bytes delta compression saved on the last tick and
+   * since the server started.
+   */
+  void logSnapshotStats();
+  /**
+   * @brief Logs how long it took from connecting until the local player
+   * existed along with everything else, and what it took to send.
+   */
+  void logJoinStats();
+  /**
+   * @brief Keeps a copy of the next packets sent, then logs how well each
+   * codec compresses them, see benchmarkCodecs.
+   */
+  void sampleCodecs(int packets) { codecSamplesWanted = packets; }
+  /**
+   * @brief Records every packet sent and received from now on to a file, to
+   * replay against a server with netreplay. Start it before clients connect
+   * so their handshakes are in it.
+   */
+  void startCapture(const std::string& path) { capture.open(path, backend); }
+  void stopCapture() { capture.close(); }
 
   void sendRconCommand(std::string password, std::string command) {
     pendingRconCommands.push_back({password, command});
@@ -15,6 +15,10 @@ bool Player::isLocalPlayer() {
   return getManager()->getLocalPeer().playerEntity == this;
 }
 
+bool Player::getOwnership(Peer* peer) {
+  return remotePeerId.get() >= 0 && peer->peerId == remotePeerId.get();
+}
+
 void Player::serialize(BitStream& stream) {
   Entity::serialize(stream);
   remotePeerId.serialize(stream);
@@ -19,6 +19,9 @@ class Player : public Entity {
 
   virtual std::string getEntityInfo();
 
+  // the peer controlling the player
+  virtual bool getOwnership(Peer* peer);
+
   virtual bool isDirty() { return remotePeerId.isDirty(); }
   virtual bool isBot() { return remotePeerId.get() == -2; }
   virtual void serialize(BitStream& stream);
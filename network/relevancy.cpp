@@ -0,0 +1,191 @@
+#include "relevancy.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+
+#include "console.hpp"
+#include "logging.hpp"
+
+namespace rdm::network {
+GridRelevancyFilter::GridRelevancyFilter(float cellSize, int radius) {
+  this->cellSize = cellSize;
+  this->radius = radius;
+}
+
+void GridRelevancyFilter::update() { cells.clear(); }
+
+bool GridRelevancyFilter::getCell(Entity* entity, glm::ivec3& cell) {
+  auto it = cells.find(entity);
+  if (it != cells.end()) {
+    cell = it->second;
+    return true;
+  }
+
+  glm::vec3 position;
+  if (!entity->getPosition(position)) return false;
+  cell = glm::ivec3(glm::floor(position / cellSize));
+  cells[entity] = cell;
+  return true;
+}
+
+float GridRelevancyFilter::getPriority(Entity* viewer, Entity* entity) {
+  glm::ivec3 viewerCell, entityCell;
+  if (!viewer || !getCell(viewer, viewerCell)) return 1.f;
+  if (!getCell(entity, entityCell)) return 1.f;
+
+  glm::ivec3 d = glm::abs(entityCell - viewerCell);
+  int distance = std::max(d.x, std::max(d.y, d.z));
+  if (distance > radius) return 0.f;
+  return 1.f / (1 + distance);
+}
+
+void UpdateQueue::remove(EntityId id) {
+  pending.erase(id);
+  sizes.erase(id);
+}
+
+void UpdateQueue::clear() {
+  pending.clear();
+  sizes.clear();
+}
+
+void UpdateQueue::pop(RelevancyFilter* filter, Entity* viewer,
+                      std::function<Entity*(EntityId)> lookup, size_t budget,
+                      std::vector<EntityId>& out) {
+  candidates.clear();
+  for (auto it = pending.begin(); it != pending.end();) {
+    Entity* entity = lookup(it->first);
+    if (!entity) {
+      sizes.erase(it->first);
+      it = pending.erase(it);
+      continue;
+    }
+
+    float priority = 1.f;
+    if (filter && entity != viewer) priority = filter->getPriority(viewer, entity);
+    if (priority <= 0.f) {
+      it = pending.erase(it);
+      continue;
+    }
+
+    it->second += priority;
+    if (it->second >= 1.f) candidates.push_back({it->second, it->first});
+    it++;
+  }
+
+  std::sort(candidates.begin(), candidates.end(),
+            [](auto& a, auto& b) { return a.first > b.first; });
+
+  size_t used = 0;
+  for (auto& candidate : candidates) {
+    auto size = sizes.find(candidate.second);
+    size_t estimate = size != sizes.end() ? size->second : 32;
+    // always let one through so a tiny budget can't starve everything
+    if (budget && used && used + estimate > budget) break;
+    used += estimate;
+    out.push_back(candidate.second);
+    pending.erase(candidate.second);
+  }
+}
+
+namespace {
+class BenchEntity : public Entity {
+ public:
+  glm::vec3 position;
+  glm::vec3 velocity;
+
+  BenchEntity(EntityId id) : Entity(NULL, id) {}
+
+  virtual bool getPosition(glm::vec3& position) {
+    position = this->position;
+    return true;
+  }
+
+  // about the size of a packed FpsController state
+  virtual void serializeUnreliable(BitStream& stream) {
+    stream.writeQuantizedFloat(position.x, -4096.f, 4096.f, 21);
+    stream.writeQuantizedFloat(position.y, -4096.f, 4096.f, 21);
+    stream.writeQuantizedFloat(position.z, -4096.f, 4096.f, 21);
+    stream.writeQuantizedFloat(velocity.x, -512.f, 512.f, 16);
+    stream.writeQuantizedFloat(velocity.y, -512.f, 512.f, 16);
+    stream.writeQuantizedFloat(velocity.z, -512.f, 512.f, 16);
+    stream.writeBits(0, 32);
+  }
+};
+
+size_t benchmarkRelevancy(int players, int ticks, RelevancyFilter* filter,
+                          size_t budget) {
+  srand(players);
+  std::vector<std::unique_ptr<BenchEntity>> entities;
+  for (int i = 0; i < players; i++) {
+    entities.push_back(std::make_unique<BenchEntity>(i));
+    entities[i]->position =
+        glm::vec3((rand() % 8000) - 4000.f, (rand() % 8000) - 4000.f, 0.f);
+    entities[i]->velocity = glm::vec3(0.f);
+  }
+  auto lookup = [&entities](EntityId id) -> Entity* {
+    return entities[id].get();
+  };
+
+  std::vector<UpdateQueue> queues(players);
+  std::vector<EntityId> updates;
+  BitStream stream;
+  size_t bytes = 0;
+  float dt = 1.f / 60.f;
+  for (int t = 0; t < ticks; t++) {
+    for (auto& entity : entities) {
+      entity->velocity +=
+          glm::vec3((rand() % 200) - 100.f, (rand() % 200) - 100.f, 0.f);
+      if (glm::length(entity->velocity) > 320.f)
+        entity->velocity = glm::normalize(entity->velocity) * 320.f;
+      entity->position =
+          glm::clamp(entity->position + entity->velocity * dt, -4000.f, 4000.f);
+    }
+    if (filter) filter->update();
+
+    for (int i = 0; i < players; i++) {
+      for (auto& entity : entities) queues[i].push(entity->getEntityId());
+      updates.clear();
+      queues[i].pop(filter, entities[i].get(), lookup, budget, updates);
+
+      stream.clear();
+      stream.write<int>(updates.size());
+      for (auto id : updates) {
+        size_t start = stream.getSize();
+        stream.write<EntityId>(id);
+        entities[id]->serializeUnreliable(stream);
+        queues[i].recordSize(id, stream.getSize() - start);
+      }
+      bytes += stream.getSize();
+    }
+  }
+  return bytes / ticks;
+}
+}  // namespace
+
+static ConsoleCommand bench_relevancy(
+    "bench_relevancy", "bench_relevancy [max players] [ticks] [budget]",
+    "shows server bytes/tick of player updates with and without relevancy "
+    "filtering",
+    [](Game* game, ConsoleArgReader r) {
+      int maxPlayers = std::atoi(r.next().c_str());
+      int ticks = std::atoi(r.next().c_str());
+      int budget = std::atoi(r.next().c_str());
+      if (maxPlayers <= 0) maxPlayers = 128;
+      if (ticks <= 0) ticks = 300;
+      if (budget <= 0) budget = 512;
+
+      Log::printf(LOG_INFO,
+                  "players: all / grid / grid + %i byte budget (bytes/tick)",
+                  budget);
+      for (int players = 8; players <= maxPlayers; players *= 2) {
+        GridRelevancyFilter grid;
+        size_t all = benchmarkRelevancy(players, ticks, NULL, 0);
+        size_t filtered = benchmarkRelevancy(players, ticks, &grid, 0);
+        size_t budgeted = benchmarkRelevancy(players, ticks, &grid, budget);
+        Log::printf(LOG_INFO, "%i: %zu / %zu / %zu", players, all, filtered,
+                    budgeted);
+      }
+    });
+}  // namespace rdm::network
@@ -0,0 +1,81 @@
+#pragma once
+#include <functional>
+#include <glm/glm.hpp>
+#include <unordered_map>
+#include <vector>
+
+#include "entity.hpp"
+
+namespace rdm::network {
+/**
+ * @brief Decides how often each entity's unreliable updates are sent to a
+ * peer.
+ *
+ * The NetworkManager calls update() once per tick, then getPriority() for every
+ * entity with a pending update for every peer. A priority of 1 sends the
+ * update every tick, 0.25 about every fourth tick and 0 drops it.
+ */
+class RelevancyFilter {
+ public:
+  virtual ~RelevancyFilter() {};
+
+  virtual void update() {};
+  /**
+   * @param viewer The peer's player entity, NULL if it has none yet
+   */
+  virtual float getPriority(Entity* viewer, Entity* entity) = 0;
+};
+
+/**
+ * @brief Buckets positioned entities into cubic cells and lowers the priority
+ * of entities by how many cells away from the viewer they are.
+ */
+class GridRelevancyFilter : public RelevancyFilter {
+  float cellSize;
+  int radius;
+  std::unordered_map<Entity*, glm::ivec3> cells;
+
+  bool getCell(Entity* entity, glm::ivec3& cell);
+
+ public:
+  /**
+   * @param radius Entities further than this many cells away are culled
+   */
+  GridRelevancyFilter(float cellSize = 512.f, int radius = 4);
+
+  virtual void update();
+  virtual float getPriority(Entity* viewer, Entity* entity);
+};
+
+/**
+ * @brief The unreliable updates waiting to be sent to one peer.
+ *
+ * Each pending entity accumulates its priority every tick and is sent once
+ * it reaches 1, highest first, until the byte budget for the tick is spent.
+ * Updates that do not fit keep their priority so they go out first next time.
+ */
+class UpdateQueue {
+  std::unordered_map<EntityId, float> pending;
+  std::unordered_map<EntityId, size_t> sizes;
+  std::vector<std::pair<float, EntityId>> candidates;
+
+ public:
+  void push(EntityId id) { pending.try_emplace(id, 0.f); }
+  void remove(EntityId id);
+  // remembered to estimate what the entity will cost next time
+  void recordSize(EntityId id, size_t size) { sizes[id] = size; }
+
+  /**
+   * @brief Moves the updates to send this tick into out.
+   *
+   * @param lookup Returns the entity for an id, or NULL if it was deleted
+   * @param budget Bytes of entity state allowed this tick, 0 for unlimited
+   */
+  void pop(RelevancyFilter* filter, Entity* viewer,
+           std::function<Entity*(EntityId)> lookup, size_t budget,
+           std::vector<EntityId>& out);
+
+  size_t size() { return pending.size(); }
+  void clear();
+};
+}  // namespace rdm::network
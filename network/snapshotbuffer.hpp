@@ -0,0 +1,78 @@
+#pragma once
+#include <stddef.h>
+
+#include <algorithm>
+#include <deque>
+
+namespace rdm::network {
+/**
+ * @brief Time stamped copies of a replicated state, sampled some time in the
+ * past so there is usually a snapshot on both sides of the sample.
+ *
+ * T must provide `static T interpolate(const T& a, const T& b, float t)`. t
+ * goes past 1 when extrapolating.
+ *
+ * @tparam T The state type
+ */
+template <typename T>
+class SnapshotBuffer {
+  struct Entry {
+    float time;
+    T value;
+  };
+
+  std::deque<Entry> entries;
+  size_t capacity;
+
+ public:
+  SnapshotBuffer(size_t capacity = 32) : capacity(capacity) {}
+
+  /**
+   * @brief Adds a snapshot. Snapshots older than the newest one (reordered
+   * unreliable packets) are dropped.
+   */
+  void push(float time, const T& value) {
+    if (!entries.empty() && time <= entries.back().time) return;
+    entries.push_back(Entry{time, value});
+    while (entries.size() > capacity) entries.pop_front();
+  }
+
+  /**
+   * @brief Samples the state at time.
+   *
+   * Past the newest snapshot the last two are extrapolated, for at most
+   * maxExtrapolation seconds, after which the state holds still.
+   *
+   * @return false if there are no snapshots
+   */
+  bool sample(float time, float maxExtrapolation, T& out) const {
+    if (entries.empty()) return false;
+    if (entries.size() == 1 || time <= entries.front().time) {
+      out = entries.front().value;
+      return true;
+    }
+
+    const Entry& newest = entries.back();
+    if (time >= newest.time) {
+      const Entry& previous = entries[entries.size() - 2];
+      time = std::min(time, newest.time + maxExtrapolation);
+      out = T::interpolate(previous.value, newest.value,
+                           (time - previous.time) /
+                               (newest.time - previous.time));
+      return true;
+    }
+
+    auto next = std::upper_bound(
+        entries.begin(), entries.end(), time,
+        [](float time, const Entry& entry) { return time < entry.time; });
+    auto previous = next - 1;
+    out = T::interpolate(previous->value, next->value,
+                         (time - previous->time) / (next->time - previous->time));
+    return true;
+  }
+
+  void clear() { entries.clear(); }
+  size_t size() const { return entries.size(); }
+  float newestTime() const { return entries.empty() ? 0.f : entries.back().time; }
+};
+}  // namespace rdm::network
@@ -3,10 +3,18 @@
 #include <bullet/BulletCollision/BroadphaseCollision/btDbvtBroadphase.h>
 #include <bullet/BulletCollision/CollisionDispatch/btCollisionConfiguration.h>
 #include <bullet/BulletCollision/CollisionDispatch/btCollisionDispatcher.h>
+#include <bullet/BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h>
+#include <bullet/BulletDynamics/ConstraintSolver/btSequentialImpulseConstraintSolverMt.h>
+#include <bullet/LinearMath/btThreads.h>
+
+#include <algorithm>
+#include <random>
 
 #include "LinearMath/btIDebugDraw.h"
 #include "gfx/base_device.hpp"
 #include "gfx/base_types.hpp"
+#include "console.hpp"
+#include "game.hpp"
 #include "gfx/engine.hpp"
 #include "logging.hpp"
 #include "scheduler.hpp"
@@ -14,11 +22,135 @@
 #include "world.hpp"
 
 namespace rdm {
+static CVar phys_rate("phys_rate", "60.0", CVARF_SAVE | CVARF_GLOBAL);
+static CVar phys_threaded("phys_threaded", "0", CVARF_SAVE | CVARF_GLOBAL);
+static CVar phys_threads("phys_threads", "0", CVARF_SAVE | CVARF_GLOBAL);
+
+// queries run by one worker at a time, a ray test is quick
+#define PHYSICS_QUERY_GRAIN 16
+
+// runs Bullet's parallel loops on the SchedulerPool, so the Mt pipeline shares
+// the workers the rest of the engine uses instead of starting its own
+class PhysicsTaskScheduler : public btITaskScheduler {
+  std::atomic<int> numThreads;  // 0 is every worker
+  static thread_local int localThreads;
+
+ public:
+  // doesn't touch the pool, which starts on first use
+  PhysicsTaskScheduler() : btITaskScheduler("SchedulerPool"), numThreads(0) {}
+
+  virtual int getMaxNumThreads() const {
+    return std::min((int)SchedulerPool::singleton()->getWorkerCount(),
+                    BT_MAX_THREAD_COUNT);
+  }
+  virtual int getNumThreads() const {
+    int threads = localThreads ? localThreads : numThreads.load();
+    return threads ? threads : getMaxNumThreads();
+  }
+  virtual void setNumThreads(int threads) {
+    numThreads = std::clamp(threads, 1, getMaxNumThreads());
+  }
+  void setLocalNumThreads(int threads) {
+    localThreads = threads > 0 ? std::min(threads, getMaxNumThreads()) : 0;
+  }
+
+  virtual void parallelFor(int iBegin, int iEnd, int grainSize,
+                           const btIParallelForBody& body) {
+    // no more chunks than threads, Bullet's grain is only a lower bound
+    size_t count = iEnd - iBegin;
+    size_t threads = getNumThreads();
+    size_t grain = std::max((size_t)std::max(grainSize, 1),
+                            (count + threads - 1) / threads);
+    Scheduler::parallelFor(
+        iBegin, iEnd,
+        [&body](size_t begin, size_t end) { body.forLoop(begin, end); },
+        grain);
+  }
+
+  virtual btScalar parallelSum(int iBegin, int iEnd, int grainSize,
+                               const btIParallelSumBody& body) {
+    std::mutex sumMutex;
+    btScalar sum = 0;
+    size_t count = iEnd - iBegin;
+    size_t threads = getNumThreads();
+    size_t grain = std::max((size_t)std::max(grainSize, 1),
+                            (count + threads - 1) / threads);
+    Scheduler::parallelFor(
+        iBegin, iEnd,
+        [&](size_t begin, size_t end) {
+          btScalar part = body.sumLoop(begin, end);
+          std::scoped_lock l(sumMutex);
+          sum += part;
+        },
+        grain);
+    return sum;
+  }
+};
+
+thread_local int PhysicsTaskScheduler::localThreads = 0;
+
+static PhysicsTaskScheduler* getTaskScheduler() {
+  // installed by the first threaded pipeline, worlds are made on the main
+  // thread as btSetTaskScheduler wants. serial pipelines never need it
+  static PhysicsTaskScheduler* scheduler = [] {
+    PhysicsTaskScheduler* scheduler = new PhysicsTaskScheduler();
+    btSetTaskScheduler(scheduler);
+    return scheduler;
+  }();
+  return scheduler;
+}
+
+PhysicsPipeline::PhysicsPipeline(bool threaded) : threaded(threaded) {
+  if (threaded) getTaskScheduler();
+
+  overlappingPairCache.reset(new btDbvtBroadphase());
+  collisionConfiguration.reset(new btDefaultCollisionConfiguration());
+  if (threaded) {
+    dispatcher.reset(new btCollisionDispatcherMt(collisionConfiguration.get()));
+    // small islands each go to a solver from the pool, large ones to the Mt
+    // solver
+    solverPool.reset(new btConstraintSolverPoolMt(getMaxThreadCount()));
+    solver.reset(new btSequentialImpulseConstraintSolverMt());
+    dynamicsWorld.reset(new btDiscreteDynamicsWorldMt(
+        dispatcher.get(), overlappingPairCache.get(), solverPool.get(),
+        solver.get(), collisionConfiguration.get()));
+  } else {
+    dispatcher.reset(new btCollisionDispatcher(collisionConfiguration.get()));
+    solver.reset(new btSequentialImpulseConstraintSolver);
+    dynamicsWorld.reset(new btDiscreteDynamicsWorld(
+        dispatcher.get(), overlappingPairCache.get(), solver.get(),
+        collisionConfiguration.get()));
+  }
+  dynamicsWorld->setGravity(btVector3(0, -10, 0));
+}
+
+void PhysicsPipeline::setThreadCount(int threads) {
+  getTaskScheduler()->setNumThreads(threads > 0 ? threads
+                                                : getMaxThreadCount());
+}
+
+int PhysicsPipeline::getThreadCount() {
+  return getTaskScheduler()->getNumThreads();
+}
+
+int PhysicsPipeline::getMaxThreadCount() {
+  return getTaskScheduler()->getMaxNumThreads();
+}
+
+void PhysicsPipeline::setLocalThreadCount(int threads) {
+  getTaskScheduler()->setLocalNumThreads(threads);
+}
+
 class PhysicsJob : public SchedulerJob {
   PhysicsWorld* world;
 
  public:
-  virtual double getFrameRate() { return PHYSICS_FRAMERATE; }
+  // only how often the job wakes, stepWorld steps by PHYSICS_FRAMERATE
+  // however much time passed
+  virtual double getFrameRate() {
+    float rate = phys_rate.getFloat();
+    return rate > 0.f ? 1.0 / rate : PHYSICS_FRAMERATE;
+  }
 
   PhysicsJob(PhysicsWorld* _world) : SchedulerJob("Physics"), world(_world) {}
 
@@ -100,21 +232,32 @@ class DebugDrawer : public btIDebugDraw {
   }
 };
 
-PhysicsWorld::PhysicsWorld(World* world) {
-  world->getScheduler()->addJob(new PhysicsJob(this));
+PhysicsWorld::PhysicsWorld(World* world)
+    : pipeline(phys_threaded.getBool()) {
+  if (world) world->getScheduler()->addJob(new PhysicsJob(this));
 
   debugDrawInit = false;
+  debugDrawEnabled = false;
+  stepSimulation = true;
+  accumulator = 0.0;
+  stepped = false;
+  droppedSteps = 0;
+  transforms = NULL;
+  transformReaders = 0;
+  deliveringOwner = NULL;
 
-  collisionConfiguration.reset(new btDefaultCollisionConfiguration());
-  dispatcher.reset(new btCollisionDispatcher(collisionConfiguration.get()));
-  overlappingPairCache.reset(new btDbvtBroadphase());
-  solver.reset(new btSequentialImpulseConstraintSolver);
-  dynamicsWorld.reset(
-      new btDiscreteDynamicsWorld(dispatcher.get(), overlappingPairCache.get(),
-                                  solver.get(), collisionConfiguration.get()));
-  dynamicsWorld->setGravity(btVector3(0, -10, 0));
-
-  Log::printf(LOG_DEBUG, "Initialized physics world");
+  if (pipeline.threaded) {
+#if !BT_THREADSAFE
+    Log::printf(LOG_WARN,
+                "phys_threaded is set but Bullet was built without "
+                "BT_THREADSAFE, the world will step serially");
+#endif
+    PhysicsPipeline::setThreadCount(phys_threads.getInt());
+    Log::printf(LOG_DEBUG, "Initialized physics world on %i threads",
+                PhysicsPipeline::getThreadCount());
+  } else {
+    Log::printf(LOG_DEBUG, "Initialized physics world");
+  }
 }
 
 static CVar r_physics("r_physics", "0", CVARF_SAVE | CVARF_GLOBAL);
@@ -124,7 +267,7 @@ void PhysicsWorld::initializeDebugDraw(rdm::gfx::Engine* engine) {
 
   debugDraw.reset(new DebugDrawer(engine));
 
-  dynamicsWorld->setDebugDrawer(debugDraw.get());
+  pipeline.dynamicsWorld->setDebugDrawer(debugDraw.get());
   debugDrawInit = true;
 }
 
@@ -137,29 +280,569 @@ void PhysicsWorld::stepWorld() {
           break;
         default:
         case 1:
-          dynamicsWorld->getDebugDrawer()->setDebugMode(
+          pipeline.dynamicsWorld->getDebugDrawer()->setDebugMode(
               btIDebugDraw::DBG_DrawAabb | btIDebugDraw::DBG_DrawText);
           break;
         case 2:
-          dynamicsWorld->getDebugDrawer()->setDebugMode(
+          pipeline.dynamicsWorld->getDebugDrawer()->setDebugMode(
               btIDebugDraw::DBG_DrawWireframe | btIDebugDraw::DBG_DrawAabb);
           break;
         case 3:
-          dynamicsWorld->getDebugDrawer()->setDebugMode(
+          pipeline.dynamicsWorld->getDebugDrawer()->setDebugMode(
               btIDebugDraw::DBG_DrawNormals);
           break;
         case 4:
-          dynamicsWorld->getDebugDrawer()->setDebugMode(
+          pipeline.dynamicsWorld->getDebugDrawer()->setDebugMode(
               btIDebugDraw::DBG_DrawContactPoints);
           break;
         case 5:
-          dynamicsWorld->getDebugDrawer()->setDebugMode(
+          pipeline.dynamicsWorld->getDebugDrawer()->setDebugMode(
               btIDebugDraw::DBG_MAX_DEBUG_DRAW_MODE);
           break;
       }
 
-    if (stepSimulation) dynamicsWorld->stepSimulation(PHYSICS_FRAMERATE, 10);
   }
-  if (stepSimulation) physicsStepping.fire();
+
+  auto now = std::chrono::steady_clock::now();
+  if (!stepSimulation || !stepped) {
+    // the first step is one step long
+    accumulator = stepSimulation ? PHYSICS_FRAMERATE : 0.0;
+    stepped = stepSimulation;
+  } else {
+    accumulator += std::chrono::duration<double>(now - lastStep).count();
+  }
+  lastStep = now;
+
+  int steps = 0;
+  while (accumulator >= PHYSICS_FRAMERATE) {
+    if (steps == PHYSICS_MAX_SUBSTEPS) {
+      // too far behind to catch up, the time is lost
+      droppedSteps += (size_t)(accumulator / PHYSICS_FRAMERATE);
+      accumulator = 0.0;
+      break;
+    }
+    stepFixed();
+    accumulator -= PHYSICS_FRAMERATE;
+    steps++;
+  }
+
+  // nothing moved, but the queue should not wait on the next step
+  if (steps == 0) {
+    {
+      std::scoped_lock l(mutex);
+      runQueries();
+    }
+    deliverQueries();
+  }
+}
+
+void PhysicsWorld::stepFixed() {
+  {
+    std::scoped_lock l(mutex);
+    pipeline.dynamicsWorld->stepSimulation(PHYSICS_FRAMERATE, 0);
+    runQueries();
+  }
+  deliverQueries();
+  physicsStepping.fire();
+  {
+    std::scoped_lock l(mutex);
+    publishTransforms();
+  }
 }
+
+namespace {
+struct QueryRayCallback : public btCollisionWorld::ClosestRayResultCallback {
+  const btCollisionObject* ignore;
+
+  QueryRayCallback(const btVector3& from, const btVector3& to,
+                   const btCollisionObject* ignore)
+      : ClosestRayResultCallback(from, to), ignore(ignore) {}
+
+  virtual bool needsCollision(btBroadphaseProxy* proxy) const {
+    if (proxy->m_clientObject == ignore) return false;
+    return ClosestRayResultCallback::needsCollision(proxy);
+  }
+};
+
+struct QuerySweepCallback
+    : public btCollisionWorld::ClosestConvexResultCallback {
+  const btCollisionObject* ignore;
+
+  QuerySweepCallback(const btVector3& from, const btVector3& to,
+                     const btCollisionObject* ignore)
+      : ClosestConvexResultCallback(from, to), ignore(ignore) {}
+
+  virtual bool needsCollision(btBroadphaseProxy* proxy) const {
+    if (proxy->m_clientObject == ignore) return false;
+    return ClosestConvexResultCallback::needsCollision(proxy);
+  }
+};
+
+struct QueryContactCallback : public btCollisionWorld::ContactResultCallback {
+  const btCollisionObject* object;
+  std::vector<const btCollisionObject*>& overlaps;
+
+  QueryContactCallback(const btCollisionObject* object,
+                       std::vector<const btCollisionObject*>& overlaps)
+      : object(object), overlaps(overlaps) {}
+
+  virtual btScalar addSingleResult(btManifoldPoint& cp,
+                                   const btCollisionObjectWrapper* a, int,
+                                   int, const btCollisionObjectWrapper* b,
+                                   int, int) {
+    const btCollisionObject* other = a->getCollisionObject() == object
+                                         ? b->getCollisionObject()
+                                         : a->getCollisionObject();
+    if (std::find(overlaps.begin(), overlaps.end(), other) == overlaps.end())
+      overlaps.push_back(other);
+    return 0;
+  }
+};
+
+void runQuery(btDiscreteDynamicsWorld* world, PhysicsQuery& query) {
+  PhysicsQueryResult& result = query.result;
+  switch (query.type) {
+    case PhysicsQuery::Ray: {
+      QueryRayCallback callback(query.from.getOrigin(), query.to.getOrigin(),
+                                query.ignore);
+      world->rayTest(query.from.getOrigin(), query.to.getOrigin(), callback);
+      result.hit = callback.hasHit();
+      result.object = callback.m_collisionObject;
+      result.point = callback.m_hitPointWorld;
+      result.normal = callback.m_hitNormalWorld;
+      result.fraction = callback.m_closestHitFraction;
+    } break;
+    case PhysicsQuery::Sweep: {
+      QuerySweepCallback callback(query.from.getOrigin(),
+                                  query.to.getOrigin(), query.ignore);
+      world->convexSweepTest(query.shape, query.from, query.to, callback);
+      result.hit = callback.hasHit();
+      result.object = callback.m_hitCollisionObject;
+      result.point = callback.m_hitPointWorld;
+      result.normal = callback.m_hitNormalWorld;
+      result.fraction = callback.m_closestHitFraction;
+    } break;
+    case PhysicsQuery::Overlap: {
+      QueryContactCallback callback(query.object, result.overlaps);
+      world->contactTest(const_cast<btCollisionObject*>(query.object),
+                         callback);
+      result.hit = result.overlaps.size() != 0;
+      result.object = result.hit ? result.overlaps[0] : NULL;
+    } break;
+  }
+}
+}  // namespace
+
+void PhysicsWorld::queueQuery(PhysicsQuery query) {
+  query.cancelled = false;
+  std::scoped_lock l(queryMutex);
+  queuedQueries.push_back(std::move(query));
+}
+
+void PhysicsWorld::queueRay(const btVector3& from, const btVector3& to,
+                            PhysicsQueryCallback callback,
+                            const btCollisionObject* ignore, void* owner) {
+  PhysicsQuery query;
+  query.type = PhysicsQuery::Ray;
+  query.from.setIdentity();
+  query.from.setOrigin(from);
+  query.to.setIdentity();
+  query.to.setOrigin(to);
+  query.shape = NULL;
+  query.object = NULL;
+  query.ignore = ignore;
+  query.owner = owner;
+  query.callback = callback;
+  queueQuery(std::move(query));
+}
+
+void PhysicsWorld::queueSweep(const btConvexShape* shape,
+                              const btTransform& from, const btTransform& to,
+                              PhysicsQueryCallback callback,
+                              const btCollisionObject* ignore, void* owner) {
+  PhysicsQuery query;
+  query.type = PhysicsQuery::Sweep;
+  query.from = from;
+  query.to = to;
+  query.shape = shape;
+  query.object = NULL;
+  query.ignore = ignore;
+  query.owner = owner;
+  query.callback = callback;
+  queueQuery(std::move(query));
+}
+
+void PhysicsWorld::queueOverlap(const btCollisionObject* object,
+                                PhysicsQueryCallback callback, void* owner) {
+  PhysicsQuery query;
+  query.type = PhysicsQuery::Overlap;
+  query.from = object->getWorldTransform();
+  query.to = query.from;
+  query.shape = NULL;
+  query.object = object;
+  query.ignore = object;
+  query.owner = owner;
+  query.callback = callback;
+  queueQuery(std::move(query));
+}
+
+void PhysicsWorld::cancelQueries(void* owner) {
+  if (!owner) return;
+  {
+    std::scoped_lock l(queryMutex);
+    std::erase_if(queuedQueries, [owner](const PhysicsQuery& query) {
+      return query.owner == owner;
+    });
+    for (auto& query : runningQueries)
+      if (query.owner == owner) query.cancelled = true;
+  }
+
+  // wait out a callback on the physics thread, unless this is it
+  while (true) {
+    {
+      std::scoped_lock l(queryMutex);
+      if (deliveringOwner != owner ||
+          deliveringThread == std::this_thread::get_id())
+        return;
+    }
+    std::this_thread::yield();
+  }
+}
+
+PhysicsQueryCallback PhysicsWorld::futureCallback(
+    std::future<PhysicsQueryResult>& future) {
+  auto promise = std::make_shared<std::promise<PhysicsQueryResult>>();
+  future = promise->get_future();
+  return [promise](const PhysicsQueryResult& result) {
+    promise->set_value(result);
+  };
+}
+
+void PhysicsWorld::runQueries() {
+  {
+    std::scoped_lock l(queryMutex);
+    if (queuedQueries.empty()) return;
+    std::swap(queuedQueries, runningQueries);
+  }
+
+  // the world does not change until the mutex is unlocked, the workers only
+  // read it
+  btDiscreteDynamicsWorld* world = pipeline.dynamicsWorld.get();
+  auto run = [this, world](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) runQuery(world, runningQueries[i]);
+  };
+#if BT_THREADSAFE
+  Scheduler::parallelFor(0, runningQueries.size(), run, PHYSICS_QUERY_GRAIN);
+#else
+  // the broadphase shares one ray test stack unless Bullet is thread safe
+  run(0, runningQueries.size());
+#endif
+}
+
+void PhysicsWorld::deliverQueries() {
+  for (auto& query : runningQueries) {
+    {
+      std::scoped_lock l(queryMutex);
+      if (query.cancelled || !query.callback) continue;
+      deliveringOwner = query.owner;
+      deliveringThread = std::this_thread::get_id();
+    }
+    query.callback(query.result);
+    std::scoped_lock l(queryMutex);
+    deliveringOwner = NULL;
+  }
+
+  std::scoped_lock l(queryMutex);
+  runningQueries.clear();
+}
+
+void PhysicsWorld::publishTransforms() {
+  PhysicsTransformSnapshot* last = transforms.load();
+  PhysicsTransformSnapshot* next;
+  if (freeTransforms.size()) {
+    next = freeTransforms.back();
+    freeTransforms.pop_back();
+  } else {
+    transformPool.push_back(std::make_unique<PhysicsTransformSnapshot>());
+    next = transformPool.back().get();
+  }
+
+  next->time = std::chrono::steady_clock::now();
+  next->objects.clear();
+  btCollisionObjectArray& objects =
+      pipeline.dynamicsWorld->getCollisionObjectArray();
+  for (int i = 0; i < objects.size(); i++)
+    if (!objects[i]->isStaticObject()) next->objects.push_back(objects[i]);
+  std::sort(next->objects.begin(), next->objects.end());
+
+  // both sorted, so the previous transforms are found in one walk
+  next->previous.resize(next->objects.size());
+  next->current.resize(next->objects.size());
+  size_t j = 0;
+  for (size_t i = 0; i < next->objects.size(); i++) {
+    const btCollisionObject* object = next->objects[i];
+    next->current[i] = object->getWorldTransform();
+    if (last)
+      while (j < last->objects.size() && last->objects[j] < object) j++;
+    if (last && j < last->objects.size() && last->objects[j] == object)
+      next->previous[i] = last->current[j];
+    else
+      next->previous[i] = next->current[i];
+  }
+
+  PhysicsTransformSnapshot* old = transforms.exchange(next);
+  if (old) retiredTransforms.push_back(old);
+  // a reader that started before the exchange is counted in transformReaders,
+  // one that starts after it can only see next
+  if (transformReaders == 0) {
+    freeTransforms.insert(freeTransforms.end(), retiredTransforms.begin(),
+                          retiredTransforms.end());
+    retiredTransforms.clear();
+  }
+}
+
+bool PhysicsWorld::readTransform(const btCollisionObject* object,
+                                 btTransform& transform, bool interpolate) {
+  transformReaders++;
+  PhysicsTransformSnapshot* snapshot = transforms.load();
+  bool found = false;
+  if (snapshot) {
+    auto it = std::lower_bound(snapshot->objects.begin(),
+                               snapshot->objects.end(), object);
+    if (it != snapshot->objects.end() && *it == object) {
+      size_t i = it - snapshot->objects.begin();
+      transform = snapshot->current[i];
+      if (interpolate) {
+        float t = std::chrono::duration<float>(
+                      std::chrono::steady_clock::now() - snapshot->time)
+                      .count() /
+                  PHYSICS_FRAMERATE;
+        t = std::clamp(t, 0.f, 1.f);
+        const btTransform& previous = snapshot->previous[i];
+        transform.setOrigin(
+            previous.getOrigin().lerp(snapshot->current[i].getOrigin(), t));
+        transform.setRotation(previous.getRotation().slerp(
+            snapshot->current[i].getRotation(), t));
+      }
+      found = true;
+    }
+  }
+  transformReaders--;
+  return found;
+}
+
+namespace {
+struct BenchStatic {
+  btCollisionShape* shape;
+  btTransform transform;
+};
+
+// copies of the running world's static shapes, which are freed with its map
+// while the bench steps
+class BenchShapes : public btTriangleCallback {
+  std::vector<std::unique_ptr<btCollisionShape>> shapes;
+  std::vector<std::unique_ptr<btTriangleMesh>> meshes;
+
+ public:
+  virtual void processTriangle(btVector3* triangle, int partId,
+                               int triangleIndex) {
+    meshes.back()->addTriangle(triangle[0], triangle[1], triangle[2]);
+  }
+
+  // NULL for shapes the bench doesn't know how to copy
+  btCollisionShape* clone(const btCollisionShape* shape) {
+    btCollisionShape* copy = NULL;
+    switch (shape->getShapeType()) {
+      case BOX_SHAPE_PROXYTYPE:
+        // the half extents are already scaled
+        copy = new btBoxShape(
+            ((const btBoxShape*)shape)->getHalfExtentsWithoutMargin());
+        break;
+      case SPHERE_SHAPE_PROXYTYPE:
+        copy = new btSphereShape(((const btSphereShape*)shape)->getRadius());
+        break;
+      case STATIC_PLANE_PROXYTYPE: {
+        const btStaticPlaneShape* plane = (const btStaticPlaneShape*)shape;
+        copy = new btStaticPlaneShape(plane->getPlaneNormal(),
+                                      plane->getPlaneConstant());
+      } break;
+      case CONVEX_HULL_SHAPE_PROXYTYPE: {
+        const btConvexHullShape* hull = (const btConvexHullShape*)shape;
+        copy = new btConvexHullShape(
+            (const btScalar*)hull->getUnscaledPoints(), hull->getNumPoints());
+        copy->setLocalScaling(hull->getLocalScaling());
+      } break;
+      case COMPOUND_SHAPE_PROXYTYPE: {
+        const btCompoundShape* compound = (const btCompoundShape*)shape;
+        btCompoundShape* children =
+            new btCompoundShape(true, compound->getNumChildShapes());
+        shapes.emplace_back(children);
+        for (int i = 0; i < compound->getNumChildShapes(); i++)
+          if (btCollisionShape* child = clone(compound->getChildShape(i)))
+            children->addChildShape(compound->getChildTransform(i), child);
+        children->setMargin(shape->getMargin());
+        return children;
+      }
+      case TRIANGLE_MESH_SHAPE_PROXYTYPE: {
+        // the triangles come out scaled
+        meshes.emplace_back(new btTriangleMesh());
+        btVector3 aabbMax(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+        ((const btConcaveShape*)shape)
+            ->processAllTriangles(this, -aabbMax, aabbMax);
+        if (!meshes.back()->getNumTriangles()) {
+          meshes.pop_back();
+          return NULL;
+        }
+        copy = new btBvhTriangleMeshShape(meshes.back().get(), true);
+      } break;
+      default:
+        return NULL;
+    }
+    copy->setMargin(shape->getMargin());
+    shapes.emplace_back(copy);
+    return copy;
+  }
+};
+
+// mean time of one step of a fresh pipeline with balls dropped on statics
+double benchPipeline(bool threaded, const std::vector<BenchStatic>& statics,
+                     const btVector3& gravity, int balls, int steps,
+                     int& manifolds) {
+  PhysicsPipeline pipeline(threaded);
+  btDiscreteDynamicsWorld* world = pipeline.dynamicsWorld.get();
+  world->setGravity(gravity);
+
+  std::vector<std::unique_ptr<btRigidBody>> bodies;
+  btVector3 aabbMin(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+  btVector3 aabbMax = -aabbMin;
+  for (auto& object : statics) {
+    btRigidBody::btRigidBodyConstructionInfo info(0.0, NULL, object.shape);
+    info.m_startWorldTransform = object.transform;
+    bodies.emplace_back(new btRigidBody(info));
+    world->addRigidBody(bodies.back().get());
+
+    btVector3 min, max;
+    object.shape->getAabb(object.transform, min, max);
+    aabbMin.setMin(min);
+    aabbMax.setMax(max);
+  }
+
+  // about as big next to the gravity as a raymarcher ball, in either units
+  btScalar radius = std::max(gravity.length() * btScalar(0.05), btScalar(0.1));
+  btSphereShape sphere(radius);
+  btVector3 inertia;
+  sphere.calculateLocalInertia(1.0, inertia);
+  btVector3 up =
+      gravity.fuzzyZero() ? btVector3(0, 1, 0) : -gravity.normalized();
+  btVector3 extent = aabbMax - aabbMin;
+
+  // the same drop every run
+  std::mt19937 random(balls);
+  std::uniform_real_distribution<btScalar> unit(0.0, 1.0);
+  for (int i = 0; i < balls; i++) {
+    btVector3 position(aabbMin.x() + extent.x() * unit(random),
+                       aabbMin.y() + extent.y() * unit(random),
+                       aabbMin.z() + extent.z() * unit(random));
+    // dropped from a little above whatever is under the point
+    btVector3 below = position - up * extent.length();
+    btCollisionWorld::ClosestRayResultCallback hit(position, below);
+    world->rayTest(position, below, hit);
+    if (hit.hasHit()) position = hit.m_hitPointWorld;
+    position += up * radius * (2.0 + 8.0 * unit(random));
+
+    btRigidBody::btRigidBodyConstructionInfo info(1.0, NULL, &sphere, inertia);
+    info.m_startWorldTransform.setIdentity();
+    info.m_startWorldTransform.setOrigin(position);
+    info.m_friction = 0.1;
+    info.m_restitution = 1.0;
+    bodies.emplace_back(new btRigidBody(info));
+    world->addRigidBody(bodies.back().get());
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < steps; i++) world->stepSimulation(PHYSICS_FRAMERATE, 0);
+  double time = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count() /
+                steps;
+
+  manifolds = world->getDispatcher()->getNumManifolds();
+  for (auto& body : bodies) world->removeRigidBody(body.get());
+  return time;
+}
+}  // namespace
+
+static ConsoleCommand bench_physics(
+    "bench_physics", "bench_physics [balls] [steps]",
+    "times steps of balls dropped on the world's static bodies, serial and "
+    "multithreaded on more and more threads",
+    [](Game* game, ConsoleArgReader r) {
+      int balls = std::atoi(r.next().c_str());
+      int steps = std::atoi(r.next().c_str());
+      if (balls <= 0) balls = 500;
+      if (steps <= 0) steps = 300;
+
+      // the statics are copied, a map change frees the world's shapes while
+      // the bench is still stepping them
+      BenchShapes shapes;
+      std::vector<BenchStatic> statics;
+      int skipped = 0;
+      btVector3 gravity(0, -10, 0);
+      World* world =
+          game->getServerWorld() ? game->getServerWorld() : game->getWorld();
+      PhysicsWorld* physics = world ? world->getPhysicsWorld() : NULL;
+      if (physics) {
+        std::scoped_lock l(physics->mutex);
+        gravity = physics->getWorld()->getGravity();
+        btCollisionObjectArray& objects =
+            physics->getWorld()->getCollisionObjectArray();
+        for (int i = 0; i < objects.size(); i++) {
+          if (!objects[i]->isStaticObject()) continue;
+          if (btCollisionShape* shape =
+                  shapes.clone(objects[i]->getCollisionShape()))
+            statics.push_back({shape, objects[i]->getWorldTransform()});
+          else
+            skipped++;
+        }
+      }
+      if (skipped)
+        Log::printf(LOG_WARN, "Left out %i static bodies of unknown shapes",
+                    skipped);
+      // nothing loaded, use the raymarcher's floor
+      btBoxShape floor(btVector3(50, 1, 50));
+      if (statics.empty())
+        statics.push_back({&floor, btTransform::getIdentity()});
+
+#if !BT_THREADSAFE
+      Log::printf(LOG_WARN,
+                  "Bullet was built without BT_THREADSAFE, multithreaded "
+                  "pipelines step serially");
+#endif
+      Log::printf(LOG_INFO, "%i balls on %zu static bodies, %i steps", balls,
+                  statics.size(), steps);
+
+      int manifolds;
+      double serial =
+          benchPipeline(false, statics, gravity, balls, steps, manifolds);
+      Log::printf(LOG_INFO, "Serial: %0.3fms/step, %i manifolds",
+                  serial * 1000.0, manifolds);
+
+      // only this thread's pipelines, the running world keeps its count
+      int max = PhysicsPipeline::getMaxThreadCount();
+      try {
+        for (int threads = 1;; threads = std::min(threads * 2, max)) {
+          PhysicsPipeline::setLocalThreadCount(threads);
+          double time =
+              benchPipeline(true, statics, gravity, balls, steps, manifolds);
+          Log::printf(LOG_INFO,
+                      "%i threads: %0.3fms/step, %0.2fx serial, %i manifolds",
+                      threads, time * 1000.0, serial / time, manifolds);
+          if (threads == max) break;
+        }
+      } catch (...) {
+        PhysicsPipeline::setLocalThreadCount(0);
+        throw;
+      }
+      PhysicsPipeline::setLocalThreadCount(0);
+    });
 };  // namespace rdm
@@ -5,16 +5,25 @@
 #include <bullet/BulletCollision/CollisionDispatch/btDefaultCollisionConfiguration.h>
 #include <bullet/BulletDynamics/ConstraintSolver/btSequentialImpulseConstraintSolver.h>
 #include <bullet/BulletDynamics/Dynamics/btDiscreteDynamicsWorld.h>
+#include <bullet/BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h>
 #include <bullet/btBulletDynamicsCommon.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <glm/glm.hpp>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #include "LinearMath/btMatrix3x3.h"
 #include "signal.hpp"
 
 #define PHYSICS_FRAMERATE (1.0 / 60.0)
+// steps run in one wake of the physics job before the rest is dropped
+#define PHYSICS_MAX_SUBSTEPS 10
 
 #define PHYSICS_INDEX_WORLD 1
 #define PHYSICS_INDEX_PLAYER 2
@@ -26,24 +35,205 @@ class Engine;
 }
 
 class World;
-class PhysicsWorld {
-  std::unique_ptr<btSequentialImpulseConstraintSolver> solver;
-  std::unique_ptr<btBroadphaseInterface> overlappingPairCache;
-  std::unique_ptr<btCollisionDispatcher> dispatcher;
+
+/**
+ * @brief Where every moving body was after the last two physics steps.
+ */
+struct PhysicsTransformSnapshot {
+  // when the newer step finished
+  std::chrono::steady_clock::time_point time;
+  std::vector<const btCollisionObject*> objects;  // sorted
+  std::vector<btTransform> previous;
+  std::vector<btTransform> current;
+};
+
+/**
+ * @brief The Bullet objects a dynamics world is built from. Multithreaded
+ * pipelines use the Mt dispatcher, solver pool and world, which run their
+ * loops on the SchedulerPool through Bullet's task scheduler.
+ *
+ * Bullet only runs those loops in parallel when it was built with
+ * BT_THREADSAFE, see the bullet_threadsafe meson option.
+ */
+struct PhysicsPipeline {
   std::unique_ptr<btDefaultCollisionConfiguration> collisionConfiguration;
+  std::unique_ptr<btCollisionDispatcher> dispatcher;
+  std::unique_ptr<btBroadphaseInterface> overlappingPairCache;
+  std::unique_ptr<btConstraintSolverPoolMt> solverPool;
+  std::unique_ptr<btConstraintSolver> solver;
+  std::unique_ptr<btDiscreteDynamicsWorld> dynamicsWorld;  // destroyed first
+  bool threaded;
+
+  PhysicsPipeline(bool threaded);
+
+  /**
+   * @brief Sets how many threads multithreaded pipelines step on, clamped to
+   * the SchedulerPool's worker count. 0 uses every worker.
+   */
+  static void setThreadCount(int threads);
+  static int getThreadCount();
+  static int getMaxThreadCount();
+
+  /**
+   * @brief Overrides setThreadCount for pipelines stepped on the calling
+   * thread only, so a benchmark can leave the running world alone. 0 clears
+   * the override.
+   */
+  static void setLocalThreadCount(int threads);
+};
+
+/**
+ * @brief What a query queued on PhysicsWorld found.
+ */
+struct PhysicsQueryResult {
+  bool hit = false;
+  // closest hit of rays and sweeps, first overlap of overlaps
+  const btCollisionObject* object = NULL;
+  btVector3 point = btVector3(0, 0, 0);
+  btVector3 normal = btVector3(0, 0, 0);
+  btScalar fraction = 1.0;
+  std::vector<const btCollisionObject*> overlaps;
+};
+
+typedef std::function<void(const PhysicsQueryResult&)> PhysicsQueryCallback;
+
+/**
+ * @brief A ray, sweep or overlap waiting for the next batch.
+ */
+struct PhysicsQuery {
+  enum Type { Ray, Sweep, Overlap };
+
+  Type type;
+  btTransform from;  // only the origin is used by rays
+  btTransform to;
+  const btConvexShape* shape;
+  const btCollisionObject* object;  // overlaps
+  const btCollisionObject* ignore;
+  void* owner;
+  bool cancelled;
+  PhysicsQueryCallback callback;
+  PhysicsQueryResult result;
+};
+
+class PhysicsWorld {
+  PhysicsPipeline pipeline;
   btAlignedObjectArray<std::unique_ptr<btCollisionShape>> collisionShapes;
-  std::unique_ptr<btDiscreteDynamicsWorld> dynamicsWorld;
 
   std::unique_ptr<btIDebugDraw> debugDraw;
   bool debugDrawEnabled;
   bool debugDrawInit;
   bool stepSimulation;
 
+  // real time not simulated yet, stepped off PHYSICS_FRAMERATE at a time
+  double accumulator;
+  std::chrono::steady_clock::time_point lastStep;
+  bool stepped;
+  size_t droppedSteps;
+
+  // the newest snapshot is published for readers on other threads, the ones
+  // before it are reused once no reader can still hold them
+  std::atomic<PhysicsTransformSnapshot*> transforms;
+  std::atomic<int> transformReaders;
+  std::vector<std::unique_ptr<PhysicsTransformSnapshot>> transformPool;
+  std::vector<PhysicsTransformSnapshot*> freeTransforms;
+  std::vector<PhysicsTransformSnapshot*> retiredTransforms;
+
+  // queued during a tick, run as one batch after the next step
+  std::mutex queryMutex;
+  std::vector<PhysicsQuery> queuedQueries;
+  std::vector<PhysicsQuery> runningQueries;
+  void* deliveringOwner;
+  std::thread::id deliveringThread;
+
+  void queueQuery(PhysicsQuery query);
+  // call with mutex locked
+  void runQueries();
+  // call without mutex locked
+  void deliverQueries();
+
+  // call with mutex locked
+  void publishTransforms();
+  bool readTransform(const btCollisionObject* object, btTransform& transform,
+                     bool interpolate);
+
  public:
+  /**
+   * @param world Scheduler the physics job is added to. Without one the
+   * world only steps when stepWorld or stepFixed is called.
+   */
   PhysicsWorld(World* world);
 
   Signal<> physicsStepping;
+  /**
+   * @brief Runs as many PHYSICS_FRAMERATE steps as the real time since the
+   * last call adds up to, firing physicsStepping and publishing transforms
+   * after each one.
+   */
   void stepWorld();
+  /**
+   * @brief Runs one PHYSICS_FRAMERATE step now, whatever the time, with the
+   * queued queries, physicsStepping and transforms as stepWorld does.
+   */
+  void stepFixed();
+
+  /**
+   * @brief Where object is drawn, between its transforms after the last two
+   * steps by how far the next step is along. Lock free, safe from any thread
+   * without the mutex.
+   *
+   * @return false if object is static or has not been through a step yet
+   */
+  bool getInterpolatedTransform(const btCollisionObject* object,
+                                btTransform& transform) {
+    return readTransform(object, transform, true);
+  }
+  /**
+   * @brief Like getInterpolatedTransform, but where object was after the
+   * last step.
+   */
+  bool getLatestTransform(const btCollisionObject* object,
+                          btTransform& transform) {
+    return readTransform(object, transform, false);
+  }
+  size_t getDroppedSteps() { return droppedSteps; }
+
+  /**
+   * @brief Queues a ray test for the closest hit. Queued queries run together
+   * right after the next step, across the SchedulerPool when Bullet is thread
+   * safe, and callback is called on the physics thread without the mutex
+   * before physicsStepping fires.
+   *
+   * @param ignore Never hit, e.g. the body casting the ray
+   * @param owner Tag for cancelQueries, for owners that may go away before
+   * the batch runs
+   */
+  void queueRay(const btVector3& from, const btVector3& to,
+                PhysicsQueryCallback callback,
+                const btCollisionObject* ignore = NULL, void* owner = NULL);
+  /**
+   * @brief Queues a sweep of shape from one transform to another for the
+   * closest hit, see queueRay.
+   */
+  void queueSweep(const btConvexShape* shape, const btTransform& from,
+                  const btTransform& to, PhysicsQueryCallback callback,
+                  const btCollisionObject* ignore = NULL, void* owner = NULL);
+  /**
+   * @brief Queues a test for everything touching object, which does not have
+   * to be in the world, see queueRay.
+   */
+  void queueOverlap(const btCollisionObject* object,
+                    PhysicsQueryCallback callback, void* owner = NULL);
+  /**
+   * @brief Drops the queries queued with owner and waits out any of their
+   * callbacks running on another thread.
+   */
+  void cancelQueries(void* owner);
+  /**
+   * @brief A callback for the queue functions that fulfills future. Waiting
+   * on it from the physics thread or with the mutex locked never returns.
+   */
+  static PhysicsQueryCallback futureCallback(
+      std::future<PhysicsQueryResult>& future);
 
   void setStepSimulation(bool s) { stepSimulation = s; };
 
@@ -51,7 +241,8 @@ class PhysicsWorld {
   bool isDebugDrawInitialized() { return debugDrawInit; }
   void initializeDebugDraw(rdm::gfx::Engine* engine);
 
-  btDiscreteDynamicsWorld* getWorld() { return dynamicsWorld.get(); }
+  btDiscreteDynamicsWorld* getWorld() { return pipeline.dynamicsWorld.get(); }
+  bool isThreaded() { return pipeline.threaded; }
   std::mutex mutex;
 };
 
@@ -1,18 +1,24 @@
 #include "fpscontroller.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
 #include <glm/common.hpp>
 #include <glm/geometric.hpp>
 #include <glm/glm.hpp>
+#include <unordered_map>
 
 #include "BulletCollision/CollisionDispatch/btCollisionObject.h"
 #include "LinearMath/btVector3.h"
 #include "alc.h"
+#include "console.hpp"
 #include "gfx/imgui/imgui.h"
 #include "input.hpp"
 #include "logging.hpp"
+#include "network/entity.hpp"
 #include "physics.hpp"
+#include "settings.hpp"
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtc/quaternion.hpp>
@@ -24,7 +30,99 @@
 
 #define FPS_CONTROLLER_FRONT -1, 0, 0
 
+// 1/64 of a unit across +-16384 units
+#define FPS_CONTROLLER_POSITION_RANGE 16384.f
+#define FPS_CONTROLLER_POSITION_BITS 21
+// 1/16 of a unit per second across +-2048 units per second
+#define FPS_CONTROLLER_VELOCITY_RANGE 2048.f
+#define FPS_CONTROLLER_VELOCITY_BITS 16
+#define FPS_CONTROLLER_ANGLE_BITS 16
+#define FPS_CONTROLLER_MOVE_BITS 8
+
+// input commands resent in every packet, a packet covers this many lost ones
+#define FPS_CONTROLLER_INPUT_REDUNDANCY 8
+// a second of input at 60hz, older commands are dropped unacked
+#define FPS_CONTROLLER_MAX_PENDING_INPUTS 64
+// bounds how far behind the client the server may fall
+#define FPS_CONTROLLER_MAX_RECEIVED_INPUTS 16
+
+// idle steps before a controller falls asleep, and the speed below which it
+// counts as standing still
+#define FPS_CONTROLLER_SLEEP_STEPS 30
+#define FPS_CONTROLLER_SLEEP_SPEED 1.f
+
 namespace rdm::putil {
+static CVar cl_interpdelay("cl_interpdelay", "0.1", CVARF_SAVE | CVARF_GLOBAL);
+static CVar cl_extrapolate("cl_extrapolate", "0.25",
+                           CVARF_SAVE | CVARF_GLOBAL);
+static CVar cl_predictionerror("cl_predictionerror", "1.0",
+                               CVARF_SAVE | CVARF_GLOBAL);
+static CVar phys_controllersleep("phys_controllersleep", "1",
+                                 CVARF_SAVE | CVARF_GLOBAL);
+
+FpsControllerSystem::FpsControllerSystem(PhysicsWorld* world) {
+  this->world = world;
+  awake = 0;
+  sleepEnabled = phys_controllersleep.getBool();
+  stepJob = world->physicsStepping.listen([this] { step(); });
+}
+
+FpsControllerSystem::~FpsControllerSystem() {
+  world->physicsStepping.removeListener(stepJob);
+}
+
+std::shared_ptr<FpsControllerSystem> FpsControllerSystem::get(
+    PhysicsWorld* world) {
+  static std::mutex systemsMutex;
+  static std::unordered_map<PhysicsWorld*, std::weak_ptr<FpsControllerSystem>>
+      systems;
+  std::scoped_lock l(systemsMutex);
+  std::shared_ptr<FpsControllerSystem> system = systems[world].lock();
+  if (!system) {
+    system = std::make_shared<FpsControllerSystem>(world);
+    systems[world] = system;
+  }
+  return system;
+}
+
+void FpsControllerSystem::add(FpsController* controller) {
+  std::scoped_lock l(mutex);
+  controllers.push_back(controller);
+  idleSteps.push_back(0);
+}
+
+void FpsControllerSystem::remove(FpsController* controller) {
+  std::scoped_lock l(mutex);
+  for (size_t i = 0; i < controllers.size(); i++) {
+    if (controllers[i] != controller) continue;
+    controllers.erase(controllers.begin() + i);
+    idleSteps.erase(idleSteps.begin() + i);
+    return;
+  }
+}
+
+void FpsControllerSystem::step() {
+#ifndef DISABLE_EASY_PROFILER
+  EASY_FUNCTION("FpsControllerSystem::step");
+#endif
+
+  std::scoped_lock l(mutex);
+  size_t stepped = 0;
+  for (size_t i = 0; i < controllers.size(); i++) {
+    if (sleepEnabled) {
+      if (controllers[i]->wantsStep())
+        idleSteps[i] = 0;
+      else if (idleSteps[i] < FPS_CONTROLLER_SLEEP_STEPS)
+        idleSteps[i]++;
+      else
+        continue;
+    }
+    controllers[i]->physicsStep();
+    stepped++;
+  }
+  awake = stepped;
+}
+
 FpsControllerSettings::FpsControllerSettings() {
   capsuleHeight = 46.f;
   capsuleRadius = 16.f;
@@ -53,7 +151,6 @@ FpsController::FpsController(PhysicsWorld* world,
   {
     std::scoped_lock l(world->mutex);
     world->getWorld()->addRigidBody(rigidBody.get());
-    stepJob = world->physicsStepping.listen([this] { physicsStep(); });
   }
 
   rigidBody->setUserPointer(this);
@@ -66,17 +163,33 @@ FpsController::FpsController(PhysicsWorld* world,
   cameraYaw = 0.f;
   localPlayer = true;
   enable = true;
+  grounded = false;
+  jumping = false;
+
+  nextInputSequence = 1;
+  lastSentInput = 0;
+  inputDriven = false;
+  appliedInput = 0;
+  lastProcessedInput = 0;
+  processedOrigin = btVector3(0.f, 0.f, 0.f);
+  processedVelocity = btVector3(0.f, 0.f, 0.f);
+  lastInput = InputCommand{0, glm::vec2(0.f), false, 0.f, 0.f};
 
   moveVel = glm::vec2(0.0);
 
   rigidBody->setAngularFactor(btVector3(0, 0, 1));
   rigidBody->setRestitution(0.0);
   rigidBody->setFriction(0.1);
+
+  woken = true;
+  system = FpsControllerSystem::get(world);
+  system->add(this);
 }
 
 FpsController::~FpsController() {
+  system->remove(this);
+  world->cancelQueries(this);
   world->getWorld()->removeRigidBody(rigidBody.get());
-  world->physicsStepping.removeListener(stepJob);
 }
 
 void FpsController::imguiDebug() {
@@ -95,8 +208,10 @@ void FpsController::imguiDebug() {
 
 void FpsController::teleport(glm::vec3 p) {
   std::scoped_lock l(m);
+  wake();
 
   networkPosition = p;
+  snapshots.clear();
   btTransform& transform = rigidBody->getWorldTransform();
   transform.setOrigin(BulletHelpers::toVector3(p));
   rigidBody->setWorldTransform(transform);
@@ -104,12 +219,12 @@ void FpsController::teleport(glm::vec3 p) {
   rigidBody->setAngularVelocity(btVector3(0.0, 0.0, 0.0));
 }
 
-void FpsController::moveGround(btVector3& vel, glm::vec2 wishdir) {
+void FpsController::moveGround(btVector3& vel, glm::vec2 wishdir, bool jump) {
   float speed = vel.length();
   float control = speed < settings.stopSpeed ? settings.stopSpeed : speed;
   float newspeed = speed - PHYSICS_FRAMERATE * settings.friction * control;
 
-  if (Input::singleton()->isKeyDown(' ')) {
+  if (jump) {
     vel += btVector3(0, 0, 50);
     jumping = true;
     return;
@@ -164,16 +279,64 @@ void FpsController::updateCamera(gfx::Camera& camera) {
   camera.setFar(65535.f);
 }
 
-void FpsController::detectGrounded() {
-  btTransform& transform = rigidBody->getWorldTransform();
-  btVector3 start =
-      transform.getOrigin() + btVector3(0, 0, -settings.capsuleHeight / 2.0);
-  btVector3 end = start + btVector3(0, 0, -19);
+void FpsController::getGroundRay(btVector3 origin, btVector3& start,
+                                 btVector3& end) {
+  start = origin + btVector3(0, 0, -settings.capsuleHeight / 2.0);
+  end = start + btVector3(0, 0, -19);
+}
+
+bool FpsController::isGroundedAt(btVector3 origin) {
+  btVector3 start, end;
+  getGroundRay(origin, start, end);
   btDynamicsWorld::ClosestRayResultCallback callback(start, end);
   world->getWorld()->rayTest(start, end, callback);
+  return callback.m_collisionObject != NULL;
+}
 
-  grounded = (callback.m_collisionObject != NULL);
-  if (grounded) jumping = false;
+void FpsController::detectGrounded() {
+  // batched with every other controller's, the answer comes after the next
+  // step and before physicsStep runs again
+  btVector3 start, end;
+  getGroundRay(rigidBody->getWorldTransform().getOrigin(), start, end);
+  world->queueRay(
+      start, end,
+      [this](const PhysicsQueryResult& result) {
+        std::scoped_lock l(m);
+        grounded = result.hit;
+        if (grounded) jumping = false;
+      },
+      rigidBody.get(), this);
+}
+
+bool FpsController::wantsStep() {
+  if (woken.exchange(false)) return true;
+  // disabled controllers are pinned every step, skipping them lets them fall
+  if (!enable) return true;
+
+  std::scoped_lock l(m);
+  if (localPlayer) return true;
+  if (inputDriven && (receivedInputs.size() || appliedInput ||
+                      lastInput.move != glm::vec2(0.f) || lastInput.jump))
+    return true;
+  // remote players on clients follow their snapshots until sampling runs past
+  // the extrapolation limit, the next snapshot wakes them again
+  if (snapshots.size() && clock &&
+      getViewTime() < snapshots.newestTime() + cl_extrapolate.getFloat())
+    return true;
+  return !grounded || rigidBody->getLinearVelocity().length2() >
+                          FPS_CONTROLLER_SLEEP_SPEED *
+                              FPS_CONTROLLER_SLEEP_SPEED;
+}
+
+void FpsController::applyInput(const InputCommand& command, btVector3& vel) {
+  glm::mat3 view = glm::toMat3(
+      glm::angleAxis(command.cameraPitch, glm::vec3(0.f, 0.f, 1.f)));
+  glm::vec2 wishdir =
+      glm::vec2(view * glm::vec3(-command.move.x, -command.move.y, 0.0));
+  accel = wishdir;
+
+  // modelled after Quake 1 movement
+  grounded ? moveGround(vel, wishdir, command.jump) : moveAir(vel, wishdir);
 }
 
 void FpsController::physicsStep() {
@@ -190,6 +353,11 @@ void FpsController::physicsStep() {
 
   std::scoped_lock l(m);
 
+  if (!localPlayer) {
+    NetworkState state;
+    if (sampleSnapshots(state)) applyState(state);
+  }
+
   btTransform& transform = rigidBody->getWorldTransform();
   float dist = glm::distance(networkPosition,
                              BulletHelpers::fromVector3(transform.getOrigin()));
@@ -213,6 +381,12 @@ void FpsController::physicsStep() {
     // Log::printf(LOG_DEBUG, "%.2f, %.2f, %.2f", transform.getOrigin().x(),
     // transform.getOrigin().y(), transform.getOrigin().z());
 
+    // stepSimulation has moved us by the last command since the last step
+    if (pendingInputs.size() && !pendingInputs.back().simulated) {
+      pendingInputs.back().origin = transform.getOrigin();
+      pendingInputs.back().simulated = true;
+    }
+
     Input::Axis* fbA = Input::singleton()->getAxis("ForwardBackward");
     Input::Axis* lrA = Input::singleton()->getAxis("LeftRight");
 
@@ -220,12 +394,17 @@ void FpsController::physicsStep() {
         (btVector3(FPS_CONTROLLER_FRONT) * BulletHelpers::toMat3(cameraView))
             .normalize();
 
-    glm::vec2 wishdir =
-        glm::vec2(moveView * glm::vec3(-fbA->value, -lrA->value, 0.0));
-    accel = wishdir;
+    InputCommand command;
+    command.sequence = nextInputSequence++;
+    command.move = glm::vec2(fbA->value, lrA->value);
+    command.jump = Input::singleton()->isKeyDown(' ');
+    command.cameraYaw = cameraYaw;
+    command.cameraPitch = cameraPitch;
+    applyInput(command, vel);
 
-    // modelled after Quake 1 movement
-    grounded ? moveGround(vel, wishdir) : moveAir(vel, wishdir);
+    pendingInputs.push_back(PendingInput{command, btVector3(0, 0, 0), false});
+    while (pendingInputs.size() > FPS_CONTROLLER_MAX_PENDING_INPUTS)
+      pendingInputs.pop_front();
 
     if (!vel.fuzzyZero()) rigidBody->activate(true);
 
@@ -240,38 +419,300 @@ void FpsController::physicsStep() {
       }*/
 
     transform.setBasis(BulletHelpers::toMat3(moveView));
+  } else if (inputDriven) {
+    // the command from the last step has been simulated, remember the result
+    // for the owner to check its prediction against
+    if (appliedInput) {
+      lastProcessedInput = appliedInput;
+      processedOrigin = transform.getOrigin();
+      processedVelocity = vel;
+    }
+
+    // keep the last input held down if the client falls behind
+    appliedInput = 0;
+    if (receivedInputs.size()) {
+      lastInput = receivedInputs.front();
+      receivedInputs.pop_front();
+      appliedInput = lastInput.sequence;
+    }
+    applyInput(lastInput, vel);
+
+    if (!vel.fuzzyZero()) rigidBody->activate(true);
+    rigidBody->setLinearVelocity(vel);
+    transform.setBasis(BulletHelpers::toMat3(glm::toMat3(
+        glm::angleAxis(lastInput.cameraPitch, glm::vec3(0.f, 0.f, 1.f)))));
+
+    glm::quat yawQuat =
+        glm::angleAxis(lastInput.cameraYaw, glm::vec3(0.f, 1.f, 0.f));
+    glm::quat pitchQuat =
+        glm::angleAxis(lastInput.cameraPitch, glm::vec3(0.f, 0.f, 1.f));
+    cameraYaw = lastInput.cameraYaw;
+    cameraPitch = lastInput.cameraPitch;
+    front = BulletHelpers::toVector3(glm::toMat3(pitchQuat * yawQuat) *
+                                     glm::vec3(FPS_CONTROLLER_FRONT));
   }
 
   detectGrounded();
 }
 
-void FpsController::serialize(network::BitStream& stream) {
+// wraps an unbounded camera angle into [-pi, pi] so it can be quantized
+static float wrapAngle(float angle) {
+  return remainderf(angle, 2.f * M_PI);
+}
+
+void FpsController::writeState(network::BitStream& stream,
+                               btTransform transform, btVector3 velocity,
+                               float cameraYaw, float cameraPitch) {
+  btVector3 origin = transform.getOrigin();
+  for (int i = 0; i < 3; i++)
+    stream.writeQuantizedFloat(origin[i], -FPS_CONTROLLER_POSITION_RANGE,
+                               FPS_CONTROLLER_POSITION_RANGE,
+                               FPS_CONTROLLER_POSITION_BITS);
+  btQuaternion rotation;
+  transform.getBasis().getRotation(rotation);
+  stream.writeQuat(
+      glm::quat(rotation.w(), rotation.x(), rotation.y(), rotation.z()));
+  for (int i = 0; i < 3; i++)
+    stream.writeQuantizedFloat(velocity[i], -FPS_CONTROLLER_VELOCITY_RANGE,
+                               FPS_CONTROLLER_VELOCITY_RANGE,
+                               FPS_CONTROLLER_VELOCITY_BITS);
+  stream.writeQuantizedFloat(wrapAngle(cameraYaw), -M_PI, M_PI,
+                             FPS_CONTROLLER_ANGLE_BITS);
+  stream.writeQuantizedFloat(wrapAngle(cameraPitch), -M_PI, M_PI,
+                             FPS_CONTROLLER_ANGLE_BITS);
+}
+
+void FpsController::readState(network::BitStream& stream,
+                              btTransform& transform, btVector3& velocity,
+                              float& cameraYaw, float& cameraPitch) {
+  btVector3 origin;
+  for (int i = 0; i < 3; i++)
+    origin[i] = stream.readQuantizedFloat(-FPS_CONTROLLER_POSITION_RANGE,
+                                          FPS_CONTROLLER_POSITION_RANGE,
+                                          FPS_CONTROLLER_POSITION_BITS);
+  glm::quat rotation = stream.readQuat();
+  transform.setOrigin(origin);
+  transform.setBasis(btMatrix3x3(
+      btQuaternion(rotation.x, rotation.y, rotation.z, rotation.w)));
+  for (int i = 0; i < 3; i++)
+    velocity[i] = stream.readQuantizedFloat(-FPS_CONTROLLER_VELOCITY_RANGE,
+                                            FPS_CONTROLLER_VELOCITY_RANGE,
+                                            FPS_CONTROLLER_VELOCITY_BITS);
+  cameraYaw = stream.readQuantizedFloat(-M_PI, M_PI, FPS_CONTROLLER_ANGLE_BITS);
+  cameraPitch =
+      stream.readQuantizedFloat(-M_PI, M_PI, FPS_CONTROLLER_ANGLE_BITS);
+}
+
+void FpsController::serialize(network::BitStream& stream, bool owner) {
   btTransform transform;
   getMotionState()->getWorldTransform(transform);
-  btVector3FloatData vectorData;
-  transform.getOrigin().serialize(vectorData);
-  stream.write<btVector3FloatData>(vectorData);
-  btMatrix3x3FloatData matrixData;
-  transform.getBasis().serialize(matrixData);
-  stream.write<btMatrix3x3FloatData>(matrixData);
-  rigidBody->getLinearVelocity().serialize(vectorData);
-  stream.write<btVector3FloatData>(vectorData);
-  stream.write<float>(cameraYaw);
-  stream.write<float>(cameraPitch);
-}
-
-void FpsController::deserialize(network::BitStream& stream, bool backend) {
-  btVector3 origin;
-  origin.deSerialize(stream.read<btVector3FloatData>());
+  btVector3 velocity = rigidBody->getLinearVelocity();
 
-  btMatrix3x3 basis;
-  basis.deSerialize(stream.read<btMatrix3x3FloatData>());
+  std::scoped_lock l(m);
+  if (owner && lastProcessedInput) {
+    transform.setOrigin(processedOrigin);
+    velocity = processedVelocity;
+  }
+  writeState(stream, transform, velocity, cameraYaw, cameraPitch);
+  if (owner) stream.writeBits(lastProcessedInput, 32);
+}
 
+void FpsController::writeInputs(network::BitStream& stream) {
+  std::scoped_lock l(m);
+  int count =
+      std::min<int>(pendingInputs.size(), FPS_CONTROLLER_INPUT_REDUNDANCY);
+  stream.writeVarInt(count);
+  if (!count) return;
+
+  auto first = pendingInputs.end() - count;
+  stream.write<uint32_t>(first->command.sequence);
+  for (auto it = first; it != pendingInputs.end(); it++)
+    writeInputCommand(stream, it->command);
+  lastSentInput = pendingInputs.back().command.sequence;
+}
+
+void FpsController::writeInputCommand(network::BitStream& stream,
+                                      const InputCommand& command) {
+  stream.writeQuantizedFloat(command.move.x, -1.f, 1.f,
+                             FPS_CONTROLLER_MOVE_BITS);
+  stream.writeQuantizedFloat(command.move.y, -1.f, 1.f,
+                             FPS_CONTROLLER_MOVE_BITS);
+  stream.writeBool(command.jump);
+  stream.writeQuantizedFloat(wrapAngle(command.cameraYaw), -M_PI, M_PI,
+                             FPS_CONTROLLER_ANGLE_BITS);
+  stream.writeQuantizedFloat(wrapAngle(command.cameraPitch), -M_PI, M_PI,
+                             FPS_CONTROLLER_ANGLE_BITS);
+}
+
+void FpsController::readInputCommand(network::BitStream& stream,
+                                     InputCommand& command) {
+  command.move.x =
+      stream.readQuantizedFloat(-1.f, 1.f, FPS_CONTROLLER_MOVE_BITS);
+  command.move.y =
+      stream.readQuantizedFloat(-1.f, 1.f, FPS_CONTROLLER_MOVE_BITS);
+  command.jump = stream.readBool();
+  command.cameraYaw =
+      stream.readQuantizedFloat(-M_PI, M_PI, FPS_CONTROLLER_ANGLE_BITS);
+  command.cameraPitch =
+      stream.readQuantizedFloat(-M_PI, M_PI, FPS_CONTROLLER_ANGLE_BITS);
+}
+
+void FpsController::readInputs(network::BitStream& stream) {
+  int count = stream.readVarInt();
+  if (!count) return;
+  uint32_t sequence = stream.read<uint32_t>();
+
+  std::scoped_lock l(m);
+  inputDriven = true;
+  uint32_t newest = receivedInputs.size() ? receivedInputs.back().sequence
+                                          : lastInput.sequence;
+  for (int i = 0; i < count; i++, sequence++) {
+    InputCommand command;
+    command.sequence = sequence;
+    readInputCommand(stream, command);
+    // resent ones we already have
+    if (sequence <= newest) continue;
+    receivedInputs.push_back(command);
+  }
+  while (receivedInputs.size() > FPS_CONTROLLER_MAX_RECEIVED_INPUTS)
+    receivedInputs.pop_front();
+}
+
+bool FpsController::hasUnsentInputs() {
+  std::scoped_lock l(m);
+  return pendingInputs.size() &&
+         pendingInputs.back().command.sequence != lastSentInput;
+}
+
+namespace {
+// sweeps the capsule through walls during replay, floors are left to the
+// grounded check
+struct ReplaySweepCallback
+    : public btCollisionWorld::ClosestConvexResultCallback {
+  btCollisionObject* self;
+
+  ReplaySweepCallback(btCollisionObject* self, const btVector3& from,
+                      const btVector3& to)
+      : ClosestConvexResultCallback(from, to), self(self) {}
+
+  virtual bool needsCollision(btBroadphaseProxy* proxy) const {
+    if (proxy->m_clientObject == self) return false;
+    return ClosestConvexResultCallback::needsCollision(proxy);
+  }
+
+  virtual btScalar addSingleResult(btCollisionWorld::LocalConvexResult& result,
+                                   bool normalInWorldSpace) {
+    btVector3 normal =
+        normalInWorldSpace ? result.m_hitNormalLocal
+                           : result.m_hitCollisionObject->getWorldTransform()
+                                     .getBasis() *
+                                 result.m_hitNormalLocal;
+    if (normal.z() > 0.7f) return 1.f;
+    return ClosestConvexResultCallback::addSingleResult(result,
+                                                        normalInWorldSpace);
+  }
+};
+}  // namespace
+
+// the server simulated up to ack and ended up at origin, if we predicted
+// something else start over from there and run the newer inputs again
+void FpsController::reconcile(btVector3 origin, btVector3 velocity,
+                              uint32_t ack) {
+  std::scoped_lock l(m);
+  while (pendingInputs.size() && pendingInputs.front().command.sequence < ack)
+    pendingInputs.pop_front();
+  if (!pendingInputs.size() || pendingInputs.front().command.sequence != ack ||
+      !pendingInputs.front().simulated)
+    return;
+
+  btVector3 predicted = pendingInputs.front().origin;
+  pendingInputs.pop_front();
+  if (predicted.distance(origin) < cl_predictionerror.getFloat()) return;
+
+  Log::printf(LOG_DEBUG, "Prediction off by %f, replaying %i inputs",
+              predicted.distance(origin), (int)pendingInputs.size());
+
+  // stepSimulation without collisions, except walls swept against below
+  btConvexShape* shape =
+      static_cast<btConvexShape*>(rigidBody->getCollisionShape());
+  btTransform from = rigidBody->getWorldTransform(), to = from;
+  btVector3 gravity = world->getWorld()->getGravity();
+  grounded = isGroundedAt(origin);
+  for (auto& pending : pendingInputs) {
+    applyInput(pending.command, velocity);
+    if (!pending.simulated) break;
+
+    velocity += gravity * PHYSICS_FRAMERATE;
+    if (grounded && velocity.z() < 0.f) velocity.setZ(0.f);
+
+    btVector3 target = origin + velocity * PHYSICS_FRAMERATE;
+    from.setOrigin(origin);
+    to.setOrigin(target);
+    ReplaySweepCallback callback(rigidBody.get(), origin, target);
+    world->getWorld()->convexSweepTest(shape, from, to, callback);
+    if (callback.hasHit()) {
+      origin = origin.lerp(target, callback.m_closestHitFraction);
+      btVector3 normal = callback.m_hitNormalWorld;
+      float into = velocity.dot(normal);
+      if (into < 0.f) velocity -= normal * into;
+    } else {
+      origin = target;
+    }
+
+    pending.origin = origin;
+    grounded = isGroundedAt(origin);
+  }
+
+  btTransform& transform = rigidBody->getWorldTransform();
+  transform.setOrigin(origin);
+  rigidBody->setWorldTransform(transform);
+  rigidBody->setLinearVelocity(velocity);
+  rigidBody->activate(true);
+}
+
+FpsController::NetworkState FpsController::NetworkState::interpolate(
+    const NetworkState& a, const NetworkState& b, float t) {
+  NetworkState state;
+  state.origin = a.origin.lerp(b.origin, t);
+  state.rotation = a.rotation.slerp(b.rotation, t);
+  state.velocity = a.velocity.lerp(b.velocity, t);
+  // the short way around, the angles are unbounded
+  state.cameraYaw = a.cameraYaw + wrapAngle(b.cameraYaw - a.cameraYaw) * t;
+  state.cameraPitch =
+      a.cameraPitch + wrapAngle(b.cameraPitch - a.cameraPitch) * t;
+  return state;
+}
+
+void FpsController::deserialize(network::BitStream& stream, bool backend,
+                                float time, bool owner) {
+  btTransform transform;
   btVector3 velocity;
-  velocity.deSerialize(stream.read<btVector3FloatData>());
+  float cameraYaw, cameraPitch;
+  readState(stream, transform, velocity, cameraYaw, cameraPitch);
+  btVector3 origin = transform.getOrigin();
+  uint32_t ack = owner ? stream.readBits(32) : 0;
+  wake();
 
-  float cameraYaw = stream.read<float>();
-  float cameraPitch = stream.read<float>();
+  if (localPlayer && ack) {
+    networkPosition = BulletHelpers::fromVector3(origin);
+    reconcile(origin, velocity, ack);
+    return;
+  }
+
+  if (!backend && !localPlayer && time >= 0.f && clock &&
+      cl_interpdelay.getFloat() > 0.f) {
+    NetworkState state;
+    state.origin = origin;
+    transform.getBasis().getRotation(state.rotation);
+    state.velocity = velocity;
+    state.cameraYaw = cameraYaw;
+    state.cameraPitch = cameraPitch;
+
+    std::scoped_lock l(m);
+    networkPosition = BulletHelpers::fromVector3(origin);
+    snapshots.push(time, state);
+    return;
+  }
 
   if (backend) {
     btTransform& bodyTransform = rigidBody->getWorldTransform();
@@ -290,23 +731,13 @@ void FpsController::deserialize(network::BitStream& stream, bool backend) {
   }
 
   if (!localPlayer) {
-    btTransform& bodyTransform = rigidBody->getWorldTransform();
-    bodyTransform.setOrigin(BulletHelpers::toVector3(networkPosition));
-    bodyTransform.setBasis(basis);
-
-    rigidBody->setLinearVelocity(velocity);
-    rigidBody->setAngularVelocity(btVector3(0.0, 0.0, 0.0));
-    if (enable) rigidBody->activate(true);
-    rigidBody->setWorldTransform(bodyTransform);
-
-    glm::quat yawQuat = glm::angleAxis(cameraYaw, glm::vec3(0.f, 1.f, 0.f));
-    glm::quat pitchQuat = glm::angleAxis(cameraPitch, glm::vec3(0.f, 0.f, 1.f));
-    glm::mat3 frontMat3 = glm::toMat3(pitchQuat * yawQuat);
-    glm::vec3 front = frontMat3 * glm::vec3(FPS_CONTROLLER_FRONT);
-
-    this->cameraYaw = cameraYaw;
-    this->cameraPitch = cameraPitch;
-    this->front = BulletHelpers::toVector3(front);
+    NetworkState state;
+    state.origin = BulletHelpers::toVector3(networkPosition);
+    transform.getBasis().getRotation(state.rotation);
+    state.velocity = velocity;
+    state.cameraYaw = cameraYaw;
+    state.cameraPitch = cameraPitch;
+    applyState(state);
   } else {
     btTransform& ourTransform = rigidBody->getWorldTransform();
     float dist = glm::distance(
@@ -315,4 +746,196 @@ void FpsController::deserialize(network::BitStream& stream, bool backend) {
   }
 }
 
+void FpsController::applyState(const NetworkState& state) {
+  btTransform& bodyTransform = rigidBody->getWorldTransform();
+  bodyTransform.setOrigin(state.origin);
+  bodyTransform.setRotation(state.rotation);
+
+  rigidBody->setLinearVelocity(state.velocity);
+  rigidBody->setAngularVelocity(btVector3(0.0, 0.0, 0.0));
+  if (enable) rigidBody->activate(true);
+  rigidBody->setWorldTransform(bodyTransform);
+
+  glm::quat yawQuat = glm::angleAxis(state.cameraYaw, glm::vec3(0.f, 1.f, 0.f));
+  glm::quat pitchQuat =
+      glm::angleAxis(state.cameraPitch, glm::vec3(0.f, 0.f, 1.f));
+  glm::mat3 frontMat3 = glm::toMat3(pitchQuat * yawQuat);
+  glm::vec3 front = frontMat3 * glm::vec3(FPS_CONTROLLER_FRONT);
+
+  this->cameraYaw = state.cameraYaw;
+  this->cameraPitch = state.cameraPitch;
+  this->front = BulletHelpers::toVector3(front);
+}
+
+// call with m locked
+bool FpsController::sampleSnapshots(NetworkState& state) {
+  if (!clock || !snapshots.size()) return false;
+  return snapshots.sample(clock() - cl_interpdelay.getFloat(),
+                          cl_extrapolate.getFloat(), state);
+}
+
+float FpsController::getViewTime() {
+  if (!clock) return 0.f;
+  return clock() - cl_interpdelay.getFloat();
+}
+
+btTransform FpsController::getInterpolatedTransform() {
+  btTransform transform;
+  {
+    std::scoped_lock l(m);
+    NetworkState state;
+    if (!localPlayer && sampleSnapshots(state)) {
+      transform.setOrigin(state.origin);
+      transform.setRotation(state.rotation);
+      return transform;
+    }
+  }
+
+  // m is not held here, the physics mutex is always taken before it
+  if (world->getInterpolatedTransform(rigidBody.get(), transform))
+    return transform;
+  std::scoped_lock l(world->mutex);
+  motionState->getWorldTransform(transform);
+  return transform;
+}
+
+// there is no recorded session in tree yet, so players wander around a map
+// sized box with random turns instead
+static ConsoleCommand bench_netstate(
+    "bench_netstate", "bench_netstate [players] [ticks]",
+    "compares the packed FpsController state against the old float layout",
+    [](Game* game, ConsoleArgReader r) {
+      int players = std::atoi(r.next().c_str());
+      int ticks = std::atoi(r.next().c_str());
+      if (players <= 0) players = 32;
+      if (ticks <= 0) ticks = 600;
+
+      std::vector<btVector3> positions(players), velocities(players);
+      std::vector<float> yaws(players, 0.f), pitches(players, 0.f);
+      for (int i = 0; i < players; i++) {
+        positions[i] = btVector3((rand() % 4000) - 2000.f,
+                                 (rand() % 4000) - 2000.f, 200.f);
+        velocities[i] = btVector3(0.f, 0.f, 0.f);
+      }
+
+      size_t oldBytes = 0, packedBytes = 0;
+      float maxError = 0.f;
+      float dt = 1.f / 60.f;
+      for (int t = 0; t < ticks; t++) {
+        network::BitStream stream;
+        for (int i = 0; i < players; i++) {
+          velocities[i] += btVector3((rand() % 200) - 100.f,
+                                     (rand() % 200) - 100.f, 0.f);
+          if (velocities[i].length() > 320.f)
+            velocities[i] = velocities[i].normalized() * 320.f;
+          positions[i] += velocities[i] * dt;
+          yaws[i] += ((rand() % 100) - 50.f) * 0.002f;
+          pitches[i] += ((rand() % 100) - 50.f) * 0.002f;
+
+          btTransform transform = btTransform::getIdentity();
+          transform.setOrigin(positions[i]);
+          transform.setRotation(btQuaternion(btVector3(0, 0, 1), yaws[i]));
+
+          oldBytes += sizeof(network::EntityId) +
+                      sizeof(btVector3FloatData) * 2 +
+                      sizeof(btMatrix3x3FloatData) + sizeof(float) * 2;
+          stream.write<network::EntityId>(i);
+          FpsController::writeState(stream, transform, velocities[i], yaws[i],
+                                    pitches[i]);
+        }
+        packedBytes += stream.getSize();
+
+        network::BitStream reader(stream.getData(), stream.getSize());
+        for (int i = 0; i < players; i++) {
+          reader.read<network::EntityId>();
+          btTransform transform;
+          btVector3 velocity;
+          float yaw, pitch;
+          FpsController::readState(reader, transform, velocity, yaw, pitch);
+          maxError = std::max(
+              maxError, transform.getOrigin().distance(positions[i]));
+        }
+      }
+
+      float rate = 60.f;
+      if (CVar* netRate = Settings::singleton()->getCvar("net_rate"))
+        rate = netRate->getFloat();
+      size_t updates = (size_t)players * ticks;
+      Log::printf(LOG_INFO, "%i players, %i ticks", players, ticks);
+      Log::printf(LOG_INFO, "Old:    %0.1f bytes per update, %0.1f kbit/s",
+                  (double)oldBytes / updates,
+                  oldBytes * 8.0 / ticks * rate / 1000.0);
+      Log::printf(LOG_INFO, "Packed: %0.1f bytes per update, %0.1f kbit/s",
+                  (double)packedBytes / updates,
+                  packedBytes * 8.0 / ticks * rate / 1000.0);
+      Log::printf(LOG_INFO, "Max position error: %f", maxError);
+    });
+
+static ConsoleCommand bench_fpscontroller(
+    "bench_fpscontroller", "bench_fpscontroller [bots] [steps]",
+    "times physics steps of bots, half idle and half walking, with and "
+    "without controllers sleeping",
+    [](Game* game, ConsoleArgReader r) {
+      int bots = std::atoi(r.next().c_str());
+      int steps = std::atoi(r.next().c_str());
+      if (bots <= 0) bots = 200;
+      if (steps <= 0) steps = 600;
+
+      for (int sleep = 0; sleep < 2; sleep++) {
+        PhysicsWorld physics(NULL);
+        physics.getWorld()->setGravity(btVector3(0, 0, -206.67));
+        btBoxShape floorShape(btVector3(4096, 4096, 16));
+        btRigidBody::btRigidBodyConstructionInfo info(0.0, NULL, &floorShape);
+        info.m_startWorldTransform.setIdentity();
+        info.m_startWorldTransform.setOrigin(btVector3(0, 0, -16));
+        btRigidBody floor(info);
+        physics.getWorld()->addRigidBody(&floor);
+
+        std::vector<std::unique_ptr<FpsController>> controllers;
+        for (int i = 0; i < bots; i++) {
+          controllers.emplace_back(new FpsController(&physics));
+          controllers.back()->setLocalPlayer(false);
+          controllers.back()->teleport(
+              glm::vec3((i % 20) * 64.f, (i / 20) * 64.f, 48.f));
+        }
+        std::shared_ptr<FpsControllerSystem> system =
+            FpsControllerSystem::get(&physics);
+        system->setSleepEnabled(sleep);
+
+        // a second to land before timing
+        for (int i = 0; i < 60; i++) physics.stepFixed();
+
+        // the odd bots walk in circles, the rest stand still
+        network::BitStream input;
+        std::chrono::duration<double> time(0);
+        size_t awake = 0;
+        for (int i = 0; i < steps; i++) {
+          uint32_t sequence = i + 1;
+          FpsController::InputCommand command{
+              sequence, glm::vec2(1.f, 0.f), false, 0.f, i * 0.05f};
+          input.clear();
+          input.writeVarInt(1);
+          input.write<uint32_t>(sequence);
+          FpsController::writeInputCommand(input, command);
+          for (size_t j = 1; j < controllers.size(); j += 2) {
+            network::BitStream in(input.getData(), input.getSize());
+            controllers[j]->readInputs(in);
+          }
+
+          auto start = std::chrono::steady_clock::now();
+          physics.stepFixed();
+          time += std::chrono::steady_clock::now() - start;
+          awake += system->getAwake();
+        }
+
+        Log::printf(LOG_INFO,
+                    "Sleeping %s: %0.3fms/step, %0.1f of %i controllers "
+                    "stepped",
+                    sleep ? "on" : "off", time.count() * 1000.0 / steps,
+                    (double)awake / steps, bots);
+
+        controllers.clear();
+        physics.getWorld()->removeRigidBody(&floor);
+      }
+    });
 };  // namespace rdm::putil
@@ -1,6 +1,14 @@
 #pragma once
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "gfx/camera.hpp"
 #include "network/bitstream.hpp"
+#include "network/snapshotbuffer.hpp"
 #include "physics.hpp"
 namespace rdm::putil {
 struct FpsControllerSettings {
@@ -16,7 +24,79 @@ struct FpsControllerSettings {
   FpsControllerSettings();  // default settings, good for bsp maps
 };
 
+class FpsController;
+
+/**
+ * @brief Steps every FpsController of one physics world from a single
+ * physicsStepping listener. Controllers with no input, no snapshots and no
+ * speed to speak of fall asleep after a while and are skipped until
+ * something wakes them.
+ */
+class FpsControllerSystem {
+  PhysicsWorld* world;
+  ClosureId stepJob;
+  std::mutex mutex;
+  // one entry per controller in each, in the order they were added
+  std::vector<FpsController*> controllers;
+  std::vector<uint16_t> idleSteps;
+  std::atomic<size_t> awake;
+  std::atomic<bool> sleepEnabled;
+
+  void step();
+
+ public:
+  FpsControllerSystem(PhysicsWorld* world);
+  ~FpsControllerSystem();
+
+  /**
+   * @brief The system of world, made when the first controller asks for it
+   * and destroyed with the last one.
+   */
+  static std::shared_ptr<FpsControllerSystem> get(PhysicsWorld* world);
+
+  void add(FpsController* controller);
+  /**
+   * @brief Waits out a step in progress on another thread.
+   */
+  void remove(FpsController* controller);
+
+  // defaults to phys_controllersleep
+  void setSleepEnabled(bool enabled) { sleepEnabled = enabled; }
+  size_t getAwake() { return awake; }
+  size_t size() { return controllers.size(); }
+};
+
 class FpsController {
+  friend class FpsControllerSystem;
+
+ public:
+  /**
+   * @brief What serialize sends, buffered on clients for remote players.
+   */
+  struct NetworkState {
+    btVector3 origin;
+    btQuaternion rotation;
+    btVector3 velocity;
+    float cameraYaw;
+    float cameraPitch;
+
+    static NetworkState interpolate(const NetworkState& a,
+                                    const NetworkState& b, float t);
+  };
+
+  /**
+   * @brief The local player's input for one physics step. Clients predict
+   * with these and send them to the server, which simulates them again.
+   */
+  struct InputCommand {
+    uint32_t sequence;
+    glm::vec2 move;  // ForwardBackward, LeftRight axes
+    bool jump;
+    float cameraYaw;
+    float cameraPitch;
+  };
+
+ private:
   PhysicsWorld* world;
   std::unique_ptr<btRigidBody> rigidBody;
   btMotionState* motionState;
@@ -25,7 +105,8 @@ class FpsController {
   bool enable;
   void* user;
 
-  ClosureId stepJob;
+  std::shared_ptr<FpsControllerSystem> system;
+  std::atomic<bool> woken;
 
   float cameraPitch;
   float cameraYaw;
@@ -41,9 +122,44 @@ class FpsController {
 
   btVector3 front;
 
+  network::SnapshotBuffer<NetworkState> snapshots;
+  std::function<float()> clock;
+
+  // client, commands the server has not acked and where each one left us
+  struct PendingInput {
+    InputCommand command;
+    btVector3 origin;
+    bool simulated;
+  };
+  std::deque<PendingInput> pendingInputs;
+  uint32_t nextInputSequence;
+  uint32_t lastSentInput;
+
+  // server, commands received but not simulated yet
+  std::deque<InputCommand> receivedInputs;
+  InputCommand lastInput;
+  bool inputDriven;
+  uint32_t appliedInput;
+  // the state right after lastProcessedInput was simulated, sent to the owner
+  uint32_t lastProcessedInput;
+  btVector3 processedOrigin;
+  btVector3 processedVelocity;
+
+  void applyInput(const InputCommand& command, btVector3& vel);
+  void reconcile(btVector3 origin, btVector3 velocity, uint32_t ack);
+  void getGroundRay(btVector3 origin, btVector3& start, btVector3& end);
+  // tests now, detectGrounded queues the same ray for the next batch
+  bool isGroundedAt(btVector3 origin);
+
+  bool sampleSnapshots(NetworkState& state);
+  void applyState(const NetworkState& state);
+
   void physicsStep();
+  // whether physicsStep has anything to do, FpsControllerSystem puts the
+  // controller to sleep after enough steps without
+  bool wantsStep();
 
-  void moveGround(btVector3& vel, glm::vec2 wishdir);
+  void moveGround(btVector3& vel, glm::vec2 wishdir, bool jump);
   void moveAir(btVector3& vel, glm::vec2 wishdir);
   void detectGrounded();
 
@@ -54,13 +170,84 @@ class FpsController {
                 FpsControllerSettings settings = FpsControllerSettings());
   ~FpsController();
 
-  void setEnable(bool enable) { this->enable = enable; }
+  void setEnable(bool enable) {
+    if (this->enable == enable) return;
+    this->enable = enable;
+    wake();
+  }
 
-  void setLocalPlayer(bool b) { localPlayer = b; };
+  void setLocalPlayer(bool b) {
+    if (localPlayer == b) return;
+    localPlayer = b;
+    wake();
+  };
+  /**
+   * @brief Steps the controller on the next step even if it is asleep, for
+   * changes made from outside that physicsStep has to see.
+   */
+  void wake() { woken = true; }
   void updateCamera(gfx::Camera& camera);
 
-  void serialize(network::BitStream& stream);
-  void deserialize(network::BitStream& stream, bool backend = false);
+  /**
+   * @param owner Also sends the last input command simulated and the state
+   * it left the controller in, for the owning client to reconcile with
+   */
+  void serialize(network::BitStream& stream, bool owner = false);
+  /**
+   * @param time When the state was sent. Remote players on clients buffer
+   * states stamped with a time and play them back cl_interpdelay seconds
+   * behind the clock set with setClock, otherwise the state is applied now.
+   */
+  void deserialize(network::BitStream& stream, bool backend = false,
+                   float time = -1.f, bool owner = false);
+
+  /**
+   * @brief Writes the newest unacknowledged input commands, redundantly so a
+   * lost packet does not lose input.
+   */
+  void writeInputs(network::BitStream& stream);
+  /**
+   * @brief Queues input commands from the owning client, see writeInputs.
+   * From then on the server moves the controller from input alone.
+   */
+  void readInputs(network::BitStream& stream);
+  bool hasUnsentInputs();
+  /**
+   * @brief Bit packs one input command the way writeInputs sends it, after a
+   * varint count and the uint32_t sequence of the first command.
+   */
+  static void writeInputCommand(network::BitStream& stream,
+                                const InputCommand& command);
+  static void readInputCommand(network::BitStream& stream,
+                               InputCommand& command);
+
+  /**
+   * @brief Sets where the current distributedTime is read from, e.g.
+   * NetworkManager::getClockTime.
+   */
+  void setClock(std::function<float()> clock) { this->clock = clock; }
+  /**
+   * @brief The transform remote players should be drawn at, interpolated
+   * from buffered states. Falls back to the rigid body interpolated between
+   * physics steps when nothing is buffered. Takes no lock the physics step
+   * holds, call it without the physics mutex.
+   */
+  btTransform getInterpolatedTransform();
+  /**
+   * @brief The time remote players are being drawn at, in the server's
+   * distributedTime. 0 without a clock.
+   */
+  float getViewTime();
+
+  /**
+   * @brief Bit packs a controller state the way serialize sends it.
+   */
+  static void writeState(network::BitStream& stream, btTransform transform,
+                         btVector3 velocity, float cameraYaw,
+                         float cameraPitch);
+  static void readState(network::BitStream& stream, btTransform& transform,
+                        btVector3& velocity, float& cameraYaw,
+                        float& cameraPitch);
 
   void imguiDebug();
 
@@ -0,0 +1,185 @@
+#include "lagcompensation.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+
+#include "console.hpp"
+#include "logging.hpp"
+
+namespace rdm::putil {
+LagCompensation::LagCompensation(int maxColliders, int history) {
+  this->maxColliders = maxColliders;
+  frames.resize(history);
+  records.resize(history * maxColliders);
+  saved.reserve(maxColliders);
+  clear();
+}
+
+void LagCompensation::clear() {
+  head = frames.size() - 1;
+  frameCount = 0;
+  saved.clear();
+}
+
+void LagCompensation::beginFrame(float time) {
+  head = (head + 1) % frames.size();
+  frames[head].time = time;
+  frames[head].count = 0;
+  if (frameCount < (int)frames.size()) frameCount++;
+}
+
+void LagCompensation::record(int id, const btTransform& transform) {
+  if (!frameCount) return;
+  Frame& frame = frames[head];
+  if (frame.count >= maxColliders) return;
+  Record& record = records[head * maxColliders + frame.count++];
+  record.id = id;
+  record.origin = transform.getOrigin();
+  record.rotation = transform.getRotation();
+}
+
+const LagCompensation::Record* LagCompensation::find(int frame, int id) const {
+  const Record* first = &records[frame * maxColliders];
+  for (int i = 0; i < frames[frame].count; i++)
+    if (first[i].id == id) return &first[i];
+  return NULL;
+}
+
+bool LagCompensation::findFrames(float time, int& before, int& after) const {
+  if (!frameCount || time >= frames[head].time) return false;
+
+  int size = frames.size();
+  after = -1;
+  for (int i = 0; i < frameCount; i++) {
+    int frame = (head - i + size) % size;
+    if (frames[frame].time <= time) {
+      before = frame;
+      return true;
+    }
+    after = frame;
+  }
+  // older than the history, the oldest frame is the best there is
+  before = after;
+  after = -1;
+  return true;
+}
+
+void LagCompensation::restore(btCollisionWorld* world) {
+  for (auto& s : saved) {
+    s.object->setWorldTransform(s.transform);
+    world->updateSingleAabb(s.object);
+  }
+  saved.clear();
+}
+
+namespace {
+struct BenchWorld {
+  btDefaultCollisionConfiguration configuration;
+  btCollisionDispatcher dispatcher;
+  btDbvtBroadphase broadphase;
+  btCollisionWorld world;
+  btCapsuleShape shape;
+  std::vector<std::unique_ptr<btCollisionObject>> objects;
+  std::vector<btVector3> velocities;
+
+  BenchWorld(int players)
+      : dispatcher(&configuration),
+        world(&dispatcher, &broadphase, &configuration),
+        shape(16.f, 40.f) {
+    for (int i = 0; i < players; i++) {
+      auto object = std::make_unique<btCollisionObject>();
+      object->setCollisionShape(&shape);
+      object->setWorldTransform(btTransform(
+          btQuaternion::getIdentity(),
+          btVector3((rand() % 2000) - 1000.f, (rand() % 2000) - 1000.f, 0.f)));
+      world.addCollisionObject(object.get());
+      objects.push_back(std::move(object));
+      velocities.push_back(btVector3(0, 0, 0));
+    }
+  }
+
+  ~BenchWorld() {
+    for (auto& object : objects) world.removeCollisionObject(object.get());
+  }
+
+  void step(float dt) {
+    for (size_t i = 0; i < objects.size(); i++) {
+      velocities[i] +=
+          btVector3((rand() % 200) - 100.f, (rand() % 200) - 100.f, 0.f);
+      if (velocities[i].length() > 320.f)
+        velocities[i] = velocities[i].normalized() * 320.f;
+      btTransform transform = objects[i]->getWorldTransform();
+      transform.setOrigin(transform.getOrigin() + velocities[i] * dt);
+      objects[i]->setWorldTransform(transform);
+      world.updateSingleAabb(objects[i].get());
+    }
+  }
+
+  // a shot from one player at where another one is now
+  void shot(int& shooter, btVector3& from, btVector3& to) {
+    shooter = rand() % objects.size();
+    int target = rand() % objects.size();
+    from = objects[shooter]->getWorldTransform().getOrigin();
+    to = objects[target]->getWorldTransform().getOrigin();
+    to = from + (to - from).normalized() * 4096.f;
+  }
+};
+
+// seconds per shot
+double benchmarkShots(BenchWorld& bench, LagCompensation* lag, float now,
+                      int shots, int& hits) {
+  hits = 0;
+  auto lookup = [&bench](int id) -> btCollisionObject* {
+    return bench.objects[id].get();
+  };
+  std::chrono::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < shots; i++) {
+    int shooter;
+    btVector3 from, to;
+    bench.shot(shooter, from, to);
+    if (lag) lag->rewind(now - 0.2f, shooter, lookup, &bench.world);
+    btCollisionWorld::ClosestRayResultCallback callback(from, to);
+    bench.world.rayTest(from, to, callback);
+    if (lag) lag->restore(&bench.world);
+    if (callback.hasHit()) hits++;
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+             .count() /
+         shots;
+}
+}  // namespace
+
+static ConsoleCommand bench_lagcomp(
+    "bench_lagcomp", "bench_lagcomp [players] [shots]",
+    "times a rewound hitscan trace against a plain one",
+    [](Game* game, ConsoleArgReader r) {
+      int players = std::atoi(r.next().c_str());
+      int shots = std::atoi(r.next().c_str());
+      if (players <= 0) players = 32;
+      if (shots <= 0) shots = 10000;
+
+      srand(players);
+      BenchWorld bench(players);
+      LagCompensation lag(players);
+      float dt = 1.f / 60.f;
+      float now = 0.f;
+      for (int t = 0; t < 64; t++) {
+        bench.step(dt);
+        now += dt;
+        lag.beginFrame(now);
+        for (int i = 0; i < players; i++)
+          lag.record(i, bench.objects[i]->getWorldTransform());
+      }
+
+      int plainHits, rewoundHits;
+      double plain = benchmarkShots(bench, NULL, now, shots, plainHits);
+      double rewound = benchmarkShots(bench, &lag, now, shots, rewoundHits);
+      Log::printf(LOG_INFO,
+                  "%i players, %i shots: plain %0.1fns (%i hits), rewound "
+                  "%0.1fns (%i hits) per shot",
+                  players, shots, plain * 1e9, plainHits, rewound * 1e9,
+                  rewoundHits);
+    });
+}  // namespace rdm::putil
@@ -0,0 +1,111 @@
+#pragma once
+#include <btBulletDynamicsCommon.h>
+
+#include <vector>
+
+namespace rdm::putil {
+/**
+ * @brief A short history of collider transforms, so the server can move
+ * colliders back to where a client saw them when it fired, trace, and put
+ * them back.
+ *
+ * Everything is allocated up front; recording, rewinding and restoring never
+ * allocate. Colliders are remembered by id, not by pointer, so one deleted in
+ * the meantime is simply skipped.
+ */
+class LagCompensation {
+  struct Record {
+    int id;
+    btVector3 origin;
+    btQuaternion rotation;
+  };
+
+  struct Frame {
+    float time;
+    int count;
+  };
+
+  struct Saved {
+    btCollisionObject* object;
+    btTransform transform;
+  };
+
+  int maxColliders;
+  int head;  // the frame being recorded, or the newest one
+  int frameCount;
+  std::vector<Frame> frames;
+  std::vector<Record> records;  // maxColliders per frame
+  std::vector<Saved> saved;
+
+  const Record* find(int frame, int id) const;
+  // the frames before and after time, after is -1 if time is past the newest
+  bool findFrames(float time, int& before, int& after) const;
+
+ public:
+  /**
+   * @param history How many frames are kept, at 60 ticks a second the
+   * default is a little over a second
+   */
+  LagCompensation(int maxColliders = 64, int history = 64);
+
+  /**
+   * @brief Starts a new frame, overwriting the oldest one. Frames must be
+   * recorded in increasing time.
+   */
+  void beginFrame(float time);
+  /**
+   * @brief Records a collider in the current frame, ignored past
+   * maxColliders.
+   */
+  void record(int id, const btTransform& transform);
+
+  /**
+   * @brief Moves every collider recorded around time, except ignoreId, to
+   * where it was at that time. Call restore() before the world steps again.
+   *
+   * Times older than the history use the oldest frame; times past the newest
+   * frame leave colliders where they are.
+   *
+   * @param lookup Returns the btCollisionObject* for an id, or NULL if it is
+   * gone
+   * @return How many colliders were moved
+   */
+  template <typename Lookup>
+  int rewind(float time, int ignoreId, Lookup lookup, btCollisionWorld* world) {
+    restore(world);
+    int before, after;
+    if (!findFrames(time, before, after)) return 0;
+
+    const Frame& frame = frames[before];
+    float t = 0.f;
+    if (after != -1)
+      t = (time - frame.time) / (frames[after].time - frame.time);
+    for (int i = 0; i < frame.count; i++) {
+      const Record& record = records[before * maxColliders + i];
+      if (record.id == ignoreId) continue;
+      btCollisionObject* object = lookup(record.id);
+      if (!object) continue;
+
+      btTransform transform(record.rotation, record.origin);
+      const Record* next = after != -1 ? find(after, record.id) : NULL;
+      if (next) {
+        transform.setOrigin(record.origin.lerp(next->origin, t));
+        transform.setRotation(record.rotation.slerp(next->rotation, t));
+      }
+
+      saved.push_back(Saved{object, object->getWorldTransform()});
+      object->setWorldTransform(transform);
+      world->updateSingleAabb(object);
+    }
+    return saved.size();
+  }
+
+  /**
+   * @brief Puts colliders moved by rewind() back.
+   */
+  void restore(btCollisionWorld* world);
+
+  void clear();
+  int getMaxColliders() const { return maxColliders; }
+};
+}  // namespace rdm::putil
@@ -127,19 +127,21 @@ void RGame::initialize() {
     cam.setTarget(cam.getPosition() + vm * forward);
 
     if (Input::singleton()->isKeyDown(SDLK_q)) {
-      glm::vec3 pos = glm::vec3(0.0);
-      {
-        std::scoped_lock l(world->getPhysicsWorld()->mutex);
-        btVector3 start = BulletHelpers::toVector3(cam.getPosition());
-        btVector3 end = BulletHelpers::toVector3(vm * (100.f * forward));
-        btDynamicsWorld::ClosestRayResultCallback callback(start, end);
-        world->getPhysicsWorld()->getWorld()->rayTest(start, end, callback);
-        pos = BulletHelpers::fromVector3(callback.m_hitPointWorld) -
-              ((vm * forward) * 2.f);
-      }
-      game->createBall(world->getPhysicsWorld(), 1.f, pos);
+      PhysicsWorld* physics = world->getPhysicsWorld();
+      btVector3 start = BulletHelpers::toVector3(cam.getPosition());
+      btVector3 end = BulletHelpers::toVector3(vm * (100.f * forward));
+      glm::vec3 back = (vm * forward) * 2.f;
+      // the ball is made on the physics thread once the ray has run
+      physics->queueRay(start, end,
+                        [this, physics, back](const PhysicsQueryResult& r) {
+                          glm::vec3 pos =
+                              BulletHelpers::fromVector3(r.point) - back;
+                          game->createBall(physics, 1.f, pos);
+                        });
     }
 
+    // balls are added from the physics thread by the ray above
+    std::scoped_lock l(world->getPhysicsWorld()->mutex, game->entitiesMutex);
     for (int i = 0; i < game->entities.size(); i++) {
       REntity& e = game->entities[i];
       btTransform trans;
@@ -182,7 +184,9 @@ void RGame::initialize() {
 
               // update entity positioning
               btTransform trans;
-              e.state->getWorldTransform(trans);
+              if (!world->getPhysicsWorld()->getInterpolatedTransform(e.body,
+                                                                      trans))
+                e.state->getWorldTransform(trans);
               btVector3 origin = trans.getOrigin();
               e.position = glm::vec3(origin.x(), origin.y(), origin.z());
             }
@@ -58,7 +58,7 @@ America::~America() {
 
 void America::tick() {
   if (getManager()->isBackend()) {
-    std::vector<Entity*> pawns = getManager()->findEntitiesByType("Pawn");
+    auto& pawns = getManager()->findEntitiesByType("Pawn");
     if (!pawns.size()) return;
     bool allTurnsDone = true;
     for (auto _pawn : pawns) {
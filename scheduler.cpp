@@ -1,9 +1,13 @@
 #include "scheduler.hpp"
 
+#include <math.h>
+
+#include <algorithm>
 #include <chrono>
 
 #include "input.hpp"
 #include "logging.hpp"
+#include "settings.hpp"
 
 #ifdef __linux
 #include <linux/prctl.h> /* Definition of PR_* constants */
@@ -20,21 +24,389 @@
 static size_t schedulerId = 0;
 
 namespace rdm {
+static CVar sched_pool("sched_pool", "0", CVARF_SAVE | CVARF_GLOBAL);
+static CVar sched_threads("sched_threads", "0", CVARF_SAVE | CVARF_GLOBAL);
+static CVar sched_window("sched_window", "256", CVARF_SAVE | CVARF_GLOBAL);
+
+static thread_local SchedulerJob* currentJobPtr = NULL;
+static thread_local SchedulerPool* currentWorkerPool = NULL;
+static thread_local int currentWorkerId = -1;
+
+static void setThreadName(std::string name) {
+#ifndef NDEBUG
+#ifdef __linux
+  pthread_setname_np(pthread_self(), name.c_str());
+  prctl(PR_SET_NAME, name.c_str());
+#endif
+#endif
+}
+
+SchedulerTimer::SchedulerTimer() {
+  lastId = 0;
+  running = true;
+  thread = std::thread(&SchedulerTimer::timerMain, this);
+}
+
+SchedulerTimer::~SchedulerTimer() {
+  {
+    std::scoped_lock l(mutex);
+    running = false;
+  }
+  wake.notify_all();
+  if (thread.joinable()) thread.join();
+}
+
+static SchedulerTimer* _timerSingleton = NULL;
+static std::mutex timerSingletonMutex;
+SchedulerTimer* SchedulerTimer::singleton() {
+  std::scoped_lock l(timerSingletonMutex);
+  if (!_timerSingleton) _timerSingleton = new SchedulerTimer();
+  return _timerSingleton;
+}
+
+SchedulerTimer::TimerId SchedulerTimer::schedule(TimePoint when,
+                                                 Callback callback) {
+  bool earliest;
+  TimerId id;
+  {
+    std::scoped_lock l(mutex);
+    id = ++lastId;
+    earliest = queue.empty() || when < queue.top().when;
+    queue.push(Entry{.when = when, .id = id});
+    callbacks[id] = std::move(callback);
+  }
+  if (earliest) wake.notify_one();
+  return id;
+}
+
+bool SchedulerTimer::cancel(TimerId id) {
+  std::scoped_lock l(mutex);
+  // the queue entry is left behind and dropped once it comes up
+  return callbacks.erase(id) != 0;
+}
+
+void SchedulerTimer::timerMain() {
+  setThreadName("SchedulerTimer");
+
+  std::unique_lock l(mutex);
+  while (running) {
+    if (queue.empty()) {
+      wake.wait(l);
+      continue;
+    }
+
+    Entry next = queue.top();
+    if (std::chrono::steady_clock::now() < next.when) {
+      wake.wait_until(l, next.when);
+      continue;
+    }
+    queue.pop();
+
+    auto it = callbacks.find(next.id);
+    if (it == callbacks.end()) continue;  // cancelled
+    Callback callback = std::move(it->second);
+    callbacks.erase(it);
+    try {
+      callback();
+    } catch (std::exception& e) {
+      Log::printf(LOG_ERROR, "Unhandled exception in timer, what() = '%s'",
+                  e.what());
+    }
+  }
+}
+
+SchedulerPool::SchedulerPool(size_t numWorkers) {
+  queued = 0;
+  nextWorker = 0;
+  running = true;
+  for (size_t i = 0; i < numWorkers; i++)
+    workers.push_back(std::unique_ptr<Worker>(new Worker()));
+  for (size_t i = 0; i < numWorkers; i++)
+    workers[i]->thread = std::thread(&SchedulerPool::workerMain, this, i);
+  Log::printf(LOG_DEBUG, "Started scheduler pool with %i workers", numWorkers);
+}
+
+SchedulerPool::~SchedulerPool() {
+  {
+    std::scoped_lock l(mutex);
+    running = false;
+  }
+  wake.notify_all();
+  for (auto& worker : workers)
+    if (worker->thread.joinable()) worker->thread.join();
+}
+
+static SchedulerPool* _poolSingleton = NULL;
+static std::mutex poolSingletonMutex;
+SchedulerPool* SchedulerPool::singleton() {
+  std::scoped_lock l(poolSingletonMutex);
+  if (!_poolSingleton) {
+    int numWorkers = sched_threads.getInt();
+    if (numWorkers <= 0) numWorkers = std::thread::hardware_concurrency();
+    _poolSingleton = new SchedulerPool(std::max(numWorkers, 1));
+  }
+  return _poolSingleton;
+}
+
+int SchedulerPool::getWorkerId() {
+  return currentWorkerPool == this ? currentWorkerId : -1;
+}
+
+void SchedulerPool::push(size_t id, Task task) {
+  Worker* worker = workers[id].get();
+  std::scoped_lock l(worker->mutex);
+  worker->tasks.push_back(std::move(task));
+  queued++;
+}
+
+bool SchedulerPool::popTask(size_t id, Task& task) {
+  {
+    Worker* worker = workers[id].get();
+    std::scoped_lock l(worker->mutex);
+    if (!worker->tasks.empty()) {
+      task = std::move(worker->tasks.back());
+      worker->tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < workers.size(); i++) {
+    Worker* victim = workers[(id + i) % workers.size()].get();
+    std::scoped_lock l(victim->mutex);
+    if (!victim->tasks.empty()) {
+      task = std::move(victim->tasks.front());
+      victim->tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SchedulerPool::submit(Task task) {
+  int id = getWorkerId();
+  if (id == -1) id = nextWorker++ % workers.size();
+  push(id, std::move(task));
+  { std::scoped_lock l(mutex); }  // worker may be between check and wait
+  wake.notify_one();
+}
+
+SchedulerTimer::TimerId SchedulerPool::submitAt(TimePoint when, Task task) {
+  return SchedulerTimer::singleton()->schedule(
+      when, [this, task] { submit(task); });
+}
+
+struct TaskGroupState {
+  std::mutex mutex;
+  std::condition_variable done;
+  std::deque<std::function<void()>> tasks;
+  size_t pending;
+  std::exception_ptr error;
+
+  // pops and runs one task of this group, returns false if none were queued
+  bool runOne() {
+    std::function<void()> task;
+    {
+      std::scoped_lock l(mutex);
+      if (tasks.empty()) return false;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+
+    std::exception_ptr thrown;
+    try {
+      task();
+    } catch (...) {
+      thrown = std::current_exception();
+    }
+
+    std::scoped_lock l(mutex);
+    if (thrown && !error) error = thrown;
+    if (--pending == 0) done.notify_all();
+    return true;
+  }
+};
+
+TaskGroup::TaskGroup(SchedulerPool* pool) {
+  this->pool = pool;
+  state.reset(new TaskGroupState());
+  state->pending = 0;
+}
+
+TaskGroup::~TaskGroup() {
+  try {
+    wait();
+  } catch (std::exception& e) {
+    Log::printf(LOG_ERROR, "Unwaited task group threw, what() = '%s'",
+                e.what());
+  }
+}
+
+void TaskGroup::spawn(std::function<void()> task) {
+  {
+    std::scoped_lock l(state->mutex);
+    state->tasks.push_back(std::move(task));
+    state->pending++;
+    state->done.notify_all();
+  }
+  // the pool only gets a runner, so whoever gets to the task first (a worker
+  // or the thread in wait()) runs it. the runner keeps the state alive in case
+  // the group is gone by the time it is picked up
+  std::shared_ptr<TaskGroupState> state = this->state;
+  pool->submit([state] { state->runOne(); });
+}
+
+void TaskGroup::wait() {
+  while (true) {
+    if (state->runOne()) continue;
+
+    std::unique_lock l(state->mutex);
+    if (state->pending == 0) break;
+    // the rest are running elsewhere, but they can still spawn more
+    state->done.wait(l, [this] {
+      return state->pending == 0 || !state->tasks.empty();
+    });
+  }
+
+  std::scoped_lock l(state->mutex);
+  if (state->error) {
+    std::exception_ptr e = state->error;
+    state->error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+TaskGraph::Node* TaskGraph::add(std::function<void()> task) {
+  std::scoped_lock l(mutex);
+  Node* node = new Node();
+  node->task = task;
+  node->dependencies = 0;
+  nodes.push_back(std::unique_ptr<Node>(node));
+  return node;
+}
+
+void TaskGraph::precede(Node* before, Node* after) {
+  std::scoped_lock l(mutex);
+  before->successors.push_back(after);
+  after->dependencies++;
+}
+
+void TaskGraph::remove(Node* node) {
+  std::scoped_lock l(mutex);
+  for (auto& other : nodes) {
+    auto it = std::find(other->successors.begin(), other->successors.end(),
+                        node);
+    if (it != other->successors.end()) other->successors.erase(it);
+  }
+  for (auto successor : node->successors) successor->dependencies--;
+  std::erase_if(nodes, [node](std::unique_ptr<Node>& n) {
+    return n.get() == node;
+  });
+}
+
+bool TaskGraph::empty() {
+  std::scoped_lock l(mutex);
+  return nodes.empty();
+}
+
+void TaskGraph::runNode(Node* node, TaskGroup& group) {
+  group.spawn([this, node, &group] {
+    node->task();
+    for (auto successor : node->successors)
+      if (--successor->remaining == 0) runNode(successor, group);
+  });
+}
+
+void TaskGraph::run() {
+  std::scoped_lock l(mutex);
+  TaskGroup group;
+  for (auto& node : nodes) node->remaining = node->dependencies;
+  for (auto& node : nodes)
+    if (node->dependencies == 0) runNode(node.get(), group);
+  group.wait();
+}
+
+void SchedulerPool::workerMain(size_t id) {
+  currentWorkerPool = this;
+  currentWorkerId = id;
+  setThreadName("Pool/" + std::to_string(id));
+
+  while (running) {
+    Task task;
+    if (popTask(id, task)) {
+      try {
+        task();
+      } catch (std::exception& e) {
+        Log::printf(LOG_ERROR,
+                    "Unhandled exception in pool task, what() = '%s'",
+                    e.what());
+      }
+      continue;
+    }
+
+    std::unique_lock l(mutex);
+    wake.wait(l, [this] { return !running || queued != 0; });
+  }
+}
+
 Scheduler::Scheduler() { this->id = schedulerId++; }
 Scheduler::~Scheduler() { waitToWrapUp(); }
 
+SchedulerJob* Scheduler::currentJob() {
+  for (auto& job : jobs)
+    if (job.get() == currentJobPtr) return currentJobPtr;
+  return NULL;
+}
+
 void Scheduler::imguiDebug() {
   for (auto& job : jobs) {
-    JobStatistics stats = job->getStats();
-    ImGui::Text("Job %s", stats.name);
-    ImGui::Text("S: %i, T: %0.2f", stats.schedulerId, stats.time);
-    ImGui::Text("Total DT: %0.8f", stats.totalDeltaTime);
-    ImGui::Text("DT: %0.8f", stats.deltaTime);
+    JobStatistics& stats = job->getStats();
+    ImGui::Text("Job %s%s", stats.name, job->isPooled() ? " (pooled)" : "");
+    ImGui::Text("S: %i, T: %0.2f", stats.schedulerId, stats.time.load());
+    ImGui::Text("Total DT: %0.8f", stats.totalDeltaTime.load());
+    ImGui::Text("DT: %0.8f", stats.deltaTime.load());
     ImGui::Text("Expected DT: %0.8f", job->getFrameRate());
+    ImGui::Text("Jitter: %0.8f (max %0.8f), skipped %i",
+                stats.pacingJitter.load(), stats.maxPacingJitter.load(),
+                stats.skippedFrames.load());
+    JobHistogram::Percentiles step = stats.stepTimes.getPercentiles();
+    ImGui::Text("Step p50 %0.3fms, p95 %0.3fms, p99 %0.3fms, max %0.3fms",
+                step.p50 * 1000.0, step.p95 * 1000.0, step.p99 * 1000.0,
+                step.max * 1000.0);
+    ImGui::Text("Overruns: %i (last %i frames)", stats.overruns.load(),
+                step.count);
     ImGui::Separator();
   }
 }
 
+void Scheduler::logPacingReport() {
+  for (auto& job : jobs) {
+    JobStatistics& stats = job->getStats();
+    double expected = job->getFrameRate();
+    Log::printf(LOG_INFO,
+                "%s/%i: period %0.3fms (expected %0.3fms), jitter %0.3fms "
+                "(max %0.3fms), skipped %i frames",
+                stats.name, stats.schedulerId,
+                stats.getAvgDeltaTime() * 1000.0, expected * 1000.0,
+                stats.pacingJitter * 1000.0, stats.maxPacingJitter * 1000.0,
+                stats.skippedFrames.load());
+  }
+}
+
+void Scheduler::logLatencyReport() {
+  for (auto& job : jobs) {
+    JobStatistics& stats = job->getStats();
+    JobHistogram::Percentiles step = stats.stepTimes.getPercentiles();
+    Log::printf(LOG_INFO,
+                "%s/%i: step p50 %0.3fms, p95 %0.3fms, p99 %0.3fms, max "
+                "%0.3fms over %i frames, %i overruns",
+                stats.name, stats.schedulerId, step.p50 * 1000.0,
+                step.p95 * 1000.0, step.p99 * 1000.0, step.max * 1000.0,
+                step.count, stats.overruns.load());
+  }
+}
+
 void Scheduler::waitToWrapUp() {
   for (auto& job : jobs) {
     job->stopBlocking();
@@ -49,157 +421,386 @@ SchedulerJob* Scheduler::addJob(SchedulerJob* job) {
 }
 
 void Scheduler::startAllJobs() {
-  for (int i = 0; i < jobs.size(); i++) jobs[i]->startTask();
+  SchedulerPool* pool =
+      sched_pool.getBool() ? SchedulerPool::singleton() : NULL;
+  for (int i = 0; i < jobs.size(); i++) {
+    if (pool && !jobs[i]->isThreadAffine())
+      jobs[i]->startPooled(pool);
+    else
+      jobs[i]->startTask();
+  }
 }
 
 SchedulerJob::SchedulerJob(const char* name, bool stopOnCancel) {
   this->stopOnCancel = stopOnCancel;
   stats.name = name;
-  killMutex.lock();
+  pool = NULL;
+  pendingTimer = 0;
+  pooledStarted = false;
+  woken = false;
+  started = false;
+  finished = false;
 }
 
 SchedulerJob::~SchedulerJob() { stopBlocking(); }
 
-void JobStatistics::addDeltaTimeSample(double dt) {
-  for (int i = 0; i < SCHEDULER_TIME_SAMPLES - 1; i++) {
-    deltaTimeSamples[i] = deltaTimeSamples[i + 1];
+JobHistogram::JobHistogram(size_t window) {
+  this->window = std::max((size_t)1, window);
+  samples.reset(new std::atomic<double>[this->window]);
+  clear();
+}
+
+void JobHistogram::add(double sample) {
+  size_t i = written.load(std::memory_order_relaxed);
+  samples[i % window].store(sample, std::memory_order_relaxed);
+  written.store(i + 1, std::memory_order_release);
+}
+
+void JobHistogram::clear() {
+  for (size_t i = 0; i < window; i++)
+    samples[i].store(0.0, std::memory_order_relaxed);
+  written.store(0, std::memory_order_release);
+}
+
+double JobHistogram::getMean() {
+  size_t count = std::min(written.load(std::memory_order_acquire), window);
+  if (count == 0) return 0.0;
+  double sum = 0.0;
+  for (size_t i = 0; i < count; i++)
+    sum += samples[i].load(std::memory_order_relaxed);
+  return sum / count;
+}
+
+JobHistogram::Percentiles JobHistogram::getPercentiles() {
+  Percentiles p = {};
+  size_t count = std::min(written.load(std::memory_order_acquire), window);
+  if (count == 0) return p;
+
+  std::vector<double> sorted(count);
+  for (size_t i = 0; i < count; i++)
+    sorted[i] = samples[i].load(std::memory_order_relaxed);
+  std::sort(sorted.begin(), sorted.end());
+
+  auto rank = [&](double q) {
+    size_t i = (size_t)ceil(q * count);
+    return sorted[std::clamp(i, (size_t)1, count) - 1];
+  };
+  p.p50 = rank(0.50);
+  p.p95 = rank(0.95);
+  p.p99 = rank(0.99);
+  p.max = sorted.back();
+  for (double sample : sorted) p.mean += sample;
+  p.mean /= count;
+  p.count = count;
+  return p;
+}
+
+static size_t getWindow() {
+  return std::clamp(sched_window.getInt(), 1, SCHEDULER_MAX_WINDOW);
+}
+
+JobStatistics::JobStatistics() : periods(getWindow()), stepTimes(getWindow()) {
+  overruns = 0;
+}
+
+void JobStatistics::addDeltaTimeSample(double dt) { periods.add(dt); }
+
+void JobStatistics::addStepTimeSample(double dt, double expected) {
+  stepTimes.add(dt);
+  if (expected != 0.0 && dt > expected) overruns++;
+}
+
+void JobStatistics::addPacingSample(double period, double expected) {
+  expectedDeltaTime = expected;
+  if (expected == 0.0) return;  // unlimited jobs have nothing to miss
+  double error = fabs(period - expected);
+  // only this job writes them, the loads and stores just keep readers on other
+  // threads from seeing torn values
+  double jitter = pacingJitter.load();
+  pacingJitter = jitter + (error - jitter) / SCHEDULER_TIME_SAMPLES;
+  if (error > maxPacingJitter.load()) maxPacingJitter = error;
+}
+
+double JobStatistics::getAvgDeltaTime() { return periods.getMean(); }
+
+void SchedulerJob::beginTask() {
+  stats.time = 0.0;
+  stats.expectedDeltaTime = 0.0;
+  stats.pacingJitter = 0.0;
+  stats.maxPacingJitter = 0.0;
+  stats.skippedFrames = 0;
+  stats.overruns = 0;
+  stats.periods.clear();
+  stats.stepTimes.clear();
+  deadline = std::chrono::steady_clock::now();
+#ifndef NDEBUG
+  Log::printf(LOG_DEBUG, "Starting job %s/%i", stats.name, stats.schedulerId);
+#endif
+  startup();
+}
+
+bool SchedulerJob::stepTask() {
+  currentJobPtr = this;
+
+  Result r;
+  try {
+    r = step();
+  } catch (std::exception& e) {
+    Log::printf(LOG_FATAL, "Fatal unhandled exception in %s/%i, what() = '%s'",
+                stats.name, stats.schedulerId, e.what());
+    r = Cancel;
+
+    try {
+      error(e);
+    } catch (std::exception& e) {
+      Log::printf(LOG_FATAL,
+                  "Double error in SchedulerJob error handler, what() = '%s'",
+                  e.what());
+    }
+
+    Log::printf(LOG_DEBUG, "Sending quit object to Input queue");
+    InputObject quitObject{.type = InputObject::Quit};
+    Input::singleton()->postEvent(quitObject);
+  }
+  switch (r) {
+    case Stepped:
+      break;
+    case Cancel:
+      state = Stopped;
+      break;
+  }
+
+  bool running = true;
+  switch (state) {
+    case Running:
+    default:
+      break;
+    case StopPlease:
+      if (stopOnCancel) {
+        running = false;
+        state = Stopped;
+      }
+      break;
+    case Stopped:
+      running = false;
+      state = Stopped;
+      break;
   }
-  // memcpy(deltaTimeSamples, &deltaTimeSamples[1],
-  //      sizeof(double) * (SCHEDULER_TIME_SAMPLES - 1));
-  deltaTimeSamples[SCHEDULER_TIME_SAMPLES - 1] = dt;
+  return running;
+}
+
+void SchedulerJob::endTask() {
+  shutdown();
+#ifndef NDEBUG
+  Log::printf(LOG_DEBUG, "Task %s/%i stopped", stats.name, stats.schedulerId);
+#endif
+}
+
+void SchedulerJob::finishTask() {
+  // notify while still holding waitMutex, stopBlocking may destroy the job as
+  // soon as it gets the lock back
+  std::scoped_lock l(waitMutex);
+  state = Stopped;
+  finished = true;
+  stopped.notify_all();
 }
 
-double JobStatistics::getAvgDeltaTime() {
-  double avg = 0.0;
-  for (int i = 0; i < SCHEDULER_TIME_SAMPLES; i++) avg += deltaTimeSamples[i];
-  avg /= SCHEDULER_TIME_SAMPLES;
-  return avg;
+std::chrono::steady_clock::time_point SchedulerJob::nextDeadline(
+    std::chrono::steady_clock::time_point now) {
+  double frameRate = getFrameRate();
+  if (frameRate == 0.0) {  // run as fast as we can if there is no frame rate
+    deadline = now;
+    return deadline;
+  }
+
+  std::chrono::steady_clock::duration period =
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(frameRate));
+  deadline += period;
+  if (deadline < now) {
+    size_t missed = (now - deadline) / period;
+    switch (getOverrunPolicy()) {
+      case CatchUp:
+        if (missed < SCHEDULER_MAX_CATCHUP) break;
+        // too far behind to ever catch up, start over from now
+        stats.skippedFrames += missed;
+        deadline = now;
+        break;
+      case Skip:
+      default:
+        stats.skippedFrames += missed + 1;
+        deadline += period * (missed + 1);
+        break;
+    }
+  }
+  return deadline;
+}
+
+bool SchedulerJob::waitUntil(std::chrono::steady_clock::time_point when) {
+  {
+    std::scoped_lock l(waitMutex);
+    woken = false;
+  }
+
+  // never schedule with waitMutex held, the timer callback locks it
+  SchedulerTimer::TimerId timer =
+      SchedulerTimer::singleton()->schedule(when, [this] {
+        std::scoped_lock l(waitMutex);
+        woken = true;
+        wake.notify_all();
+      });
+
+  bool stopping;
+  {
+    std::unique_lock l(waitMutex);
+    wake.wait(l, [this] {
+      return woken || (stopOnCancel && state != Running);
+    });
+    stopping = !woken;
+  }
+
+  SchedulerTimer::singleton()->cancel(timer);
+  return !stopping;
 }
 
 void SchedulerJob::task(SchedulerJob* job) {
-#ifndef NDEBUG
-#ifdef __linux
   std::string jobName = job->getStats().name;
   jobName += "/" + std::to_string(job->getStats().schedulerId);
-  pthread_setname_np(pthread_self(), jobName.c_str());
-  prctl(PR_SET_NAME, jobName.c_str());
-#endif
-#endif
+  setThreadName(jobName);
 #ifndef DISABLE_EASY_PROFILER
   EASY_THREAD_SCOPE(jobName.c_str());
 #endif
-  job->stats.time = 0.0;
-  for (int i = 0; i < SCHEDULER_TIME_SAMPLES; i++)
-    job->stats.deltaTimeSamples[i] = 0.0;
   bool running = true;
-#ifndef NDEBUG
-  Log::printf(LOG_DEBUG, "Starting job %s/%i", job->getStats().name,
-              job->getStats().schedulerId);
-#endif
-  job->startup();
+  job->beginTask();
   while (running) {
 #ifndef DISABLE_EASY_PROFILER
     EASY_BLOCK("Step");
 #endif
     std::chrono::time_point start = std::chrono::steady_clock::now();
 
-    Result r;
-    try {
-      r = job->step();
-    } catch (std::exception& e) {
-      Log::printf(LOG_FATAL,
-                  "Fatal unhandled exception in %s/%i, what() = '%s'",
-                  job->getStats().name, job->getStats().schedulerId, e.what());
-      r = Cancel;
-
-      try {
-        job->error(e);
-      } catch (std::exception& e) {
-        Log::printf(LOG_FATAL,
-                    "Double error in SchedulerJob error handler, what() = '%s'",
-                    e.what());
-      }
-
-      Log::printf(LOG_DEBUG, "Sending quit object to Input queue");
-      InputObject quitObject{.type = InputObject::Quit};
-      Input::singleton()->postEvent(quitObject);
-    }
-    switch (r) {
-      case Stepped:
-        break;
-      case Cancel:
-        job->state = Stopped;
-        break;
-    }
-
-    switch (job->state) {
-      case Running:
-      default:
-        break;
-      case StopPlease:
-        if (job->stopOnCancel) {
-          running = false;
-          job->state = Stopped;
-        }
-        break;
-      case Stopped:
-        running = false;
-        job->state = Stopped;
-        break;
-    }
+    running = job->stepTask();
 
     double frameRate = job->getFrameRate();
     std::chrono::time_point end = std::chrono::steady_clock::now();
     std::chrono::duration execution = end - start;
-    if (frameRate != 0.0) {  // run as fast as we can if there is no frame rate
+    std::chrono::time_point until = job->nextDeadline(end);
+    if (running && until > end) {
 #ifndef DISABLE_EASY_PROFILER
       EASY_BLOCK("Sleep");
 #endif
-      std::chrono::duration sleep =
-          std::chrono::duration<double>(frameRate) - execution -
-          std::chrono::duration<double>(frameRate * 0.00599999999999);
-      std::chrono::time_point until = end + sleep;
-      if (job->stopOnCancel) {
-        if (job->killMutex.try_lock_until(until)) {
-          Log::printf(LOG_DEBUG, "killMutex unlocked on %s",
-                      job->getStats().name);
-          running = false;
-        }
-      } else {
-        std::this_thread::sleep_until(until);
+      if (!job->waitUntil(until)) {
+        Log::printf(LOG_DEBUG, "Woken for stop on %s", job->getStats().name);
+        running = false;
       }
     }
     job->stats.deltaTime = std::chrono::duration<double>(execution).count();
+    job->stats.addStepTimeSample(job->stats.deltaTime, frameRate);
     end = std::chrono::steady_clock::now();
     execution = end - start;
     job->stats.totalDeltaTime =
         std::chrono::duration<double>(execution).count();
     job->stats.time += std::chrono::duration<double>(execution).count();
     job->stats.addDeltaTimeSample(job->stats.totalDeltaTime);
+    job->stats.addPacingSample(job->stats.totalDeltaTime, frameRate);
   }
-  job->shutdown();
-  job->state = Stopped;
-#ifndef NDEBUG
-  Log::printf(LOG_DEBUG, "Task %s/%i stopped", job->getStats().name,
-              job->getStats().schedulerId);
+  job->endTask();
+  job->finishTask();
+}
+
+void SchedulerJob::pooledTask(SchedulerJob* job) {
+#ifndef DISABLE_EASY_PROFILER
+  EASY_BLOCK("Pooled Step");
 #endif
+  std::chrono::time_point start = std::chrono::steady_clock::now();
+  if (!job->pooledStarted) {
+    job->pooledStarted = true;
+    job->lastStart = start;
+    job->beginTask();
+  } else {
+    // the period of the last frame is only known now, once it has been
+    // rescheduled and started again
+    double period =
+        std::chrono::duration<double>(start - job->lastStart).count();
+    job->lastStart = start;
+    job->stats.totalDeltaTime = period;
+    job->stats.time += period;
+    job->stats.addDeltaTimeSample(period);
+    job->stats.addPacingSample(period, job->stats.expectedDeltaTime);
+  }
+
+  bool running = job->stepTask();
+
+  std::chrono::time_point end = std::chrono::steady_clock::now();
+  job->stats.deltaTime = std::chrono::duration<double>(end - start).count();
+  job->stats.expectedDeltaTime = job->getFrameRate();
+  job->stats.addStepTimeSample(job->stats.deltaTime,
+                               job->stats.expectedDeltaTime);
+  currentJobPtr = NULL;
+
+  if (!running) {
+    job->endTask();
+    job->finishTask();  // job may be destroyed after this
+    return;
+  }
+
+  std::chrono::time_point next = job->nextDeadline(end);
+
+  // the next frame can run (and stop the job) on another worker as soon as it
+  // is queued, so pendingTimer is written under the lock and the job is not
+  // touched afterwards
+  std::scoped_lock l(job->waitMutex);
+  if (next <= end) {
+    job->pendingTimer = 0;
+    job->pool->submit([job] { pooledTask(job); });
+  } else {
+    job->pendingTimer =
+        job->pool->submitAt(next, [job] { pooledTask(job); });
+  }
+}
+
+void SchedulerJob::startPooled(SchedulerPool* pool) {
+  this->pool = pool;
+  {
+    std::scoped_lock l(waitMutex);
+    started = true;
+  }
+  pool->submit([this] { pooledTask(this); });
 }
 
 void SchedulerJob::startTask() {
+  {
+    std::scoped_lock l(waitMutex);
+    started = true;
+  }
   thread = std::thread(&SchedulerJob::task, this);
 }
 
 SchedulerJob::Result SchedulerJob::step() { return Stepped; }
 
+bool SchedulerJob::isCurrentThread() {
+  if (pool) return currentJobPtr == this;
+  return std::this_thread::get_id() == thread.get_id();
+}
+
 void SchedulerJob::stopBlocking() {
-  if (state == Running) {
-    state = StopPlease;
-    if (stopOnCancel) killMutex.unlock();
-    while (state != Stopped) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(2));
-    }
-    thread.join();
+  SchedulerTimer::TimerId timer;
+  {
+    std::scoped_lock l(waitMutex);
+    if (!started || finished) return;
+    if (state == Running) state = StopPlease;
+    wake.notify_all();
+    timer = pendingTimer;
+  }
+
+  // a pooled job sleeping on the timer is pulled forward so it sees the stop
+  if (pool && stopOnCancel && SchedulerTimer::singleton()->cancel(timer))
+    pool->submit([this] { pooledTask(this); });
+
+  {
+    std::unique_lock l(waitMutex);
+    stopped.wait(l, [this] { return finished; });
   }
+  if (thread.joinable()) thread.join();
 }
 
 SchedulerJob* Scheduler::getJob(std::string name) {
@@ -207,4 +808,28 @@ SchedulerJob* Scheduler::getJob(std::string name) {
     if (jobs[i]->getStats().name == name) return jobs[i].get();
   return nullptr;
 }
+
+void Scheduler::parallelFor(size_t begin, size_t end,
+                            std::function<void(size_t, size_t)> func,
+                            size_t grain) {
+  if (begin >= end) return;
+
+  SchedulerPool* pool = SchedulerPool::singleton();
+  size_t count = end - begin;
+  if (grain == 0)
+    grain = std::max((size_t)1, count / pool->getWorkerCount());
+  if (count <= grain || pool->getWorkerCount() == 1) {
+    func(begin, end);
+    return;
+  }
+
+  TaskGroup group(pool);
+  size_t chunkBegin = begin;
+  for (; chunkBegin + grain < end; chunkBegin += grain) {
+    size_t chunkEnd = chunkBegin + grain;
+    group.spawn([func, chunkBegin, chunkEnd] { func(chunkBegin, chunkEnd); });
+  }
+  func(chunkBegin, end);  // last chunk runs on the calling thread
+  group.wait();
+}
 };  // namespace rdm
@@ -1,13 +1,58 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <queue>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #define SCHEDULER_TIME_SAMPLES 64
+// sched_window is clamped to this many frames
+#define SCHEDULER_MAX_WINDOW 65536
+#define SCHEDULER_MAX_CATCHUP 5
 
 namespace rdm {
+/**
+ * @brief Lock-free ring buffer of timing samples.
+ *
+ * Only the owning job writes samples, any thread may read them. A reader can
+ * race with a sample being replaced while it copies the window, which only
+ * shifts what it sees by a frame.
+ */
+class JobHistogram {
+  std::unique_ptr<std::atomic<double>[]> samples;
+  size_t window;
+  std::atomic<size_t> written;
+
+ public:
+  struct Percentiles {
+    double p50;
+    double p95;
+    double p99;
+    double max;
+    double mean;
+    size_t count;
+  };
+
+  JobHistogram(size_t window = SCHEDULER_TIME_SAMPLES);
+
+  size_t getWindow() { return window; }
+
+  // producer only
+  void add(double sample);
+  void clear();
+
+  double getMean();
+  Percentiles getPercentiles();
+};
+
 /**
  * @brief Statistics for a specific job.
  *
@@ -22,34 +67,283 @@ struct JobStatistics {
    * @brief The last delta time of a job.
    *
    */
-  double deltaTime;
+  std::atomic<double> deltaTime;
   /**
    * @brief The total delta time of a job (including sleep time.)
    *
    */
-  double totalDeltaTime;
+  std::atomic<double> totalDeltaTime;
   /**
    * @brief The total time of a job (added using delta times)
    *
    */
-  double time;
+  std::atomic<double> time;
   size_t schedulerId;
 
-  double deltaTimeSamples[SCHEDULER_TIME_SAMPLES];
+  /**
+   * @brief The frame rate the job asked for on its last frame.
+   *
+   */
+  std::atomic<double> expectedDeltaTime;
+  /**
+   * @brief Running average of how far totalDeltaTime lands from
+   * expectedDeltaTime.
+   *
+   */
+  std::atomic<double> pacingJitter;
+  /**
+   * @brief The worst pacing error seen since the job started.
+   *
+   */
+  std::atomic<double> maxPacingJitter;
+  /**
+   * @brief The number of frames dropped because the job overran its deadline.
+   *
+   */
+  std::atomic<size_t> skippedFrames;
+  /**
+   * @brief The number of steps that took longer than the frame they were
+   * given.
+   *
+   */
+  std::atomic<size_t> overruns;
+
+  /**
+   * @brief Recent totalDeltaTime samples.
+   *
+   */
+  JobHistogram periods;
+  /**
+   * @brief Recent deltaTime samples, the time spent inside step().
+   *
+   */
+  JobHistogram stepTimes;
+
+  JobStatistics();
+
   void addDeltaTimeSample(double dt);
+  void addStepTimeSample(double dt, double expected);
+  void addPacingSample(double period, double expected);
   double getAvgDeltaTime();
 };
 
+/**
+ * @brief Central deadline timer shared by every Scheduler.
+ *
+ * One thread sleeps until the earliest registered deadline and runs whatever
+ * callbacks are due. Callbacks run with the timer locked, so they must be
+ * short and must not schedule or cancel timers themselves.
+ */
+class SchedulerTimer {
+ public:
+  typedef std::function<void()> Callback;
+  typedef std::chrono::steady_clock::time_point TimePoint;
+  typedef size_t TimerId;
+
+ private:
+  struct Entry {
+    TimePoint when;
+    TimerId id;
+
+    bool operator>(const Entry& other) const { return when > other.when; }
+  };
+
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+  std::unordered_map<TimerId, Callback> callbacks;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::thread thread;
+  TimerId lastId;
+  bool running;
+
+  void timerMain();
+
+ public:
+  SchedulerTimer();
+  ~SchedulerTimer();
+
+  static SchedulerTimer* singleton();
+
+  /**
+   * @brief Runs callback on the timer thread once when has passed.
+   *
+   * @return TimerId An id that can be passed to cancel. Never 0.
+   */
+  TimerId schedule(TimePoint when, Callback callback);
+  /**
+   * @brief Cancels a timer.
+   *
+   * @return bool True if the timer was still pending, false if it already
+   * fired or never existed.
+   */
+  bool cancel(TimerId id);
+};
+
+/**
+ * @brief A fixed size work-stealing thread pool.
+ *
+ * Every worker owns a task deque, it pops from the back of its own deque and
+ * steals from the front of the others when it runs dry. Tasks can also be
+ * submitted with a deadline, the SchedulerTimer moves them onto a worker deque
+ * once the deadline passes. The pool is shared between every Scheduler in the
+ * process, so a listen server and a client don't each bring their own set of
+ * threads.
+ */
+class SchedulerPool {
+ public:
+  typedef std::function<void()> Task;
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::mutex mutex;  // guards worker sleep
+  std::condition_variable wake;
+  std::atomic<size_t> queued;
+  std::atomic<size_t> nextWorker;
+  std::atomic<bool> running;
+
+  void workerMain(size_t id);
+  bool popTask(size_t id, Task& task);
+  void push(size_t id, Task task);
+
+ public:
+  SchedulerPool(size_t numWorkers);
+  ~SchedulerPool();
+
+  /**
+   * @brief The process wide pool, sized by the sched_threads CVar.
+   */
+  static SchedulerPool* singleton();
+
+  /**
+   * @brief Queues a task to run as soon as a worker is free.
+   *
+   * If called from a worker thread the task goes onto that worker's own deque.
+   */
+  void submit(Task task);
+  /**
+   * @brief Queues a task to run once when has passed.
+   *
+   * @return SchedulerTimer::TimerId The timer holding the task until then.
+   */
+  SchedulerTimer::TimerId submitAt(TimePoint when, Task task);
+
+  size_t getWorkerCount() { return workers.size(); }
+
+  /**
+   * @brief Returns the index of the calling worker, or -1 if the calling thread
+   * does not belong to this pool.
+   */
+  int getWorkerId();
+};
+
+struct TaskGroupState;
+
+/**
+ * @brief Fork/join group of tasks on the SchedulerPool.
+ *
+ * Tasks are spawned into the group and wait() blocks until every one of them
+ * has finished. The waiting thread runs the group's own tasks in the meantime,
+ * so it is safe to wait from inside a pooled job.
+ */
+class TaskGroup {
+  SchedulerPool* pool;
+  std::shared_ptr<TaskGroupState> state;
+
+ public:
+  TaskGroup(SchedulerPool* pool = SchedulerPool::singleton());
+  ~TaskGroup();
+
+  void spawn(std::function<void()> task);
+  /**
+   * @brief Waits for every spawned task, rethrowing the first exception one of
+   * them threw.
+   */
+  void wait();
+};
+
+/**
+ * @brief A set of tasks with dependencies between them.
+ *
+ * The graph is kept between runs, so it can be built once and run every tick.
+ * Tasks without dependencies start straight away, the others start once
+ * everything that precedes them has finished.
+ */
+class TaskGraph {
+ public:
+  struct Node {
+    std::function<void()> task;
+    std::vector<Node*> successors;
+    size_t dependencies;
+    std::atomic<size_t> remaining;
+  };
+
+ private:
+  std::vector<std::unique_ptr<Node>> nodes;
+  std::mutex mutex;
+
+  void runNode(Node* node, TaskGroup& group);
+
+ public:
+  Node* add(std::function<void()> task);
+  /**
+   * @brief Makes after wait for before to finish.
+   */
+  void precede(Node* before, Node* after);
+  void remove(Node* node);
+
+  bool empty();
+
+  /**
+   * @brief Runs the whole graph on the SchedulerPool and blocks until it is
+   * done.
+   */
+  void run();
+};
+
 class SchedulerJob {
+  friend class Scheduler;
+
   enum State { Running, StopPlease, Stopped };
 
   std::atomic<State> state;
   std::thread thread;
   JobStatistics stats;
-  std::timed_mutex killMutex;
+
+  // wait/wake state, guarded by waitMutex
+  std::mutex waitMutex;
+  std::condition_variable wake;
+  std::condition_variable stopped;
+  bool woken;
+  bool started;
+  bool finished;
 
   bool stopOnCancel;
 
+  SchedulerPool* pool;
+  SchedulerTimer::TimerId pendingTimer;
+  bool pooledStarted;
+  std::chrono::steady_clock::time_point lastStart;
+  std::chrono::steady_clock::time_point deadline;
+
+  void beginTask();
+  bool stepTask();
+  void endTask();
+  void finishTask();
+
+  std::chrono::steady_clock::time_point nextDeadline(
+      std::chrono::steady_clock::time_point now);
+  bool waitUntil(std::chrono::steady_clock::time_point when);
+
+  static void pooledTask(SchedulerJob* job);
+  void startPooled(SchedulerPool* pool);
+
  public:
   SchedulerJob(const char* name, bool stopOnCancel = true);
   virtual ~SchedulerJob();
@@ -73,6 +367,24 @@ class SchedulerJob {
     Cancel,
   };
 
+  /**
+   * @brief What to do when a frame runs past the deadline of the next one.
+   *
+   */
+  enum OverrunPolicy {
+    /**
+     * @brief Drop the missed frames and stay on the original frame grid.
+     *
+     */
+    Skip,
+    /**
+     * @brief Run the missed frames back to back until the job has caught up,
+     * up to SCHEDULER_MAX_CATCHUP frames behind.
+     *
+     */
+    CatchUp,
+  };
+
   /**
    * @brief The frame rate of a job.
    *
@@ -80,6 +392,7 @@ class SchedulerJob {
    * will sleep to account for unused time
    */
   virtual double getFrameRate() { return 1.0 / 60.0; };
+  virtual OverrunPolicy getOverrunPolicy() { return Skip; }
   /**
    * @brief An individual step frame of a job.
    *
@@ -90,6 +403,21 @@ class SchedulerJob {
   virtual void startup() {};
   virtual void shutdown() {};
 
+  /**
+   * @brief Whether the job must always step on the same OS thread.
+   *
+   * Jobs owning thread bound state (like the GL context of the RenderJob)
+   * should return true, the Scheduler will then give them a dedicated thread
+   * even when it is running jobs on the SchedulerPool.
+   */
+  virtual bool isThreadAffine() { return false; }
+
+  /**
+   * @brief Returns true if the job is stepped by the SchedulerPool instead of
+   * its own thread.
+   */
+  bool isPooled() { return pool != NULL; }
+
   /**
    * @brief Called when your Job throws an exception, and you don't handle it.
    *
@@ -107,8 +435,8 @@ class SchedulerJob {
   /**
    * @brief Blocks and waits until a job is stopped.
    *
-   * This will lock the killMutex, causing sleep to terminate the job if it
-   * steps.
+   * Jobs created with stopOnCancel are woken from their sleep straight away,
+   * others stop once their step returns Cancel.
    */
   void stopBlocking();
 
@@ -141,11 +469,39 @@ class Scheduler {
   size_t getId() { return id; }
 
   void imguiDebug();
+  /**
+   * @brief Logs the actual period of every job against getFrameRate().
+   *
+   */
+  void logPacingReport();
+  /**
+   * @brief Logs the step time percentiles and overrun count of every job.
+   *
+   */
+  void logLatencyReport();
 
   void waitToWrapUp();
 
+  /**
+   * @brief Starts every job added to the scheduler.
+   *
+   * If sched_pool is set, jobs that are not thread affine become periodic tasks
+   * on the SchedulerPool instead of each getting their own thread.
+   */
   void startAllJobs();
 
   SchedulerJob* getJob(std::string name);
+
+  /**
+   * @brief Calls func over [begin, end) split into chunks of at least grain,
+   * spread over the SchedulerPool. Blocks until every chunk is done.
+   *
+   * @param func Called with the begin and end of each chunk.
+   * @param grain The smallest chunk worth handing to another thread. 0 picks
+   * one chunk per worker.
+   */
+  static void parallelFor(size_t begin, size_t end,
+                          std::function<void(size_t, size_t)> func,
+                          size_t grain = 0);
 };
 };  // namespace rdm
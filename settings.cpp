@@ -34,30 +34,60 @@ CVar::CVar(const char* name, const char* defaultVar, unsigned long flags) {
   this->flags = flags;
   dirty = true;
   value = defaultVar;
+  vecSequence = 0;
+  parse();
   Settings::singleton()->addCvar(name, this);
 }
 
+void CVar::parse() {
+  // the getters used to throw on a malformed value, now it reads as 0
+  try {
+    intValue.store(std::stoi(value), std::memory_order_relaxed);
+  } catch (std::exception& e) {
+    intValue.store(0, std::memory_order_relaxed);
+  }
+  try {
+    floatValue.store(std::stof(value), std::memory_order_relaxed);
+  } catch (std::exception& e) {
+    floatValue.store(0.f, std::memory_order_relaxed);
+  }
+  boolValue.store(value.c_str()[0] != '0', std::memory_order_relaxed);
+
+  glm::vec4 v = glm::vec4(0.f);
+  try {
+    v = Math::stringToVec4(value);
+  } catch (std::exception& e) {
+  }
+  vecSequence.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (int i = 0; i < 4; i++)
+    vecValue[i].store(v[i], std::memory_order_relaxed);
+  vecSequence.fetch_add(1, std::memory_order_release);
+}
+
+std::string CVar::getValue() {
+  std::scoped_lock l(valueMutex);
+  return value;
+}
+
 void CVar::setValue(std::string s) {
-  if (s != this->value) {
+  {
+    std::scoped_lock l(valueMutex);
+    if (s == this->value) return;
     this->value = s;
-    if (flags & CVARF_NOTIFY) Settings::singleton()->cvarChanging.fire(name);
-    changing.fire();
+    parse();
   }
+  if (flags & CVARF_NOTIFY) Settings::singleton()->cvarChanging.fire(name);
+  changing.fire();
 }
 
-int CVar::getInt() { return std::stoi(value); }
-
 void CVar::setInt(int i) { setValue(std::to_string(i)); }
 
-float CVar::getFloat() { return std::stof(value); }
-
 void CVar::setFloat(float f) { setValue(std::to_string(f)); }
 
 // taken from
 // https://github.com/floralrainfall/matrix/blob/trunk/matrix/src/mcvar.cpp
 
-bool CVar::getBool() { return value[0] != '0'; }
-
 void CVar::setBool(bool b) { setValue(b ? "1" : "0"); }
 
 glm::vec2 CVar::getVec2() {
@@ -76,7 +106,18 @@ void CVar::setVec3(glm::vec3 v) {
   setValue(std::format("{} {} {}", v.x, v.y, v.z));
 }
 
-glm::vec4 CVar::getVec4(int ms) { return Math::stringToVec4(value); }
+glm::vec4 CVar::getVec4(int ms) {
+  glm::vec4 v;
+  unsigned int sequence;
+  do {
+    sequence = vecSequence.load(std::memory_order_acquire);
+    for (int i = 0; i < 4; i++)
+      v[i] = vecValue[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((sequence & 1) ||
+           sequence != vecSequence.load(std::memory_order_relaxed));
+  return v;
+}
 
 void CVar::setVec4(glm::vec4 v) {
   setValue(std::format("{} {} {} {}", v.x, v.y, v.z, v.w));
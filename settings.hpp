@@ -1,6 +1,8 @@
 #pragma once
+#include <atomic>
 #include <glm/glm.hpp>
 #include <map>
+#include <mutex>
 #include <string>
 #include <variant>
 
@@ -19,28 +21,45 @@ typedef std::variant<std::string, int, float> Setting;
  */
 #define CVARF_GLOBAL (1 << 3)
 
+/**
+ * @brief A console variable.
+ *
+ * The value is kept as a string, but is parsed into every typed form whenever
+ * it is set, so the typed getters are lock-free and cheap enough to call every
+ * frame from any thread.
+ */
 class CVar {
   friend class Settings;
 
   std::string name;
-  std::string value;
+  std::mutex valueMutex;
+  std::string value;  // guarded by valueMutex
   unsigned long flags;
   bool dirty;
 
+  std::atomic<int> intValue;
+  std::atomic<float> floatValue;
+  std::atomic<bool> boolValue;
+  // vecValue is written under a sequence lock, odd while it is being written
+  std::atomic<unsigned int> vecSequence;
+  std::atomic<float> vecValue[4];
+
+  void parse();  // call with valueMutex locked
+
  public:
   CVar(const char* name, const char* defaultVar, unsigned long flags = 0);
   std::string getName() { return name; }
-  std::string getValue() { return value; }
+  std::string getValue();
   void setValue(std::string s);
 
   unsigned long getFlags() { return flags; }
 
   Signal<> changing;
 
-  int getInt();
+  int getInt() { return intValue.load(std::memory_order_relaxed); }
   void setInt(int i);
 
-  float getFloat();
+  float getFloat() { return floatValue.load(std::memory_order_relaxed); }
   void setFloat(float f);
 
   glm::vec2 getVec2();
@@ -52,7 +71,7 @@ class CVar {
   glm::vec4 getVec4(int ms = 4);
   void setVec4(glm::vec4 v);
 
-  bool getBool();
+  bool getBool() { return boolValue.load(std::memory_order_relaxed); }
   void setBool(bool b);
 };
 
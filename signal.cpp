@@ -1,6 +1,80 @@
 #include "signal.hpp"
 
+#include <chrono>
+#include <map>
+
+#include "console.hpp"
+
 namespace rdm {
-static ClosureId lastClosureId = 0;
+static std::atomic<ClosureId> lastClosureId = 0;
 ClosureId __newClosureId() { return lastClosureId++; }
+
+thread_local __SignalFrame* __signalFrames = NULL;
+
+namespace {
+// the previous Signal dispatch (locked, map of listeners copied on every call)
+// kept around so bench_signal has something to compare against
+template <typename... Args>
+class LockedSignal {
+  std::mutex m;
+  std::map<ClosureId, std::function<void(Args...)>> listeners;
+
+ public:
+  void fire(Args... a) {
+    std::scoped_lock l(m);
+    for (auto listener : listeners) listener.second(a...);
+  }
+
+  ClosureId listen(std::function<void(Args...)> a) {
+    std::scoped_lock l(m);
+    ClosureId id = __newClosureId();
+    listeners[id] = a;
+    return id;
+  }
+};
+
+// std::function only stores small captures inline, so the old dispatch
+// allocated on every call for listeners capturing more than a pointer or two
+template <typename T>
+double benchmarkFire(int listenerCount, int fires, bool largeCapture) {
+  T signal;
+  volatile float sum = 0.f;
+  for (int i = 0; i < listenerCount; i++) {
+    if (largeCapture)
+      signal.listen([&sum, i, fires, listenerCount](float dt) {
+        sum = sum + dt * (i + fires + listenerCount);
+      });
+    else
+      signal.listen([&sum](float dt) { sum = sum + dt; });
+  }
+
+  std::chrono::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < fires; i++) signal.fire(1.f / 60.f);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+}  // namespace
+
+static ConsoleCommand bench_signal(
+    "bench_signal", "bench_signal [listeners] [fires]",
+    "compares Signal::fire against the old locked signal dispatch",
+    [](Game* game, ConsoleArgReader r) {
+      int listenerCount = std::atoi(r.next().c_str());
+      int fires = std::atoi(r.next().c_str());
+      if (listenerCount <= 0) listenerCount = 32;
+      if (fires <= 0) fires = 100000;
+
+      Log::printf(LOG_INFO, "%i listeners, %i fires", listenerCount, fires);
+      for (bool largeCapture : {false, true}) {
+        double locked = benchmarkFire<LockedSignal<float>>(listenerCount, fires,
+                                                           largeCapture);
+        double snapshot =
+            benchmarkFire<Signal<float>>(listenerCount, fires, largeCapture);
+        Log::printf(LOG_INFO,
+                    "%s capture: locked %0.1fns, snapshot %0.1fns per fire",
+                    largeCapture ? "Large" : "Small", locked / fires * 1e9,
+                    snapshot / fires * 1e9);
+      }
+    });
 }  // namespace rdm
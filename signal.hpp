@@ -1,10 +1,13 @@
 #pragma once
 #include <cxxabi.h>
 
+#include <atomic>
 #include <functional>
-#include <map>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include "logging.hpp"
 
@@ -17,64 +20,146 @@ typedef size_t ClosureId;
 
 ClosureId __newClosureId();
 
+// the fires in progress on this thread, innermost first, so removeListener
+// knows which calls it would otherwise wait on forever
+struct __SignalFrame {
+  const void* listener;
+  __SignalFrame* next;
+};
+extern thread_local __SignalFrame* __signalFrames;
+
 /**
  * @brief Signals. These are able to be fired, and will execute signal handlers
  * on the firing thread. These are not related to POSIX signals.
  *
+ * Listeners are kept in a flat array that is replaced as a whole whenever a
+ * listener is added or removed, so fire() walks an immutable snapshot without
+ * locking or allocating. Old snapshots are freed once no fire() is using
+ * them.
+ *
  * @tparam Args The arguments of the signals. These will be required on
  * Signal::fire and can be retrieved on Signal::listen
  */
 template <typename... Args>
 class Signal {
-  std::mutex m;
-
  public:
   typedef std::function<void(Args...)> Function;
 
+ private:
+  struct Listener {
+    ClosureId id;
+    Function function;
+    std::atomic<bool> removed;
+    std::atomic<int> calling;
+  };
+
+  struct Snapshot {
+    std::vector<Listener*> listeners;
+  };
+
+  std::mutex m;  // guards writers, fire() never takes it without closures
+  std::atomic<Snapshot*> snapshot;
+  std::atomic<int> firing;
+  std::vector<std::unique_ptr<Snapshot>> retiredSnapshots;
+  std::vector<std::unique_ptr<Listener>> retiredListeners;
+
+  std::atomic<bool> hasClosures;
+  std::vector<Function> pendingClosures;
+
+  // call with m locked
+  void publish(Snapshot* next) {
+    Snapshot* old = snapshot.exchange(next);
+    if (old) retiredSnapshots.push_back(std::unique_ptr<Snapshot>(old));
+    // a fire() that started before the exchange is counted in firing, one that
+    // starts after it can only see the new snapshot
+    if (firing == 0) {
+      retiredSnapshots.clear();
+      retiredListeners.clear();
+    }
+  }
+
+  void callListener(Listener* listener, __SignalFrame& frame, Args&... a) {
+    listener->calling++;
+    if (listener->removed) {
+      listener->calling--;
+      return;
+    }
+    frame.listener = listener;
+    try {
+      listener->function(a...);
+    } catch (std::exception& e) {
+      int status;
+      Log::printf(LOG_ERROR, "Error calling listener %i for signal %s, '%s'",
+                  listener->id,
+                  abi::__cxa_demangle(typeid(this).name(), 0, 0, &status),
+                  e.what());
+    }
+    frame.listener = NULL;
+    listener->calling--;
+  }
+
+  void runClosures(Args&... a) {
+    std::vector<Function> closures;
+    {
+      std::scoped_lock l(m);
+      closures.swap(pendingClosures);
+      hasClosures = false;
+    }
+    for (auto& closure : closures) {
+      try {
+        closure(a...);
+      } catch (std::exception& e) {
+        int status;
+        Log::printf(LOG_ERROR, "Error calling closure for signal %s, '%s'",
+                    abi::__cxa_demangle(typeid(this).name(), 0, 0, &status),
+                    e.what());
+      }
+    }
+  }
+
+ public:
+  Signal() : snapshot(new Snapshot()), firing(0), hasClosures(false) {}
+  ~Signal() {
+    Snapshot* current = snapshot.load();
+    for (Listener* listener : current->listeners) delete listener;
+    delete current;
+  }
+
+  Signal(const Signal&) = delete;
+  Signal& operator=(const Signal&) = delete;
+
   /**
    * @brief Fires the signal.
    *
    * Will execute listeners on the firing thread, so don't rely on the fact that
-   * you may add listeners from different threads.
+   * you may add listeners from different threads. Listeners may add or remove
+   * listeners (including themselves) while being fired; listeners added during
+   * a fire are called from the next one.
    *
    * @param a The arguments to pass to signal listeners.
    */
   void fire(Args... a) {
-    std::scoped_lock l(m);
 #ifndef DISABLE_EASY_PROFILER
     EASY_FUNCTION();
 #endif
-    if (pendingClosures.size() != 0) {
+    if (hasClosures) {
 #ifndef DISABLE_EASY_PROFILER
       EASY_BLOCK("Closures");
 #endif
-      for (auto closure : pendingClosures) {
-        try {
-          closure(a...);
-        } catch (std::exception& e) {
-          int status;
-          Log::printf(LOG_ERROR, "Error calling closure for signal %s, '%s'",
-                      abi::__cxa_demangle(typeid(this).name(), 0, 0, &status),
-                      e.what());
-        }
-      }
-      pendingClosures.clear();
+      runClosures(a...);
     }
 
 #ifndef DISABLE_EASY_PROFILER
     EASY_BLOCK("Listeners");
 #endif
-    for (auto listener : listeners) {
-      try {
-        listener.second(a...);
-      } catch (std::exception& e) {
-        int status;
-        Log::printf(LOG_ERROR, "Error calling listener %i for signal %s, '%s'",
-                    listener.first,
-                    abi::__cxa_demangle(typeid(this).name(), 0, 0, &status),
-                    e.what());
-      }
-    }
+    firing++;
+    __SignalFrame frame = {NULL, __signalFrames};
+    __signalFrames = &frame;
+    Snapshot* current = snapshot.load();
+    for (Listener* listener : current->listeners)
+      callListener(listener, frame, a...);
+    __signalFrames = frame.next;
+    firing--;
   };
 
   /**
@@ -87,32 +172,69 @@ class Signal {
    */
   ClosureId listen(Function a) {
     std::scoped_lock l(m);
-    ClosureId id = __newClosureId();
-    listeners[id] = a;
-    return id;
+    Listener* listener = new Listener();
+    listener->id = __newClosureId();
+    listener->function = a;
+    listener->removed = false;
+    listener->calling = 0;
+
+    Snapshot* next = new Snapshot(*snapshot.load());
+    next->listeners.push_back(listener);
+    publish(next);
+    return listener->id;
   }
 
   void addClosure(Function a) {
     std::scoped_lock l(m);
     pendingClosures.push_back(a);
+    hasClosures = true;
   }
 
+  /**
+   * @brief Removes a listener.
+   *
+   * Once this returns the listener is not running on any other thread and will
+   * not be called again, so whatever it captured can be destroyed.
+   */
   void removeListener(ClosureId id) {
+    Listener* listener = NULL;
+    {
+      std::scoped_lock l(m);
+      Snapshot* next = new Snapshot(*snapshot.load());
+      for (auto it = next->listeners.begin(); it != next->listeners.end();
+           it++) {
+        if ((*it)->id == id) {
+          listener = *it;
+          next->listeners.erase(it);
+          break;
+        }
+      }
+      if (!listener) {
+        delete next;
+        throw std::runtime_error("Removing invalid closure id");
+      }
+      listener->removed = true;
+      publish(next);
+    }
+
+    // wait out calls on other threads, but not the ones this thread is inside
+    // of (a listener removing itself)
+    int own = 0;
+    for (__SignalFrame* frame = __signalFrames; frame; frame = frame->next)
+      if (frame->listener == listener) own++;
+    while (listener->calling > own) std::this_thread::yield();
+
+    // fires still walking an older snapshot may look at it until they finish
     std::scoped_lock l(m);
-    auto it = listeners.find(id);
-    if (it != listeners.end())
-      listeners.erase(it);
-    else
-      throw std::runtime_error("Removing invalid closure id");
+    retiredListeners.push_back(std::unique_ptr<Listener>(listener));
+    if (firing == 0) retiredListeners.clear();
   }
 
   size_t size() {
-    std::scoped_lock l(m);
-    return listeners.size();
+    firing++;
+    size_t size = snapshot.load()->listeners.size();
+    firing--;
+    return size;
   }
-
- private:
-  std::map<ClosureId, Function> listeners;
-  std::vector<Function> pendingClosures;
 };
 }  // namespace rdm
@@ -0,0 +1,437 @@
+#include <enet/enet.h>
+#include <math.h>
+#include <string.h>
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <deque>
+#include <format>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "logging.hpp"
+#include "network/bitstream.hpp"
+#include "network/compress.hpp"
+#include "network/network.hpp"
+#include "putil/fpscontroller.hpp"
+
+#ifndef DISABLE_OBZ
+#define RDM_COMPILE
+#include "obz.hpp"
+#endif
+
+// simulated players for capacity planning: each one does the real handshake
+// and then sends WPlayer input the way a client would, but has no world,
+// entities, gfx or sound, so hundreds fit in one process
+
+// commands resent in every packet, as FpsController::writeInputs does
+#define LOADGEN_INPUT_REDUNDANCY 8
+#define LOADGEN_MAX_CLIENTS 4096
+
+using namespace rdm;
+using namespace rdm::network;
+typedef NetworkManager::PacketId PacketId;
+
+struct SimulatedClient {
+  enum State {
+    Connecting,
+    Authenticating,
+    Playing,
+    Disconnected,
+  };
+
+  ENetPeer* peer = NULL;
+  State state = Connecting;
+  int index = 0;
+  int peerId = -1;
+  int playerEntity = -1;  // EntityId once the NewPeerPacket for us arrives
+  std::mt19937 random;
+
+  // scripted input
+  std::deque<putil::FpsController::InputCommand> inputs;
+  uint32_t nextSequence = 1;
+  glm::vec2 move = glm::vec2(0.f);
+  float yaw = 0.f;
+  float turnTimer = 0.f;
+  float fireTimer = 0.f;
+  bool firing = false;
+
+  // the server's clock as of the last snapshot
+  uint32_t newestSnapshot = 0;
+  uint32_t ackedSnapshot = 0;
+  float serverTime = 0.f;
+  std::chrono::steady_clock::time_point serverTimeStamp;
+
+  // since the stage started
+  size_t bytesIn = 0;
+  size_t bytesOut = 0;
+  size_t snapshots = 0;
+};
+
+class LoadGenerator {
+  ENetHost* host;
+  ENetAddress address;
+  std::vector<std::unique_ptr<SimulatedClient>> clients;
+  std::string password;
+  std::string rconPassword;
+  bool compress;
+  int seed;
+  std::vector<unsigned char> scratch;
+
+  static float randomRange(SimulatedClient& client, float min, float max) {
+    return std::uniform_real_distribution<float>(min, max)(client.random);
+  }
+
+  void send(SimulatedClient& client, int channel, BitStream& stream,
+            int flags) {
+    ENetPacket* packet = stream.releasePacket(flags);
+    client.bytesOut += packet->dataLength;
+    enet_peer_send(client.peer, channel, packet);
+  }
+
+  // the packet as NetworkManager::decompressPacket would leave it
+  BitStream readPacket(ENetPacket* packet) {
+    uint32_t id;
+    if (packet->dataLength < sizeof(PacketId))
+      throw std::runtime_error("Packet too short");
+    memcpy(&id, packet->data, sizeof(PacketId));
+    if (!(id & NETWORK_PACKET_COMPRESSED))
+      return BitStream(packet->data, packet->dataLength);
+
+    size_t header = sizeof(PacketId) + 5;
+    if (packet->dataLength < header)
+      throw std::runtime_error("Compressed packet too short");
+    uint32_t rawSize;
+    memcpy(&rawSize, packet->data + sizeof(PacketId) + 1, sizeof(rawSize));
+    if (rawSize > NETWORK_DECOMPRESS_MAX_SIZE)
+      throw std::runtime_error("Compressed packet too large");
+    id &= ~NETWORK_PACKET_COMPRESSED;
+    scratch.resize(sizeof(PacketId));
+    memcpy(scratch.data(), &id, sizeof(PacketId));
+    decompressPacketData((PacketCodec)packet->data[sizeof(PacketId)],
+                         packet->data + header, packet->dataLength - header,
+                         rawSize, scratch);
+    return BitStream(scratch.data(), scratch.size());
+  }
+
+  void receive(SimulatedClient& client, ENetPacket* packet) {
+    client.bytesIn += packet->dataLength;
+    BitStream stream = readPacket(packet);
+    switch (stream.read<PacketId>()) {
+      case NetworkManager::WelcomePacket: {
+        client.peerId = stream.read<int>();
+        stream.read<size_t>();
+        client.serverTime = stream.read<float>();
+        client.serverTimeStamp = std::chrono::steady_clock::now();
+        int types = stream.readVarInt();
+        for (int i = 0; i < types; i++) stream.readString();
+        PacketCodec codecs[NETWORK_STREAM_MAX];
+        for (int i = 0; i < NETWORK_STREAM_MAX; i++) {
+          codecs[i] = stream.read<PacketCodec>();
+          if (codecs[i] >= CodecMax || !compress) codecs[i] = CodecNone;
+        }
+#ifndef DISABLE_OBZ
+        obz::ObzCrypt::singleton()->readCryptPacket(stream, false);
+#endif
+
+        BitStream authenticate;
+        authenticate.write<PacketId>(NetworkManager::AuthenticatePacket);
+        authenticate.writeString(std::format("Loadgen{}", client.index));
+        authenticate.writeString(password);
+        authenticate.writeString("");
+        for (int i = 0; i < NETWORK_STREAM_MAX; i++)
+          authenticate.write<PacketCodec>(codecs[i]);
+#ifndef DISABLE_OBZ
+        obz::ObzCrypt::singleton()->writeCryptPacket(authenticate, false);
+#endif
+        send(client, NETWORK_STREAM_META, authenticate,
+             ENET_PACKET_FLAG_RELIABLE);
+        client.state = SimulatedClient::Authenticating;
+      } break;
+      case NetworkManager::NewPeerPacket: {
+        int peerId = stream.read<int>();
+        EntityId entity = stream.read<EntityId>();
+        if (peerId == client.peerId) {
+          client.playerEntity = entity;
+          client.state = SimulatedClient::Playing;
+        }
+      } break;
+      case NetworkManager::DeltaSnapshotPacket: {
+        uint32_t sequence = stream.read<uint32_t>();
+        stream.read<uint32_t>();
+        float time = stream.read<float>();
+        client.snapshots++;
+        if (sequence > client.newestSnapshot) {
+          client.newestSnapshot = sequence;
+          client.serverTime = time;
+          client.serverTimeStamp = std::chrono::steady_clock::now();
+        }
+      } break;
+      case NetworkManager::DisconnectPacket:
+        Log::printf(LOG_WARN, "Loadgen%i disconnected by server (%s)",
+                    client.index, stream.readString().c_str());
+        client.state = SimulatedClient::Disconnected;
+        break;
+      default:
+        break;
+    }
+  }
+
+  void script(SimulatedClient& client, float dt) {
+    client.turnTimer -= dt;
+    if (client.turnTimer <= 0.f) {
+      client.move = glm::vec2(std::round(randomRange(client, -1.f, 1.f)),
+                              std::round(randomRange(client, -1.f, 1.f)));
+      client.yaw += randomRange(client, -M_PI_2, M_PI_2);
+      client.turnTimer = randomRange(client, 1.f, 3.f);
+    }
+    client.yaw += randomRange(client, -0.02f, 0.02f);
+
+    client.fireTimer -= dt;
+    if (client.fireTimer <= 0.f) {
+      client.firing = !client.firing;
+      client.fireTimer = client.firing ? randomRange(client, 0.2f, 0.6f)
+                                       : randomRange(client, 1.f, 4.f);
+    }
+
+    putil::FpsController::InputCommand command;
+    command.sequence = client.nextSequence++;
+    command.move = client.move;
+    command.jump = randomRange(client, 0.f, 1.f) < 0.01f;
+    command.cameraYaw = client.yaw;
+    command.cameraPitch = 0.f;
+    client.inputs.push_back(command);
+    while (client.inputs.size() > LOADGEN_INPUT_REDUNDANCY)
+      client.inputs.pop_front();
+  }
+
+  // what WPlayer::serializeUnreliable sends in the ToServerLocal context
+  void sendInput(SimulatedClient& client) {
+    BitStream stream;
+    stream.write<PacketId>(NetworkManager::DeltaIdPacket);
+    stream.write<int>(1);
+    stream.write<EntityId>(client.playerEntity);
+    stream.writeVarInt(client.inputs.size());
+    stream.write<uint32_t>(client.inputs.front().sequence);
+    for (auto& command : client.inputs)
+      putil::FpsController::writeInputCommand(stream, command);
+    stream.writeBool(client.firing);
+    stream.writeBool(false);
+    if (client.firing) {
+      float elapsed = std::chrono::duration<float>(
+                          std::chrono::steady_clock::now() -
+                          client.serverTimeStamp)
+                          .count();
+      // a client draws others cl_interpdelay behind
+      stream.write<float>(client.serverTime + elapsed - 0.1f);
+    }
+    send(client, 0, stream, 0);
+
+    if (client.newestSnapshot != client.ackedSnapshot) {
+      BitStream ack;
+      ack.write<PacketId>(NetworkManager::SnapshotAckPacket);
+      ack.write<uint32_t>(client.newestSnapshot);
+      send(client, NETWORK_STREAM_ENTITY, ack, 0);
+      client.ackedSnapshot = client.newestSnapshot;
+    }
+  }
+
+  void service() {
+    ENetEvent event;
+    while (enet_host_service(host, &event, 0) > 0) {
+      SimulatedClient* client = (SimulatedClient*)event.peer->data;
+      switch (event.type) {
+        case ENET_EVENT_TYPE_RECEIVE:
+          try {
+            if (client) receive(*client, event.packet);
+          } catch (std::exception& e) {
+            Log::printf(LOG_ERROR, "Loadgen%i: %s", client->index, e.what());
+          }
+          enet_packet_destroy(event.packet);
+          break;
+        case ENET_EVENT_TYPE_DISCONNECT:
+          if (client) client->state = SimulatedClient::Disconnected;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  void report(float duration) {
+    int playing = 0;
+    size_t bytesIn = 0, bytesOut = 0, snapshots = 0;
+    double roundTripTime = 0.0, packetLoss = 0.0;
+    for (auto& client : clients) {
+      if (client->state != SimulatedClient::Playing) continue;
+      playing++;
+      bytesIn += client->bytesIn;
+      bytesOut += client->bytesOut;
+      snapshots += client->snapshots;
+      roundTripTime += client->peer->roundTripTime;
+      packetLoss += (double)client->peer->packetLoss /
+                    ENET_PEER_PACKET_LOSS_SCALE;
+      client->bytesIn = 0;
+      client->bytesOut = 0;
+      client->snapshots = 0;
+    }
+    if (!playing) {
+      Log::printf(LOG_WARN, "%zu clients, none playing", clients.size());
+      return;
+    }
+    Log::printf(LOG_INFO,
+                "%i/%zu playing: %0.2f KiB/s in, %0.2f KiB/s out per peer, "
+                "%0.1f snapshots/s, rtt %0.1fms, loss %0.2f%%",
+                playing, clients.size(),
+                bytesIn / 1024.0 / duration / playing,
+                bytesOut / 1024.0 / duration / playing,
+                snapshots / duration / playing, roundTripTime / playing,
+                packetLoss * 100.0 / playing);
+
+    if (rconPassword.size()) {
+      // the server logs its job step times
+      for (auto& client : clients) {
+        if (client->state != SimulatedClient::Playing) continue;
+        BitStream rcon;
+        rcon.write<PacketId>(NetworkManager::RconPacket);
+        rcon.writeString(rconPassword);
+        rcon.writeString("sched_latency");
+        send(*client, 0, rcon, ENET_PACKET_FLAG_RELIABLE);
+        break;
+      }
+    }
+  }
+
+ public:
+  LoadGenerator(std::string hostname, int port, std::string password,
+                std::string rconPassword, bool compress, int seed)
+      : password(password),
+        rconPassword(rconPassword),
+        compress(compress),
+        seed(seed) {
+    enet_address_set_host(&address, hostname.c_str());
+    address.port = port;
+    host = enet_host_create(NULL, LOADGEN_MAX_CLIENTS, NETWORK_STREAM_MAX, 0,
+                            0);
+    if (!host) throw std::runtime_error("enet_host_create returned NULL");
+  }
+
+  ~LoadGenerator() {
+    for (auto& client : clients)
+      if (client->state != SimulatedClient::Disconnected)
+        enet_peer_disconnect_now(client->peer, NETWORK_DISCONNECT_USER);
+    enet_host_flush(host);
+    enet_host_destroy(host);
+  }
+
+  void addClient() {
+    auto client = std::make_unique<SimulatedClient>();
+    client->index = clients.size();
+    client->random.seed(seed + client->index);
+    client->peer = enet_host_connect(host, &address, 2, 0);
+    if (!client->peer) throw std::runtime_error("enet_host_connect failed");
+    client->peer->data = client.get();
+    clients.push_back(std::move(client));
+  }
+
+  /**
+   * @brief Adds step clients every interval seconds until there are max,
+   * reporting each stage.
+   */
+  void run(int max, int step, float interval) {
+    const float dt = PHYSICS_FRAMERATE;
+    auto next = std::chrono::steady_clock::now();
+    while (clients.size() < (size_t)max) {
+      for (int i = 0; i < step && clients.size() < (size_t)max; i++)
+        addClient();
+      Log::printf(LOG_INFO, "Stage of %zu clients", clients.size());
+
+      auto stageStart = std::chrono::steady_clock::now();
+      auto stageEnd = stageStart + std::chrono::duration_cast<
+                                       std::chrono::steady_clock::duration>(
+                                       std::chrono::duration<float>(interval));
+      bool reset = false;
+      while (std::chrono::steady_clock::now() < stageEnd) {
+        service();
+        for (auto& client : clients) {
+          if (client->state != SimulatedClient::Playing) continue;
+          script(*client, dt);
+          sendInput(*client);
+        }
+        enet_host_flush(host);
+
+        // the first half of each stage lets the new clients join
+        if (!reset &&
+            std::chrono::steady_clock::now() - stageStart >
+                std::chrono::duration<float>(interval / 2.f)) {
+          for (auto& client : clients) {
+            client->bytesIn = 0;
+            client->bytesOut = 0;
+            client->snapshots = 0;
+          }
+          reset = true;
+        }
+
+        next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(dt));
+        std::this_thread::sleep_until(next);
+      }
+      report(interval / 2.f);
+    }
+  }
+};
+
+int main(int argc, char** argv) {
+  namespace po = boost::program_options;
+  po::options_description desc("Allowed options");
+  desc.add_options()("help,h", "produce help message")(
+      "address,a", po::value<std::string>()->default_value("127.0.0.1"),
+      "server to connect to")(
+      "port,p", po::value<int>()->default_value(7938), "server port")(
+      "clients,n", po::value<int>()->default_value(32),
+      "simulated clients to end with")(
+      "step,s", po::value<int>()->default_value(8),
+      "clients added each stage")(
+      "interval,i", po::value<float>()->default_value(10.f),
+      "seconds each stage lasts, stats are taken over the second half")(
+      "password", po::value<std::string>()->default_value("RDMRDMRDM"),
+      "server password")(
+      "rcon", po::value<std::string>()->default_value(""),
+      "rcon password, runs sched_latency on the server after each stage")(
+      "nocompress", "decline the packet compression the server offers")(
+      "seed", po::value<int>()->default_value(0), "seed of the scripted input");
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return EXIT_FAILURE;
+  }
+
+  int clients = vm["clients"].as<int>();
+  int step = vm["step"].as<int>();
+  if (clients <= 0 || clients > LOADGEN_MAX_CLIENTS || step <= 0) {
+    Log::printf(LOG_FATAL, "Need 1 to %i clients and a step of at least 1",
+                LOADGEN_MAX_CLIENTS);
+    return EXIT_FAILURE;
+  }
+
+  NetworkManager::initialize();
+  try {
+    LoadGenerator generator(
+        vm["address"].as<std::string>(), vm["port"].as<int>(),
+        vm["password"].as<std::string>(), vm["rcon"].as<std::string>(),
+        !vm.count("nocompress"), vm["seed"].as<int>());
+    generator.run(clients, step, vm["interval"].as<float>());
+  } catch (std::exception& e) {
+    Log::printf(LOG_FATAL, "%s", e.what());
+    NetworkManager::deinitialize();
+    return EXIT_FAILURE;
+  }
+  NetworkManager::deinitialize();
+  return EXIT_SUCCESS;
+}
@@ -1,8 +1,17 @@
 #include "map.hpp"
 
 #include <bullet/Bullet3Geometry/b3GeometryUtil.h>
+#include <bullet/LinearMath/btConvexHullComputer.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <climits>
+#include <cstdio>
+#include <filesystem>
+#include <format>
 #include <sstream>
 #include <stdexcept>
 
@@ -16,13 +25,19 @@
 #include "gfx/rendercommand.hpp"
 #include "gfx/renderpass.hpp"
 #include "logging.hpp"
+#include "network/crc_hash.hpp"
 #include "physics.hpp"
+#include "settings.hpp"
 #include "wgame.hpp"
 
 #ifndef DISABLE_EASY_PROFILER
 #include <easy/profiler.h>
 #endif
 
+// "RDHC"
+#define BSP_HULL_CACHE_MAGIC 0x43484452
+#define BSP_HULL_CACHE_VERSION 1
+
 // taken from matrix
 
 namespace ww {
@@ -47,6 +62,8 @@ BSPFile::BSPFile(const char* bsp) {
   // m_physicsWorld = NULL;
   if (od) {
     memcpy(&m_header, od.value().data(), sizeof(BSPHeader));
+    m_contentHash = network::CRC32::hash(od.value().data(), od.value().size());
+    m_contentSize = od.value().size();
 
     // preload all dirent entries
     for (int i = 0; i < __BSP_DIRENT_MAX; i++) {
@@ -466,21 +483,55 @@ void BSPFile::draw() {
   engine->pass(gfx::RenderPass::Transparent).add(transparent);
 }
 
-void BSPFile::removeFromPhysicsWorld(PhysicsWorld* world) {
-  for (btRigidBody* body : m_brushBodies) {
-    delete body->getMotionState();
-    delete body->getCollisionShape();
-    world->getWorld()->removeRigidBody(body);
-    delete body;
+static CVar map_collision("map_collision", "0", CVARF_SAVE);
+static CVar map_hullcache("map_hullcache", "1", CVARF_SAVE);
+
+// followed by a uint32_t vertex count per hull, then three floats per vertex
+struct BSPHullCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t contentHash;
+  uint32_t contentSize;
+  uint32_t hulls;
+  uint32_t vertices;
+} __attribute__((packed));
+
+const char* getCollisionModeName(BSPCollisionMode mode) {
+  switch (mode) {
+    case BSPCollisionBrushes:
+      return "brushes";
+    case BSPCollisionCompound:
+      return "compound";
+    case BSPCollisionMesh:
+      return "mesh";
+    default:
+      return "unknown";
   }
-  m_brushBodies.clear();
 }
 
-void BSPFile::addToPhysicsWorld(PhysicsWorld* world) {
+void BSPCollision::addTo(btDynamicsWorld* world) {
+  for (auto& body : bodies) world->addRigidBody(body.get());
+}
+
+void BSPCollision::removeFrom(btDynamicsWorld* world) {
+  for (auto& body : bodies) world->removeRigidBody(body.get());
+}
+
+void BSPCollision::clear() {
+  bodies.clear();
+  shapes.clear();
+  mesh.reset();
+}
+
+void BSPFile::removeFromPhysicsWorld(PhysicsWorld* world) {
   std::scoped_lock lock(world->mutex);
+  m_collision.removeFrom(world->getWorld());
+  m_collision.clear();
+}
 
-  int rb_added = 0;
-  for (auto brush : m_brushes) {
+void BSPFile::computeBrushHulls(std::vector<std::vector<btVector3>>& hulls) {
+  hulls.clear();
+  for (auto& brush : m_brushes) {
     b3AlignedObjectArray<b3Vector3> planeeqs;
 
     for (auto brushside : brush.brushSides) {
@@ -493,7 +544,6 @@ void BSPFile::addToPhysicsWorld(PhysicsWorld* world) {
 
     b3AlignedObjectArray<b3Vector3> verts;
     b3GeometryUtil::getVerticesFromPlaneEquations(planeeqs, verts);
-    btVector3 etg;
 
     // i dont know why i must do this but i have to
     std::vector<btVector3> intermediate;
@@ -502,20 +552,216 @@ void BSPFile::addToPhysicsWorld(PhysicsWorld* world) {
       intermediate.push_back(btVector3(vert.x, vert.y, vert.z));
     }
 
-    if (intermediate.size() != 0) {
-      btCollisionShape* brushshape = new btConvexHullShape(
-          (btScalar*)intermediate.data(), intermediate.size());
-      btRigidBody* brushbody = new btRigidBody(0.0, NULL, brushshape);
-      brushbody->setUserPointer(this);
-      brushbody->setUserIndex(PHYSICS_INDEX_WORLD);
-      brushshape->setUserPointer(this);
-      brushshape->setUserIndex(PHYSICS_INDEX_WORLD);
-      world->getWorld()->addRigidBody(brushbody);
-      m_brushBodies.push_back(brushbody);
-      rb_added++;
+    if (intermediate.size() != 0) hulls.push_back(std::move(intermediate));
+  }
+}
+
+std::string BSPFile::getHullCachePath() {
+  return std::format("{}hullcache/{:08x}_{}.hulls",
+                     Fun::getLocalDataDirectory(), m_contentHash,
+                     m_contentSize);
+}
+
+bool BSPFile::readHullCache(std::vector<std::vector<btVector3>>& hulls) {
+  std::string path = getHullCachePath();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(BSPHullCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const unsigned char* data = (const unsigned char*)map;
+  BSPHullCacheHeader header;
+  memcpy(&header, data, sizeof(header));
+  bool valid = header.magic == BSP_HULL_CACHE_MAGIC &&
+               header.version == BSP_HULL_CACHE_VERSION &&
+               header.contentHash == m_contentHash &&
+               header.contentSize == m_contentSize &&
+               size == sizeof(header) + header.hulls * sizeof(uint32_t) +
+                           header.vertices * sizeof(float) * 3;
+  if (valid) {
+    const unsigned char* counts = data + sizeof(header);
+    const unsigned char* vertices = counts + header.hulls * sizeof(uint32_t);
+    size_t read = 0;
+    hulls.resize(header.hulls);
+    for (uint32_t i = 0; valid && i < header.hulls; i++) {
+      uint32_t count;
+      memcpy(&count, counts + i * sizeof(uint32_t), sizeof(count));
+      if (read + count > header.vertices) {
+        valid = false;
+        break;
+      }
+      hulls[i].resize(count);
+      for (uint32_t j = 0; j < count; j++, read++) {
+        float v[3];
+        memcpy(v, vertices + read * sizeof(v), sizeof(v));
+        hulls[i][j] = btVector3(v[0], v[1], v[2]);
+      }
+    }
+    if (read != header.vertices) valid = false;
+  }
+  munmap(map, size);
+
+  if (!valid) {
+    hulls.clear();
+    Log::printf(LOG_WARN, "Ignoring stale hull cache %s", path.c_str());
+  }
+  return valid;
+}
+
+void BSPFile::writeHullCache(const std::vector<std::vector<btVector3>>& hulls) {
+  std::string path = getHullCachePath();
+  std::filesystem::create_directories(
+      std::filesystem::path(path).parent_path());
+
+  BSPHullCacheHeader header;
+  header.magic = BSP_HULL_CACHE_MAGIC;
+  header.version = BSP_HULL_CACHE_VERSION;
+  header.contentHash = m_contentHash;
+  header.contentSize = m_contentSize;
+  header.hulls = hulls.size();
+  header.vertices = 0;
+  std::vector<uint32_t> counts;
+  std::vector<float> vertices;
+  for (auto& hull : hulls) {
+    counts.push_back(hull.size());
+    header.vertices += hull.size();
+    for (auto& vertex : hull) {
+      vertices.push_back(vertex.x());
+      vertices.push_back(vertex.y());
+      vertices.push_back(vertex.z());
     }
   }
-  Log::printf(LOG_DEBUG, "added %i brush bodies", rb_added);
+
+  // renamed into place so a reader never maps half a file
+  std::string temp = path + ".tmp";
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (!file) {
+    Log::printf(LOG_WARN, "Could not write hull cache %s", temp.c_str());
+    return;
+  }
+  bool written =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(counts.data(), sizeof(uint32_t), counts.size(), file) ==
+          counts.size() &&
+      fwrite(vertices.data(), sizeof(float), vertices.size(), file) ==
+          vertices.size();
+  fclose(file);
+  if (!written || std::rename(temp.c_str(), path.c_str())) {
+    Log::printf(LOG_WARN, "Could not write hull cache %s", path.c_str());
+    std::remove(temp.c_str());
+    return;
+  }
+  Log::printf(LOG_DEBUG, "Wrote %zu brush hulls to %s", hulls.size(),
+              path.c_str());
+}
+
+void BSPFile::getBrushHulls(std::vector<std::vector<btVector3>>& hulls) {
+  if (!map_hullcache.getBool()) {
+    computeBrushHulls(hulls);
+    return;
+  }
+
+  try {
+    if (readHullCache(hulls)) {
+      Log::printf(LOG_DEBUG, "Read %zu brush hulls from the cache",
+                  hulls.size());
+      return;
+    }
+    computeBrushHulls(hulls);
+    writeHullCache(hulls);
+  } catch (std::exception& e) {
+    // no data directory or no room, the cache is only an optimization
+    Log::printf(LOG_WARN, "Hull cache: %s", e.what());
+    if (hulls.empty()) computeBrushHulls(hulls);
+  }
+}
+
+void BSPFile::buildCollision(BSPCollisionMode mode, BSPCollision& collision) {
+  collision.clear();
+  std::vector<std::vector<btVector3>> hulls;
+  getBrushHulls(hulls);
+  if (hulls.empty()) return;
+
+  switch (mode) {
+    default:
+    case BSPCollisionBrushes:
+      for (auto& hull : hulls) {
+        btCollisionShape* shape =
+            new btConvexHullShape((btScalar*)hull.data(), hull.size());
+        collision.shapes.emplace_back(shape);
+        collision.bodies.emplace_back(new btRigidBody(0.0, NULL, shape));
+      }
+      break;
+    case BSPCollisionCompound: {
+      // the children are kept in a dynamic aabb tree, the broadphase only
+      // sees the one body
+      btCompoundShape* compound = new btCompoundShape(true, hulls.size());
+      for (auto& hull : hulls) {
+        btCollisionShape* shape =
+            new btConvexHullShape((btScalar*)hull.data(), hull.size());
+        collision.shapes.emplace_back(shape);
+        compound->addChildShape(btTransform::getIdentity(), shape);
+      }
+      collision.shapes.emplace_back(compound);
+      collision.bodies.emplace_back(new btRigidBody(0.0, NULL, compound));
+    } break;
+    case BSPCollisionMesh: {
+      collision.mesh.reset(new btTriangleMesh());
+      btConvexHullComputer computer;
+      for (auto& hull : hulls) {
+        computer.compute((btScalar*)hull.data(), sizeof(btVector3),
+                         hull.size(), 0.0, 0.0);
+        // each face of the hull fanned out from its first vertex
+        for (int i = 0; i < computer.faces.size(); i++) {
+          const btConvexHullComputer::Edge* first =
+              &computer.edges[computer.faces[i]];
+          const btConvexHullComputer::Edge* edge = first->getNextEdgeOfFace();
+          int a = first->getSourceVertex();
+          int b = edge->getSourceVertex();
+          for (edge = edge->getNextEdgeOfFace(); edge != first;
+               edge = edge->getNextEdgeOfFace()) {
+            int c = edge->getSourceVertex();
+            collision.mesh->addTriangle(computer.vertices[a],
+                                        computer.vertices[b],
+                                        computer.vertices[c]);
+            b = c;
+          }
+        }
+      }
+      btCollisionShape* shape =
+          new btBvhTriangleMeshShape(collision.mesh.get(), true);
+      collision.shapes.emplace_back(shape);
+      collision.bodies.emplace_back(new btRigidBody(0.0, NULL, shape));
+    } break;
+  }
+
+  for (auto& shape : collision.shapes) {
+    shape->setUserPointer(this);
+    shape->setUserIndex(PHYSICS_INDEX_WORLD);
+  }
+  for (auto& body : collision.bodies) {
+    body->setUserPointer(this);
+    body->setUserIndex(PHYSICS_INDEX_WORLD);
+  }
+}
+
+void BSPFile::addToPhysicsWorld(PhysicsWorld* world) {
+  BSPCollisionMode mode = (BSPCollisionMode)std::clamp(
+      map_collision.getInt(), 0, (int)BSPCollisionModeMax - 1);
+  // built before locking, the hulls take a while
+  buildCollision(mode, m_collision);
+
+  std::scoped_lock lock(world->mutex);
+  m_collision.addTo(world->getWorld());
+  Log::printf(LOG_DEBUG, "added %zu brush bodies (%s)",
+              m_collision.bodies.size(), getCollisionModeName(mode));
   m_physicsWorld = world;
 }
 
@@ -158,6 +158,34 @@ struct BSPModel {
   int n_brushes;
 };
 
+/**
+ * @brief How a map's brushes are turned into collision shapes.
+ */
+enum BSPCollisionMode {
+  BSPCollisionBrushes,   // a static body per brush
+  BSPCollisionCompound,  // one body, a compound of every brush's hull
+  BSPCollisionMesh,      // one body, a triangle mesh of every brush's faces
+  BSPCollisionModeMax,
+};
+
+const char* getCollisionModeName(BSPCollisionMode mode);
+
+/**
+ * @brief The static bodies a map adds to a physics world and the shapes they
+ * are made of.
+ */
+struct BSPCollision {
+  // destroyed after the shapes that point into it
+  std::unique_ptr<btTriangleMesh> mesh;
+  std::vector<std::unique_ptr<btCollisionShape>> shapes;
+  std::vector<std::unique_ptr<btRigidBody>> bodies;
+
+  // call with the physics mutex locked
+  void addTo(btDynamicsWorld* world);
+  void removeFrom(btDynamicsWorld* world);
+  void clear();
+};
+
 class BSPFile {
   struct BSPLeafModel {
     std::vector<BSPFaceModel> m_models;
@@ -170,13 +198,16 @@ class BSPFile {
   bool m_gfxEnabled;
   std::string m_name;
   PhysicsWorld* m_physicsWorld;
+  // crc32 and size of the file, keys the hull cache
+  uint32_t m_contentHash;
+  uint32_t m_contentSize;
 
   BSPHeader m_header;
   std::vector<BSPLeafModel> m_leafs;
   std::vector<BSPFaceModel> m_models;
   std::vector<BSPBrushModel> m_brushes;
   std::vector<std::unique_ptr<gfx::BaseTexture>> m_textures;
-  std::vector<btRigidBody*> m_brushBodies;
+  BSPCollision m_collision;
   glm::vec3 vecpos;
   int m_currentClusterIndex;
   int skyboxCluster;
@@ -193,6 +224,12 @@ class BSPFile {
   void renderFaceModel(gfx::RenderList& list, BSPFaceModel* model,
                        gfx::BaseProgram* program);
 
+  // computeBrushHulls through the cache in the local data directory
+  void getBrushHulls(std::vector<std::vector<btVector3>>& hulls);
+  std::string getHullCachePath();
+  bool readHullCache(std::vector<std::vector<btVector3>>& hulls);
+  void writeHullCache(const std::vector<std::vector<btVector3>>& hulls);
+
   gfx::Engine* engine;
 
  public:
@@ -202,8 +239,22 @@ class BSPFile {
   std::vector<BSPEntity> getEntities() { return entities; }
 
   std::unique_ptr<gfx::BaseArrayPointers> createModelLayout();
+  /**
+   * @brief Builds the map's collision in the mode map_collision picks and
+   * adds it to world.
+   */
   void addToPhysicsWorld(PhysicsWorld* world);
   void removeFromPhysicsWorld(PhysicsWorld* world);
+  /**
+   * @brief Builds the map's static bodies without adding them anywhere.
+   */
+  void buildCollision(BSPCollisionMode mode, BSPCollision& collision);
+  /**
+   * @brief The vertices of every brush's convex hull, from its planes.
+   * buildCollision reads them from a cache keyed by the file's content when
+   * map_hullcache is set, and only computes them on a miss.
+   */
+  void computeBrushHulls(std::vector<std::vector<btVector3>>& hulls);
   bool getUsingVis() { return m_useVis; }
   bool getGfxEnabled() { return m_gfxEnabled; }
   int getVisCluster() { return m_currentClusterIndex; }
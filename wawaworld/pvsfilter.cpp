@@ -0,0 +1,34 @@
+#include "pvsfilter.hpp"
+
+#include <algorithm>
+
+namespace ww {
+PvsRelevancyFilter::PvsRelevancyFilter(BSPFile* file) { this->file = file; }
+
+void PvsRelevancyFilter::update() {
+  GridRelevancyFilter::update();
+  clusters.clear();
+}
+
+// -1 is outside of the map or unknown, which canSeeCluster treats as visible
+int PvsRelevancyFilter::getCluster(net::Entity* entity) {
+  auto it = clusters.find(entity);
+  if (it != clusters.end()) return it->second;
+
+  glm::vec3 position;
+  int cluster = -1;
+  if (entity->getPosition(position)) cluster = file->getCluster(position);
+  clusters[entity] = cluster;
+  return cluster;
+}
+
+float PvsRelevancyFilter::getPriority(net::Entity* viewer,
+                                      net::Entity* entity) {
+  float priority = GridRelevancyFilter::getPriority(viewer, entity);
+  if (!viewer || !file->getUsingVis()) return priority;
+
+  if (file->canSeeCluster(getCluster(viewer), getCluster(entity)))
+    return std::max(priority, 0.25f);  // far but visible, e.g. through a scope
+  return priority * 0.25f;
+}
+}  // namespace ww
@@ -0,0 +1,26 @@
+#pragma once
+#include <unordered_map>
+
+#include "map.hpp"
+#include "network/relevancy.hpp"
+
+namespace net = rdm::network;
+namespace ww {
+/**
+ * @brief Grid relevancy that also checks the map's PVS. Entities in a cluster
+ * the viewer can see keep updating at long range, occluded ones update less
+ * often.
+ */
+class PvsRelevancyFilter : public net::GridRelevancyFilter {
+  BSPFile* file;
+  std::unordered_map<net::Entity*, int> clusters;
+
+  int getCluster(net::Entity* entity);
+
+ public:
+  PvsRelevancyFilter(BSPFile* file);
+
+  virtual void update();
+  virtual float getPriority(net::Entity* viewer, net::Entity* entity);
+};
+}  // namespace ww
@@ -8,6 +8,7 @@
 #include "network/network.hpp"
 #include "physics.hpp"
 #include "sound.hpp"
+#include "worldspawn.hpp"
 #include "wplayer.hpp"
 
 #define SHOT_DISTANCE 65535.0
@@ -49,7 +50,17 @@ void WeaponSniper::primaryFire() {
   btVector3 to =
       from + (getOwnerRef()->getController()->getFront() * SHOT_DISTANCE);
   btCollisionWorld::AllHitsRayResultCallback callback(from, to);
-  getWorld()->getPhysicsWorld()->getWorld()->rayTest(from, to, callback);
+  {
+    std::scoped_lock lock(getWorld()->getPhysicsWorld()->mutex);
+    // trace against where the shooter saw everyone else
+    Worldspawn* worldspawn = NULL;
+    if (getManager()->isBackend())
+      worldspawn = dynamic_cast<Worldspawn*>(
+          getManager()->findEntityByType("Worldspawn"));
+    if (worldspawn) worldspawn->rewindPlayers(getOwnerRef());
+    getWorld()->getPhysicsWorld()->getWorld()->rayTest(from, to, callback);
+    if (worldspawn) worldspawn->restorePlayers();
+  }
   rdm::Log::printf(rdm::LOG_DEBUG, "Hit %i, travelled %f%%",
                    callback.m_collisionObjects.size(),
                    callback.m_closestHitFraction * 100.0);
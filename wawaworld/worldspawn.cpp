@@ -1,8 +1,11 @@
 #pragma once
 #include "worldspawn.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <format>
+#include <random>
 
 #include "console.hpp"
 #include "fun.hpp"
@@ -11,12 +14,14 @@
 #include "network/bitstream.hpp"
 #include "physics.hpp"
 #include "putil/fpscontroller.hpp"
+#include "pvsfilter.hpp"
 #include "settings.hpp"
 #include "world.hpp"
 #include "wplayer.hpp"
 namespace ww {
 static rdm::CVar sv_nextmap("sv_nextmap", "ffa_naamda",
                             CVARF_NOTIFY | CVARF_SAVE | CVARF_REPLICATE);
+static rdm::CVar sv_maxunlag("sv_maxunlag", "0.5", CVARF_SAVE);
 
 static rdm::ConsoleCommand changelevel(
     "changelevel", "changelevel [map]", "changes level to map",
@@ -30,6 +35,88 @@ static rdm::ConsoleCommand changelevel(
       }
     });
 
+static rdm::ConsoleCommand bench_mapcollision(
+    "bench_mapcollision", "bench_mapcollision [map] [players] [steps]",
+    "times each map_collision mode with player capsules dropped on the "
+    "map's spawns",
+    [](Game* game, ConsoleArgReader r) {
+      std::string map = r.next();
+      int players = std::atoi(r.next().c_str());
+      int steps = std::atoi(r.next().c_str());
+      if (map.empty()) map = sv_nextmap.getValue();
+      if (players <= 0) players = 64;
+      if (steps <= 0) steps = 300;
+
+      BSPFile file(Worldspawn::mapPath(map).c_str());
+      std::vector<btVector3> spawns;
+      for (auto entity : file.getEntities())
+        if (entity.properties["classname"] == "info_player_deathmatch")
+          spawns.push_back(BulletHelpers::toVector3(
+              glm::vec3(Math::stringToVec4(entity.properties["origin"]))));
+      if (spawns.empty()) spawns.push_back(btVector3(0, 0, 0));
+
+      rdm::putil::FpsControllerSettings settings;
+      btCapsuleShapeZ capsule(settings.capsuleRadius, settings.capsuleHeight);
+      btVector3 inertia;
+      capsule.calculateLocalInertia(settings.capsuleMass, inertia);
+
+      Log::printf(LOG_INFO, "%s, %i players on %zu spawns, %i steps",
+                  map.c_str(), players, spawns.size(), steps);
+      for (int mode = 0; mode < BSPCollisionModeMax; mode++) {
+        PhysicsPipeline pipeline(false);
+        btDiscreteDynamicsWorld* world = pipeline.dynamicsWorld.get();
+        world->setGravity(btVector3(0, 0, -206.67));
+
+        BSPCollision collision;
+        auto start = std::chrono::steady_clock::now();
+        file.buildCollision((BSPCollisionMode)mode, collision);
+        double buildTime = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+        collision.addTo(world);
+
+        // stacked over the spawns, the same drop for every mode
+        std::mt19937 random(players);
+        std::uniform_real_distribution<float> jitter(-48.f, 48.f);
+        std::vector<std::unique_ptr<btRigidBody>> bodies;
+        for (int i = 0; i < players; i++) {
+          btTransform transform = btTransform::getIdentity();
+          transform.setOrigin(spawns[i % spawns.size()] +
+                              btVector3(jitter(random), jitter(random),
+                                        8.f + 96.f * (i / spawns.size())));
+          btRigidBody::btRigidBodyConstructionInfo info(
+              settings.capsuleMass, NULL, &capsule, inertia);
+          info.m_startWorldTransform = transform;
+          info.m_friction = 0.1;
+          bodies.emplace_back(new btRigidBody(info));
+          bodies.back()->setAngularFactor(btVector3(0, 0, 1));
+          world->addRigidBody(bodies.back().get());
+        }
+
+        double pairs = 0.0;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < steps; i++) {
+          world->stepSimulation(PHYSICS_FRAMERATE, 0);
+          pairs += world->getBroadphase()
+                       ->getOverlappingPairCache()
+                       ->getNumOverlappingPairs();
+        }
+        double stepTime = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+
+        Log::printf(LOG_INFO,
+                    "%s: %zu static bodies built in %0.1fms, %0.1f "
+                    "broadphase pairs, %0.3fms/step",
+                    getCollisionModeName((BSPCollisionMode)mode),
+                    collision.bodies.size(), buildTime * 1000.0,
+                    pairs / steps, stepTime * 1000.0 / steps);
+
+        for (auto& body : bodies) world->removeRigidBody(body.get());
+        collision.removeFrom(world);
+      }
+    });
+
 Worldspawn::Worldspawn(net::NetworkManager* manager, net::EntityId id)
     : net::Entity(manager, id) {
   file = NULL;
@@ -87,6 +174,8 @@ void Worldspawn::loadFile(const char* _file) {
   });
 
   if (getManager()->isBackend()) {
+    getManager()->setRelevancyFilter(new PvsRelevancyFilter(file));
+
     std::vector<BSPEntity> entities = file->getEntities();
     for (auto entity : entities) {
       if (entity.properties["classname"] == "info_player_deathmatch") {
@@ -104,6 +193,11 @@ void Worldspawn::destroyFile() {
     getGfxEngine()->deleteEntity(entity);
   }
 
+  if (getManager()->isBackend()) {
+    getManager()->setRelevancyFilter(NULL);
+    lagCompensation.clear();
+  }
+
   BSPFile* file = this->file;
   this->file = NULL;
   if (getWorld()->getRunning()) {
@@ -167,7 +261,7 @@ void Worldspawn::tick() {
       } else {
         getWorld()->setTitle("RDM: Lobby");
 
-        auto ents = getManager()->findEntitiesByType("WPlayer");
+        auto& ents = getManager()->findEntitiesByType("WPlayer");
         if (ents.size() == 0) setStatus(WaitingForPlayer);
 
         if (roundStartTime < getManager()->getDistributedTime()) {
@@ -191,7 +285,7 @@ void Worldspawn::tick() {
             "WaitingForPlayer on client worldspawn??? IMPOSSIBLE");
       } else {
         getWorld()->setTitle("RDM: Waiting for players");
-        auto players = getManager()->findEntitiesByType("WPlayer");
+        auto& players = getManager()->findEntitiesByType("WPlayer");
         if (players.size() != 0) setStatus(RoundBeginning);
       }
       break;
@@ -200,6 +294,7 @@ void Worldspawn::tick() {
         emitter->stop();
       else {
         getWorld()->setTitle("RDM: " + mapName);
+        if (file) recordPlayers();
       }
       break;
     case RoundEnding:
@@ -237,6 +332,46 @@ void Worldspawn::serialize(net::BitStream& stream) {
   }
 }
 
+void Worldspawn::recordPlayers() {
+  auto& players = getManager()->findEntitiesByType("WPlayer");
+  rdm::PhysicsWorld* physics = getWorld()->getPhysicsWorld();
+  lagCompensation.beginFrame(getManager()->getDistributedTime());
+  for (auto ent : players) {
+    WPlayer* player = dynamic_cast<WPlayer*>(ent);
+    // from the published step, so the physics mutex is not needed
+    btTransform transform;
+    if (physics->getLatestTransform(player->getController()->getRigidBody(),
+                                    transform))
+      lagCompensation.record(player->getEntityId(), transform);
+  }
+}
+
+void Worldspawn::rewindPlayers(WPlayer* shooter) {
+  float now = getManager()->getDistributedTime();
+  float time = shooter->getFireViewTime();
+  if (time <= 0.f) {
+    // not stamped (bots), the client sees about a round trip into the past
+    net::Peer* peer = getManager()->getPeerById(shooter->remotePeerId.get());
+    time = now;
+    if (peer && peer->peer) time -= peer->peer->roundTripTime / 1000.f;
+  }
+  // bounds how far a client lying about its view time can reach back
+  time = std::clamp(time, now - sv_maxunlag.getFloat(), now);
+
+  lagCompensation.rewind(
+      time, shooter->getEntityId(),
+      [this](int id) -> btCollisionObject* {
+        WPlayer* player =
+            dynamic_cast<WPlayer*>(getManager()->getEntityById(id));
+        return player ? player->getController()->getRigidBody() : NULL;
+      },
+      getWorld()->getPhysicsWorld()->getWorld());
+}
+
+void Worldspawn::restorePlayers() {
+  lagCompensation.restore(getWorld()->getPhysicsWorld()->getWorld());
+}
+
 glm::vec3 Worldspawn::spawnLocation() {
   if (!mapSpawnLocations.size()) {
     return glm::vec3(0, 0, 0);
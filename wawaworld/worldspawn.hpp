@@ -3,9 +3,11 @@
 #include "map.hpp"
 #include "network/bitstream.hpp"
 #include "network/entity.hpp"
+#include "putil/lagcompensation.hpp"
 #include "sound.hpp"
 namespace net = rdm::network;
 namespace ww {
+class WPlayer;
 class Worldspawn : public net::Entity {
   BSPFile* file;
   rdm::ClosureId worldJob;
@@ -19,8 +21,9 @@ class Worldspawn : public net::Entity {
   std::unique_ptr<rdm::SoundEmitter> emitter;
   std::vector<glm::vec3> mapSpawnLocations;
   int nextSpawnLocation;
+  rdm::putil::LagCompensation lagCompensation;
 
-  std::string mapPath(std::string name);
+  void recordPlayers();
 
  public:
   enum Status {
@@ -40,6 +43,8 @@ class Worldspawn : public net::Entity {
   void destroyFile();
   glm::vec3 spawnLocation();
 
+  static std::string mapPath(std::string name);
+
   Worldspawn(net::NetworkManager* manager, net::EntityId id);
   virtual ~Worldspawn();
 
@@ -59,6 +64,14 @@ class Worldspawn : public net::Entity {
 
   GameMode getGameMode() { return gameMode; }
 
+  /**
+   * @brief Moves every other player back to where shooter saw them when it
+   * fired. Call on the backend with the physics mutex locked, and
+   * restorePlayers() before unlocking it.
+   */
+  void rewindPlayers(WPlayer* shooter);
+  void restorePlayers();
+
  private:
   Status currentStatus;
   GameMode gameMode;
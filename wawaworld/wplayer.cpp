@@ -2,7 +2,9 @@
 
 #include <cmath>
 #include <cstdio>
+#include <format>
 #include <memory>
+#include <vector>
 
 #include "SDL_keycode.h"
 #include "console.hpp"
@@ -16,6 +18,7 @@
 #include "network/entity.hpp"
 #include "physics.hpp"
 #include "putil/fpscontroller.hpp"
+#include "scheduler.hpp"
 #include "settings.hpp"
 #include "sound.hpp"
 #include "wgame.hpp"
@@ -56,6 +59,12 @@ void WPlayer::listWeapons() {
   }
 }
 
+bool WPlayer::getPosition(glm::vec3& position) {
+  position = rdm::BulletHelpers::fromVector3(
+      controller->getTransform().getOrigin());
+  return true;
+}
+
 std::string WPlayer::getEntityInfo() {
   std::string r = Player::getEntityInfo();
   r += "\nWeapons:\n";
@@ -94,12 +103,74 @@ static ConsoleCommand player_give_weapon(
       player->giveWeapon(weapon);
     });
 
+// goes through WPlayer::tick so the numbers include whatever it does to the
+// controllers every tick, unlike bench_fpscontroller
+static ConsoleCommand bench_bots(
+    "bench_bots", "bench_bots [bots] [ticks]",
+    "adds bots to the server, reports how many player controllers stayed "
+    "awake and the physics step time, then removes them",
+    [](Game* game, ConsoleArgReader reader) {
+      World* world = game->getServerWorld();
+      if (!world) throw std::runtime_error("Must be hosting");
+      if (!world->getPhysicsWorld()) throw std::runtime_error("No physics");
+      int bots = std::atoi(reader.next().c_str());
+      int ticks = std::atoi(reader.next().c_str());
+      if (bots <= 0) bots = 64;
+      if (ticks <= 0) ticks = 300;
+
+      net::NetworkManager* manager = world->getNetworkManager();
+      struct State {
+        std::vector<net::EntityId> bots;
+        int tick = 0;
+        int ticks;
+        size_t awake = 0;
+        rdm::ClosureId listener;
+      };
+      std::shared_ptr<State> state = std::make_shared<State>();
+      state->ticks = ticks;
+      for (int i = 0; i < bots; i++) {
+        WPlayer* player =
+            dynamic_cast<WPlayer*>(manager->instantiate("WPlayer"));
+        if (!player) throw std::runtime_error("player == NULL");
+        player->remotePeerId.set(-2);
+        player->displayName.set(std::format("BenchBot{}", i));
+        state->bots.push_back(player->getEntityId());
+      }
+
+      // give them a second to spawn and land before counting
+      const int settle = 60;
+      state->listener = world->stepped.listen([world, manager, state] {
+        if (state->tick++ < settle) return;
+        rdm::PhysicsWorld* physics = world->getPhysicsWorld();
+        std::shared_ptr<rdm::putil::FpsControllerSystem> system =
+            rdm::putil::FpsControllerSystem::get(physics);
+        state->awake += system->getAwake();
+        if (state->tick < settle + state->ticks) return;
+
+        rdm::SchedulerJob* job = world->getScheduler()->getJob("Physics");
+        rdm::JobHistogram::Percentiles step =
+            job->getStats().stepTimes.getPercentiles();
+        Log::printf(LOG_INFO,
+                    "bench_bots: %i bots, %0.1f of %i controllers awake on "
+                    "average over %i ticks, physics step p50 %0.3fms, p99 "
+                    "%0.3fms",
+                    (int)state->bots.size(),
+                    (double)state->awake / state->ticks, (int)system->size(),
+                    state->ticks, step.p50 * 1000.0, step.p99 * 1000.0);
+
+        for (net::EntityId id : state->bots) manager->deleteEntity(id);
+        world->stepped.removeListener(state->listener);
+      });
+    });
+
 WPlayer::WPlayer(net::NetworkManager* manager, net::EntityId id)
     : Player(manager, id) {
   controller.reset(
       new rdm::putil::FpsController(manager->getWorld()->getPhysicsWorld()));
   controller->setUser(this);
   controller->setLocalPlayer(false);
+  if (!manager->isBackend())
+    controller->setClock([manager] { return manager->getClockTime(); });
   entityNode = new rdm::Graph::Node();
   entityNode->scale = glm::vec3(6.f);
   wantedWeaponId = getManager()->isBackend() ? -1 : 1;
@@ -107,6 +178,7 @@ WPlayer::WPlayer(net::NetworkManager* manager, net::EntityId id)
 
   firingState[0] = false;
   firingState[1] = false;
+  fireViewTime = 0.f;
   if (!getManager()->isBackend()) {
     soundEmitter.reset(getGame()->getSoundManager()->newEmitter());
     soundEmitter->node = entityNode;
@@ -127,9 +199,7 @@ WPlayer::WPlayer(net::NetworkManager* manager, net::EntityId id)
     });
     gfxJob = getGfxEngine()->renderStepped.listen([this] {
       {
-        std::scoped_lock lock(getWorld()->getPhysicsWorld()->mutex);
-        btTransform transform;
-        controller->getMotionState()->getWorldTransform(transform);
+        btTransform transform = controller->getInterpolatedTransform();
         entityNode->origin =
             rdm::BulletHelpers::fromVector3(transform.getOrigin());
         entityNode->basis = rdm::BulletHelpers::fromMat3(transform.getBasis()) *
@@ -313,6 +383,7 @@ void WPlayer::tick() {
         if (origin_old.distance(origin_new) > 0.1) needsUpdate = true;
         if (oldFront.distance(getController()->getFront()) > 0.1)
           needsUpdate = true;
+        if (controller->hasUnsentInputs()) needsUpdate = true;
 
         if (needsUpdate) {
           oldTransform = transform;
@@ -400,22 +471,44 @@ void WPlayer::deserialize(net::BitStream& stream) {
 void WPlayer::serializeUnreliable(net::BitStream& stream) {
   {
     std::scoped_lock lock(getWorld()->getPhysicsWorld()->mutex);
-    controller->serialize(stream);
+    // clients send their input, the server sends where it took them
+    if (stream.getContext() == net::BitStream::ToServerLocal)
+      controller->writeInputs(stream);
+    else
+      controller->serialize(stream, stream.getContext() ==
+                                        net::BitStream::ToClientLocal);
   }
 
-  stream.write<bool>(firingState[0]);
-  stream.write<bool>(firingState[1]);
+  // wawaworld/loadgen.cpp writes the same to the server, keep it in step
+  stream.writeBool(firingState[0]);
+  stream.writeBool(firingState[1]);
+  // stamped so the server can trace against what this client saw
+  if (stream.getContext() == net::BitStream::ToServerLocal &&
+      (firingState[0] || firingState[1]))
+    stream.write<float>(controller->getViewTime());
 }
 
 void WPlayer::deserializeUnreliable(net::BitStream& stream) {
   {
     std::scoped_lock lock(getWorld()->getPhysicsWorld()->mutex);
-    controller->deserialize(stream, getManager()->isBackend());
+    if (stream.getContext() == net::BitStream::FromClientLocal)
+      controller->readInputs(stream);
+    else
+      controller->deserialize(
+          stream, getManager()->isBackend(), getManager()->getPacketTime(),
+          stream.getContext() == net::BitStream::FromServerLocal);
   }
 
+  // always read so the entities after this one stay in sync
+  bool firing[2];
+  firing[0] = stream.readBool();
+  firing[1] = stream.readBool();
+  if (stream.getContext() == net::BitStream::FromClientLocal &&
+      (firing[0] || firing[1]))
+    fireViewTime = stream.read<float>();
   if (!isLocalPlayer()) {
-    firingState[0] = stream.read<bool>();
-    firingState[1] = stream.read<bool>();
+    firingState[0] = firing[0];
+    firingState[1] = firing[1];
   }
 }
 }  // namespace ww
@@ -34,6 +34,8 @@ class WPlayer : public net::Player {
   int maxArmor;
 
   bool firingState[2];
+  float fireViewTime;  // the owner's view time when it last fired, see
+                       // FpsController::getViewTime
 
   std::unique_ptr<rdm::SoundEmitter> soundEmitter;
 
@@ -58,6 +60,10 @@ class WPlayer : public net::Player {
   virtual void serialize(net::BitStream& stream);
   virtual void deserialize(net::BitStream& stream);
 
+  virtual bool getPosition(glm::vec3& position);
+
+  float getFireViewTime() { return fireViewTime; }
+
   virtual void serializeUnreliable(net::BitStream& stream);
   virtual void deserializeUnreliable(net::BitStream& stream);
   virtual const char* getTypeName() { return "WPlayer"; };
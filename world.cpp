@@ -109,7 +109,7 @@ World::~World() {
 
 void World::tick() {
   stepping.fire();
-
+  if (!tickGraph.empty()) tickGraph.run();
   stepped.fire();
 }
 
@@ -37,6 +37,7 @@ class World {
   std::unique_ptr<network::NetworkManager> networkManager;
   std::unique_ptr<Scheduler> scheduler;
   std::unique_ptr<script::Context> scriptContext;
+  TaskGraph tickGraph;
   void* user;
   Game* game;
   std::string title;
@@ -61,6 +62,13 @@ class World {
   Game* getGame() { return game; }
   script::Context* getScriptContext() { return scriptContext.get(); }
   Scheduler* getScheduler() { return scheduler.get(); }
+  /**
+   * @brief Tasks run every world tick between stepping and stepped.
+   *
+   * Independent systems can be added here with their dependencies instead of
+   * hooking stepping, so they run in parallel on the scheduler pool.
+   */
+  TaskGraph* getTickGraph() { return &tickGraph; }
   PhysicsWorld* getPhysicsWorld() { return physics.get(); }
   network::NetworkManager* getNetworkManager() { return networkManager.get(); }
   double getTime() { return time; };